@@ -1,20 +1,35 @@
+newoption {
+  trigger = "no-stats",
+  description = "Compile the tree's stats() counters out"
+}
+
 workspace "ConcurrentTreeSolution"
   architecture "x64"
   configurations { "Debug", "Release" }
   startproject "ConcurrencyTest"
-  system "windows"
-  toolset "msc"
   warnings "Extra"
   flags { "MultiProcessorCompile" }
   cppdialect "C++20"
   staticruntime "Off"
 
+  filter { "system:windows" }
+    toolset "msc"
+  filter {}
+
   -- VS aligned new
   filter { "action:vs*" }
     buildoptions { "/Zc:alignedNew" }
   filter {}
 
+  filter { "options:no-stats" }
+    defines { "SYNC_TREE_STATS=0" }
+  filter {}
+
   outputdir = "%{cfg.buildcfg}/%{cfg.architecture}"
 
   include "concurrent_tree/premake.lua"
-  include "test/premake.lua"
\ No newline at end of file
+  -- The unit tests link the Visual Studio CppUnitTestFramework, elsewhere only the library and the benchmark build.
+  if os.target() == "windows" then
+    include "test/premake.lua"
+  end
+  include "bench/premake.lua"
\ No newline at end of file
@@ -0,0 +1,415 @@
+// YCSB style benchmark for the concurrent tree. Every cell of workload x key distribution x thread count runs on
+// a fresh tree for a fixed time and prints one result row, as CSV (default) or JSON lines.
+//
+//   ConcurrentTreeBench [--keys N] [--seconds S] [--threads 1,2,4] [--workloads read,95/5,50/50,insert]
+//                       [--distributions uniform,zipfian,sequential] [--value-size B] [--shards N] [--hash-index]
+//                       [--relaxed-balance] [--combining] [--bplus] [--typed] [--capacity BYTES] [--fence LEVELS]
+//                       [--format csv|json]
+//
+// --typed runs a TypedTree<uint64_t, uint64_t> on the key ids, 8 byte keys and inline 8 byte values, against the
+// byte keyed tree's 16 byte keys and shared value buffers.
+#include "bplus.h"
+#include "concurrent.h"
+#include "sharded.h"
+#include "typed.h"
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+    using Clock = std::chrono::steady_clock;
+
+    struct Workload {
+        std::string name;
+        int read_percent; // the rest are puts
+        bool preload;
+    };
+
+    const Workload WORKLOADS[] = {
+        { "read", 100, true },  // YCSB C
+        { "95/5", 95, true },   // YCSB B
+        { "50/50", 50, true },  // YCSB A
+        { "insert", 0, false }, // load phase, starts from an empty tree
+    };
+
+    enum class Distribution { Uniform, Zipfian, Sequential };
+
+    struct Options {
+        uint64_t keys = 1'000'000;
+        double seconds = 2.0;
+        std::vector<unsigned> threads;
+        std::vector<Workload> workloads{ std::begin(WORKLOADS), std::end(WORKLOADS) };
+        std::vector<Distribution> distributions{ Distribution::Uniform, Distribution::Zipfian, Distribution::Sequential };
+        size_t value_size = 100;
+        size_t shards = 0; // 0 benchmarks a single ConcurrentTree
+        bool hash_index = false; // single tree with a HashIndex sized for the key count
+        bool relaxed = false;    // trees defer insert rebalancing to their maintainer thread
+        bool combining = false;  // trees apply puts through flat combining
+        bool bplus = false;      // BPlusTree instead of the red-black tree
+        bool typed = false;      // TypedTree with integer keys and inline values, --value-size is ignored
+        size_t capacity = 0;     // cache mode budget of the tree, split evenly across shards, 0 for unbounded
+        size_t fence = 0;        // levels of the trees' fence index, 0 for none
+        bool json = false;
+    };
+
+    const char* name(Distribution distribution) {
+        switch (distribution) {
+        case Distribution::Uniform: return "uniform";
+        case Distribution::Zipfian: return "zipfian";
+        default: return "sequential";
+        }
+    }
+
+    uint64_t splitmix64(uint64_t& state) {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    uint64_t fnv1a(uint64_t value) {
+        uint64_t hash = 0xCBF29CE484222325ull;
+        for (int i = 0; i < 8; i++) {
+            hash ^= (value >> (8 * i)) & 0xFF;
+            hash *= 0x100000001B3ull;
+        }
+        return hash;
+    }
+
+    // Zipfian ranks after Gray et al., "Quickly generating billion-record synthetic databases", as used by YCSB.
+    // Ranks are scrambled over the key space, so the hot keys are spread through the tree instead of clustered.
+    class Zipfian {
+    public:
+        Zipfian(uint64_t items, double theta = 0.99) : items(items), theta(theta), alpha(1.0 / (1.0 - theta)) {
+            zetan = zeta(items);
+            double zeta2 = zeta(2);
+            eta = (1.0 - std::pow(2.0 / double(items), 1.0 - theta)) / (1.0 - zeta2 / zetan);
+            half_pow_theta = 1.0 + std::pow(0.5, theta);
+        }
+
+        uint64_t next(uint64_t& state) const {
+            double u = double(splitmix64(state) >> 11) * 0x1.0p-53;
+            double uz = u * zetan;
+            uint64_t rank;
+            if (uz < 1.0) rank = 0;
+            else if (uz < half_pow_theta) rank = 1;
+            else rank = std::min<uint64_t>(items - 1, uint64_t(double(items) * std::pow(eta * u - eta + 1.0, alpha)));
+            return fnv1a(rank) % items;
+        }
+
+    private:
+        uint64_t items;
+        double theta, alpha, zetan, eta, half_pow_theta;
+
+        double zeta(uint64_t n) const {
+            double sum = 0;
+            for (uint64_t i = 1; i <= n; i++) sum += 1.0 / std::pow(double(i), theta);
+            return sum;
+        }
+    };
+
+    // Log linear latency histogram, 16 sub buckets per power of two, about 6% relative error.
+    class Histogram {
+    public:
+        void record(uint64_t ns) { counts[index(ns)]++; }
+
+        void merge(const Histogram& other) {
+            for (size_t i = 0; i < BUCKETS; i++) counts[i] += other.counts[i];
+        }
+
+        uint64_t percentile(double p) const {
+            uint64_t total = 0;
+            for (uint64_t count : counts) total += count;
+            if (!total) return 0;
+            uint64_t rank = uint64_t(std::ceil(p * double(total)));
+            uint64_t seen = 0;
+            for (size_t i = 0; i < BUCKETS; i++) {
+                seen += counts[i];
+                if (seen >= std::max<uint64_t>(rank, 1)) return lower_bound(i);
+            }
+            return lower_bound(BUCKETS - 1);
+        }
+
+    private:
+        static constexpr size_t BUCKETS = 32 + 59 * 16;
+        std::vector<uint64_t> counts = std::vector<uint64_t>(BUCKETS);
+
+        static size_t index(uint64_t ns) {
+            if (ns < 32) return ns;
+            unsigned top = std::bit_width(ns) - 1; // >= 5
+            return 32 + (top - 5) * 16 + ((ns >> (top - 4)) & 15);
+        }
+
+        static uint64_t lower_bound(size_t index) {
+            if (index < 32) return index;
+            unsigned top = unsigned(index - 32) / 16 + 5;
+            return (16 + (index - 32) % 16) << (top - 4);
+        }
+    };
+
+    // 16 byte keys, so the tree keeps them inline.
+    void format_key(uint64_t id, char (&key)[17]) {
+        std::snprintf(key, sizeof(key), "user%012llu", static_cast<unsigned long long>(id % 1'000'000'000'000ull));
+    }
+
+    // One interface over the plain tree, the typed tree, the sharded tree and the B+tree, so a cell runs the same loop
+    // against each. The typed tree is keyed by id, the others by its formatted key.
+    class Engine {
+    public:
+        explicit Engine(const Options& options) {
+            if (options.bplus) bplus = std::make_unique<sync::BPlusTree>();
+            else if (options.typed) typed = std::make_unique<sync::TypedTree<uint64_t, uint64_t>>();
+            else if (options.shards) sharded = std::make_unique<sync::ShardedConcurrentTree>(options.shards);
+            else if (options.hash_index) tree = std::make_unique<sync::ConcurrentTree>(std::make_unique<sync::HashIndex>(2 * options.keys));
+            else tree = std::make_unique<sync::ConcurrentTree>();
+            sync::ConcurrentTree* single = typed ? &typed->bytes() : tree.get();
+            if (single && options.relaxed) single->setBalance(sync::ConcurrentTree::Balance::Relaxed);
+            if (single && options.combining) single->setCombining(true);
+            if (single && options.capacity) single->setCapacity(options.capacity);
+            if (single && options.fence) single->setFence(options.fence);
+            for (size_t i = 0; sharded && i < sharded->shard_count(); i++) {
+                if (options.relaxed) sharded->shard(i).setBalance(sync::ConcurrentTree::Balance::Relaxed);
+                if (options.combining) sharded->shard(i).setCombining(true);
+                if (options.capacity) sharded->shard(i).setCapacity(std::max<size_t>(1, options.capacity / sharded->shard_count()));
+                if (options.fence) sharded->shard(i).setFence(options.fence);
+            }
+        }
+        void put(uint64_t id, std::span<const unsigned char> key, const sync::Value& value) {
+            if (tree) tree->put(key, value);
+            else if (typed) typed->put(id, id);
+            else if (bplus) bplus->put(key, value);
+            else sharded->put(key, value);
+        }
+        bool find(uint64_t id, std::span<const unsigned char> key) {
+            if (typed) return typed->get(id).has_value();
+            return (tree ? tree->find(key) : bplus ? bplus->find(key) : sharded->find(key)) != nullptr;
+        }
+        sync::TreeStats stats() {
+            if (tree) return tree->stats();
+            if (typed) return typed->stats();
+            if (bplus) return bplus->stats();
+            sync::TreeStats total;
+            for (const sync::ShardStats& shard : sharded->stats()) {
+                total.restarts += shard.tree.restarts;
+                total.rotation_retries += shard.tree.rotation_retries;
+                total.lock_waits += shard.tree.lock_waits;
+                total.height = std::max(total.height, shard.tree.height);
+            }
+            return total;
+        }
+    private:
+        std::unique_ptr<sync::ConcurrentTree> tree;
+        std::unique_ptr<sync::TypedTree<uint64_t, uint64_t>> typed;
+        std::unique_ptr<sync::BPlusTree> bplus;
+        std::unique_ptr<sync::ShardedConcurrentTree> sharded;
+    };
+
+    struct Result {
+        uint64_t ops = 0;
+        uint64_t misses = 0;
+        double seconds = 0;
+        Histogram latency;
+        sync::TreeStats stats;
+    };
+
+    void preload(Engine& engine, uint64_t keys, const sync::Value& value, unsigned threads) {
+        // Random insertion order, a sorted load would only measure the rebalancing of a degenerate spine.
+        std::vector<uint64_t> ids(keys);
+        for (uint64_t i = 0; i < keys; i++) ids[i] = i;
+        std::shuffle(ids.begin(), ids.end(), std::mt19937_64(42));
+        std::vector<std::thread> loaders;
+        for (unsigned t = 0; t < threads; t++) {
+            loaders.emplace_back([&, t] {
+                char key[17];
+                for (uint64_t i = t; i < keys; i += threads) {
+                    format_key(ids[i], key);
+                    engine.put(ids[i], bytes(key), value);
+                }
+            });
+        }
+        for (auto& loader : loaders) loader.join();
+    }
+
+    Result run(const Options& options, const Workload& workload, Distribution distribution, unsigned threads, const Zipfian& zipfian) {
+        Engine engine(options);
+        auto value = std::make_shared<const std::vector<unsigned char>>(options.value_size, 'v');
+        if (workload.preload) preload(engine, options.keys, value, std::max(1u, std::thread::hardware_concurrency()));
+
+        std::atomic<unsigned> ready{ 0 };
+        std::atomic<bool> start{ false }, stop{ false };
+        std::vector<Result> results(threads);
+        std::vector<std::thread> workers;
+        for (unsigned t = 0; t < threads; t++) {
+            workers.emplace_back([&, t] {
+                Result& result = results[t];
+                uint64_t state = 0x51ED270B27ull * (t + 1);
+                uint64_t sequence = options.keys / threads * t; // each thread walks its own stretch
+                char key[17];
+                ready.fetch_add(1);
+                while (!start.load(std::memory_order_acquire)) std::this_thread::yield();
+
+                while (!stop.load(std::memory_order_relaxed)) {
+                    uint64_t id;
+                    switch (distribution) {
+                    case Distribution::Uniform: id = splitmix64(state) % options.keys; break;
+                    case Distribution::Zipfian: id = zipfian.next(state); break;
+                    default: id = sequence++ % options.keys; break;
+                    }
+                    format_key(id, key);
+                    bool read = int(splitmix64(state) % 100) < workload.read_percent;
+
+                    auto begin = Clock::now();
+                    if (read) result.misses += !engine.find(id, bytes(key));
+                    else engine.put(id, bytes(key), value);
+                    auto end = Clock::now();
+                    result.latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+                    result.ops++;
+                }
+            });
+        }
+
+        while (ready.load() < threads) std::this_thread::yield();
+        auto begin = Clock::now();
+        start.store(true, std::memory_order_release);
+        std::this_thread::sleep_for(std::chrono::duration<double>(options.seconds));
+        stop.store(true);
+        for (auto& worker : workers) worker.join();
+
+        Result total;
+        total.seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+        for (const Result& result : results) {
+            total.ops += result.ops;
+            total.misses += result.misses;
+            total.latency.merge(result.latency);
+        }
+        total.stats = engine.stats();
+        return total;
+    }
+
+    void print(const Options& options, const Workload& workload, Distribution distribution, unsigned threads, const Result& result) {
+        double throughput = double(result.ops) / result.seconds;
+        unsigned long long p50 = result.latency.percentile(0.50), p99 = result.latency.percentile(0.99),
+            p999 = result.latency.percentile(0.999);
+        std::string kind = options.bplus ? "bplus" : options.typed ? "typed" : options.shards ? "sharded" : options.hash_index ? "indexed" : "tree";
+        if (options.relaxed) kind += "-relaxed";
+        if (options.combining) kind += "-combining";
+        if (options.capacity && !options.bplus) kind += "-cache";
+        if (options.fence && !options.bplus) kind += "-fence";
+        const char* engine = kind.c_str();
+        if (options.json) {
+            std::printf("{\"engine\":\"%s\",\"shards\":%zu,\"workload\":\"%s\",\"distribution\":\"%s\",\"threads\":%u,\"keys\":%llu,"
+                "\"seconds\":%.3f,\"ops\":%llu,\"ops_per_sec\":%.0f,\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,"
+                "\"misses\":%llu,\"restarts\":%llu,\"rotation_retries\":%llu,\"lock_waits\":%llu}\n",
+                engine, options.shards, workload.name.c_str(), name(distribution), threads, (unsigned long long)options.keys,
+                result.seconds, (unsigned long long)result.ops, throughput, p50, p99, p999, (unsigned long long)result.misses,
+                (unsigned long long)result.stats.restarts, (unsigned long long)result.stats.rotation_retries,
+                (unsigned long long)result.stats.lock_waits);
+        }
+        else {
+            std::printf("%s,%zu,%s,%s,%u,%llu,%.3f,%llu,%.0f,%llu,%llu,%llu,%llu,%llu,%llu,%llu\n",
+                engine, options.shards, workload.name.c_str(), name(distribution), threads, (unsigned long long)options.keys,
+                result.seconds, (unsigned long long)result.ops, throughput, p50, p99, p999, (unsigned long long)result.misses,
+                (unsigned long long)result.stats.restarts, (unsigned long long)result.stats.rotation_retries,
+                (unsigned long long)result.stats.lock_waits);
+        }
+        std::fflush(stdout);
+    }
+
+    std::vector<std::string> split(const std::string& list) {
+        std::vector<std::string> items;
+        size_t begin = 0;
+        while (begin <= list.size()) {
+            size_t end = list.find(',', begin);
+            if (end == std::string::npos) end = list.size();
+            if (end > begin) items.push_back(list.substr(begin, end - begin));
+            begin = end + 1;
+        }
+        return items;
+    }
+
+    [[noreturn]] void usage(const char* message) {
+        std::fprintf(stderr, "%s\nusage: ConcurrentTreeBench [--keys N] [--seconds S] [--threads 1,2,4] "
+            "[--workloads read,95/5,50/50,insert] [--distributions uniform,zipfian,sequential] [--value-size B] "
+            "[--shards N] [--hash-index] [--relaxed-balance] [--combining] [--bplus] [--typed] [--capacity BYTES] [--fence LEVELS] [--format csv|json]\n", message);
+        std::exit(2);
+    }
+
+    Options parse_options(int argc, char** argv) {
+        Options options;
+        for (int i = 1; i < argc; i++) {
+            std::string flag = argv[i];
+            // Switches, the only flags without a value.
+            if (flag == "--hash-index" || flag == "--relaxed-balance" || flag == "--combining" || flag == "--bplus" || flag == "--typed") {
+                (flag == "--hash-index" ? options.hash_index : flag == "--relaxed-balance" ? options.relaxed
+                    : flag == "--combining" ? options.combining : flag == "--bplus" ? options.bplus : options.typed) = true;
+                continue;
+            }
+            if (i + 1 >= argc) usage(("missing value for " + flag).c_str());
+            std::string value = argv[++i];
+            if (flag == "--keys") options.keys = std::max<uint64_t>(1, std::strtoull(value.c_str(), nullptr, 10));
+            else if (flag == "--seconds") options.seconds = std::atof(value.c_str());
+            else if (flag == "--value-size") options.value_size = std::strtoull(value.c_str(), nullptr, 10);
+            else if (flag == "--shards") options.shards = std::strtoull(value.c_str(), nullptr, 10);
+            else if (flag == "--capacity") options.capacity = std::strtoull(value.c_str(), nullptr, 10);
+            else if (flag == "--fence") options.fence = std::strtoull(value.c_str(), nullptr, 10);
+            else if (flag == "--format") options.json = value == "json";
+            else if (flag == "--threads") {
+                for (const std::string& item : split(value)) options.threads.push_back(std::max(1, std::atoi(item.c_str())));
+            }
+            else if (flag == "--workloads") {
+                options.workloads.clear();
+                for (const std::string& item : split(value)) {
+                    auto found = std::find_if(std::begin(WORKLOADS), std::end(WORKLOADS), [&](const Workload& w) { return w.name == item; });
+                    if (found == std::end(WORKLOADS)) usage(("unknown workload " + item).c_str());
+                    options.workloads.push_back(*found);
+                }
+            }
+            else if (flag == "--distributions") {
+                options.distributions.clear();
+                for (const std::string& item : split(value)) {
+                    if (item == "uniform") options.distributions.push_back(Distribution::Uniform);
+                    else if (item == "zipfian") options.distributions.push_back(Distribution::Zipfian);
+                    else if (item == "sequential") options.distributions.push_back(Distribution::Sequential);
+                    else usage(("unknown distribution " + item).c_str());
+                }
+            }
+            else usage(("unknown option " + flag).c_str());
+        }
+        if (options.threads.empty()) {
+            // Powers of two up to the core count, and the core count itself.
+            unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+            for (unsigned t = 1; t < cores; t *= 2) options.threads.push_back(t);
+            options.threads.push_back(cores);
+        }
+        return options;
+    }
+}
+
+int main(int argc, char** argv) {
+    Options options = parse_options(argc, argv);
+    Zipfian zipfian(options.keys);
+
+    if (!options.json) {
+        std::printf("engine,shards,workload,distribution,threads,keys,seconds,ops,ops_per_sec,p50_ns,p99_ns,p999_ns,"
+            "misses,restarts,rotation_retries,lock_waits\n");
+    }
+    for (const Workload& workload : options.workloads) {
+        for (Distribution distribution : options.distributions) {
+            for (unsigned threads : options.threads) {
+                print(options, workload, distribution, threads, run(options, workload, distribution, threads, zipfian));
+            }
+        }
+    }
+    return 0;
+}
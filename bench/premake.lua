@@ -0,0 +1,25 @@
+project "ConcurrentTreeBench"
+  kind "ConsoleApp"
+  language "C++"
+  cppdialect "C++20"
+
+  targetdir ("bin/" .. outputdir .. "/%{prj.name}")
+  objdir    ("bin-int/" .. outputdir .. "/%{prj.name}")
+
+  files { "bench.cpp" }
+
+  includedirs { "../concurrent_tree" }
+
+  links { "ConcurrentTree" }
+
+  filter "system:linux"
+    links { "pthread" }
+  filter {}
+
+  filter "configurations:Debug"
+    defines { "DEBUG" }
+    symbols "On"
+
+  filter "configurations:Release"
+    defines { "NDEBUG" }
+    optimize "Speed"
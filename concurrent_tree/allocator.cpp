@@ -0,0 +1,177 @@
+#include "allocator.h"
+
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <functional>
+#include <new>
+#include <thread>
+#include <vector>
+
+namespace sync {
+    void* HeapAllocator::allocate_node(size_t size, size_t alignment) {
+        return ::operator new(size, std::align_val_t(alignment));
+    }
+
+    void HeapAllocator::release_node(void* node, size_t size, size_t alignment) {
+        ::operator delete(node, size, std::align_val_t(alignment));
+    }
+
+    unsigned char* HeapAllocator::allocate_bytes(size_t size) {
+        return size ? new unsigned char[size] : nullptr;
+    }
+
+    void HeapAllocator::release_bytes(unsigned char* bytes, size_t) {
+        delete[] bytes;
+    }
+
+    static constexpr size_t round_up(size_t value, size_t alignment) {
+        return (value + alignment - 1) / alignment * alignment;
+    }
+
+    // Slots never share a cache line.
+    static constexpr size_t line_alignment(size_t alignment) {
+        return alignment < 64 ? 64 : alignment;
+    }
+
+    // Smallest class is 16 bytes, so a freed block always fits the free list link.
+    static inline size_t size_class(size_t size) {
+        return size <= 16 ? 0 : std::bit_width(size - 1) - 4;
+    }
+
+    SlabAllocator::SlabAllocator(size_t slot_size, size_t slot_alignment)
+        : slot_size(round_up(slot_size, line_alignment(slot_alignment))), slot_alignment(line_alignment(slot_alignment)),
+        first_slot(round_up(sizeof(Slab), line_alignment(slot_alignment))),
+        slots_per_slab((SLAB_BYTES - first_slot) / this->slot_size) {
+        assert(slots_per_slab > 0 && slots_per_slab <= sizeof(Slab::live) * 8);
+    }
+
+    SlabAllocator::~SlabAllocator() {
+        free_memory();
+    }
+
+    SlabAllocator::Shard& SlabAllocator::local_shard() {
+        static thread_local const size_t hint = std::hash<std::thread::id>{}(std::this_thread::get_id()) % SHARDS;
+        return shards[hint];
+    }
+
+    SlabAllocator::Slab* SlabAllocator::slab_of(void* node) const {
+        // Slabs are aligned to their size, the header sits at the start of the block.
+        return reinterpret_cast<Slab*>(reinterpret_cast<uintptr_t>(node) & ~(uintptr_t)(SLAB_BYTES - 1));
+    }
+
+    size_t SlabAllocator::slot_index(Slab* slab, void* node) const {
+        return (static_cast<unsigned char*>(node) - reinterpret_cast<unsigned char*>(slab) - first_slot) / slot_size;
+    }
+
+    void* SlabAllocator::allocate_node(size_t size, size_t alignment) {
+        assert(size <= slot_size && alignment <= slot_alignment);
+        (void)size; (void)alignment;
+        Shard& shard = local_shard();
+        std::lock_guard<std::mutex> guard(shard.lock);
+
+        void* node;
+        if (shard.free_nodes) {
+            node = shard.free_nodes;
+            shard.free_nodes = shard.free_nodes->next;
+        }
+        else {
+            if (!shard.slabs || shard.slab_used == slots_per_slab) {
+                Slab* slab = static_cast<Slab*>(::operator new(SLAB_BYTES, std::align_val_t(SLAB_BYTES)));
+                slab->next = shard.slabs;
+                slab->owner = &shard;
+                std::fill(std::begin(slab->live), std::end(slab->live), 0);
+                shard.slabs = slab;
+                shard.slab_used = 0;
+            }
+            node = reinterpret_cast<unsigned char*>(shard.slabs) + first_slot + shard.slab_used++ * slot_size;
+        }
+
+        Slab* slab = slab_of(node);
+        size_t index = slot_index(slab, node);
+        slab->live[index / 64] |= 1ull << (index % 64);
+        return node;
+    }
+
+    void SlabAllocator::release_node(void* node, size_t, size_t) {
+        // Slots return to the shard that carved them, which guards the slab's live bitmap.
+        Slab* slab = slab_of(node);
+        Shard& shard = *slab->owner;
+        std::lock_guard<std::mutex> guard(shard.lock);
+        size_t index = slot_index(slab, node);
+        slab->live[index / 64] &= ~(1ull << (index % 64));
+        FreeBlock* block = static_cast<FreeBlock*>(node);
+        block->next = shard.free_nodes;
+        shard.free_nodes = block;
+    }
+
+    unsigned char* SlabAllocator::allocate_bytes(size_t size) {
+        if (!size) return nullptr;
+        size_t cls = size_class(size);
+        if (cls >= SIZE_CLASSES) return new unsigned char[size];
+
+        Shard& shard = local_shard();
+        std::lock_guard<std::mutex> guard(shard.lock);
+        if (FreeBlock* block = shard.free_bytes[cls]) {
+            shard.free_bytes[cls] = block->next;
+            return reinterpret_cast<unsigned char*>(block);
+        }
+
+        size_t bytes = size_t(16) << cls;
+        if (!shard.chunk || shard.chunk_used + bytes > SLAB_BYTES) {
+            shard.chunk = new unsigned char[SLAB_BYTES];
+            shard.chunk_used = 0;
+            std::lock_guard<std::mutex> chunks_guard(chunks_lock);
+            chunks.push_back(shard.chunk);
+        }
+        unsigned char* block = shard.chunk + shard.chunk_used;
+        shard.chunk_used += bytes;
+        return block;
+    }
+
+    void SlabAllocator::release_bytes(unsigned char* bytes, size_t size) {
+        if (!bytes) return;
+        size_t cls = size_class(size);
+        if (cls >= SIZE_CLASSES) {
+            delete[] bytes;
+            return;
+        }
+        Shard& shard = local_shard();
+        std::lock_guard<std::mutex> guard(shard.lock);
+        FreeBlock* block = reinterpret_cast<FreeBlock*>(bytes);
+        block->next = shard.free_bytes[cls];
+        shard.free_bytes[cls] = block;
+    }
+
+    bool SlabAllocator::release_all(Destroy destroy, void* context) {
+        // Teardown only, no thread may allocate concurrently. Sweeps the live bitmaps slab by slab.
+        for (Shard& shard : shards) {
+            for (Slab* slab = shard.slabs; slab; slab = slab->next) {
+                for (size_t word = 0; word < std::size(slab->live); ++word) {
+                    for (uint64_t bits = slab->live[word]; bits; bits &= bits - 1) {
+                        size_t index = word * 64 + std::countr_zero(bits);
+                        destroy(reinterpret_cast<unsigned char*>(slab) + first_slot + index * slot_size, context);
+                    }
+                }
+            }
+        }
+        free_memory();
+        return true;
+    }
+
+    void SlabAllocator::free_memory() {
+        for (Shard& shard : shards) {
+            while (Slab* slab = shard.slabs) {
+                shard.slabs = slab->next;
+                ::operator delete(slab, std::align_val_t(SLAB_BYTES));
+            }
+            shard.slab_used = 0;
+            shard.free_nodes = nullptr;
+            shard.chunk = nullptr;
+            shard.chunk_used = 0;
+            std::fill(std::begin(shard.free_bytes), std::end(shard.free_bytes), nullptr);
+        }
+        for (unsigned char* chunk : chunks) delete[] chunk;
+        chunks.clear();
+    }
+}
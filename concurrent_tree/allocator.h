@@ -0,0 +1,90 @@
+#pragma once
+
+#include "platform.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace sync {
+
+    // Source of node slots and key bytes for a tree. A tree owns its allocator, nodes are released through it
+    // once the epoch domain proves no reader can reach them.
+    class NodeAllocator {
+    public:
+        using Destroy = void(*)(void* node, void* context);
+
+        virtual ~NodeAllocator() = default;
+        virtual void* allocate_node(size_t size, size_t alignment) = 0;
+        virtual void release_node(void* node, size_t size, size_t alignment) = 0;
+        virtual unsigned char* allocate_bytes(size_t size) = 0;
+        virtual void release_bytes(unsigned char* bytes, size_t size) = 0;
+        // Runs destroy on every live node, then frees everything in bulk. Allocators that can't enumerate
+        // their nodes return false and leave the tree to release them one by one.
+        virtual bool release_all(Destroy, void*) { return false; }
+    };
+
+    // Plain operator new / delete, one allocation per node and per key.
+    class HeapAllocator : public NodeAllocator {
+    public:
+        void* allocate_node(size_t size, size_t alignment) override;
+        void release_node(void* node, size_t size, size_t alignment) override;
+        unsigned char* allocate_bytes(size_t size) override;
+        void release_bytes(unsigned char* bytes, size_t size) override;
+    };
+
+    // Cache line aligned node slots carved out of 64KiB slabs, and key bytes bump allocated from 64KiB chunks
+    // with size class free lists so erased keys are recycled. State is split into shards picked per thread, so
+    // concurrent writers take disjoint, uncontended locks.
+    class SlabAllocator : public NodeAllocator {
+    public:
+        static constexpr size_t SLAB_BYTES = 64 * 1024;
+        static constexpr size_t SHARDS = 32;
+        static constexpr size_t SIZE_CLASSES = 8; // 16 .. 2048 bytes, larger keys go to the heap
+
+        SlabAllocator(size_t slot_size, size_t slot_alignment);
+        ~SlabAllocator() override;
+        SlabAllocator(const SlabAllocator&) = delete;
+        SlabAllocator& operator=(const SlabAllocator&) = delete;
+
+        void* allocate_node(size_t size, size_t alignment) override;
+        void release_node(void* node, size_t size, size_t alignment) override;
+        unsigned char* allocate_bytes(size_t size) override;
+        void release_bytes(unsigned char* bytes, size_t size) override;
+        bool release_all(Destroy destroy, void* context) override;
+
+    private:
+        struct FreeBlock { FreeBlock* next; };
+        struct Shard;
+
+        struct Slab {
+            Slab* next;
+            Shard* owner;
+            uint64_t live[SLAB_BYTES / 64 / 64]; // one bit per slot, slots are at least a cache line
+        };
+
+        struct alignas(64) Shard {
+            std::mutex lock;
+            Slab* slabs = nullptr;          // newest first, the head is the one being bumped
+            size_t slab_used = 0;           // slots handed out of the head slab
+            FreeBlock* free_nodes = nullptr;
+            unsigned char* chunk = nullptr; // current key byte chunk
+            size_t chunk_used = 0;
+            FreeBlock* free_bytes[SIZE_CLASSES] = {};
+        };
+
+        const size_t slot_size;
+        const size_t slot_alignment;
+        const size_t first_slot;
+        const size_t slots_per_slab;
+        Shard shards[SHARDS];
+        std::mutex chunks_lock;
+        std::vector<unsigned char*> chunks;
+
+        Shard& local_shard();
+        Slab* slab_of(void* node) const;
+        size_t slot_index(Slab* slab, void* node) const;
+        void free_memory();
+    };
+}
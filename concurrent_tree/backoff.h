@@ -0,0 +1,40 @@
+#pragma once
+
+#include "platform.h"
+
+#include <cstdint>
+#include <thread>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#endif
+
+namespace sync {
+
+    inline void cpu_relax() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        _mm_pause();
+#elif defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#elif defined(__aarch64__)
+        asm volatile("yield");
+#endif
+    }
+
+    // Adaptive wait for short critical sections: pause spins doubling up to a limit, then yield the core
+    // instead of parking in the kernel.
+    class Backoff {
+    public:
+        void pause() {
+            if (spins > SPIN_LIMIT) {
+                std::this_thread::yield();
+                return;
+            }
+            for (uint32_t i = 0; i < spins; i++) cpu_relax();
+            spins <<= 1;
+        }
+    private:
+        static constexpr uint32_t SPIN_LIMIT = 64;
+        uint32_t spins = 1;
+    };
+}
@@ -0,0 +1,370 @@
+#include "bplus.h"
+#include "backoff.h"
+
+#include <new>
+
+namespace sync {
+    BPlusTree::BPlusTree() : root(new Leaf()) {}
+
+    BPlusTree::~BPlusTree() {
+        // No thread may be inside the tree anymore.
+        epoch.drain();
+        destroy(root.load(std::memory_order_acquire));
+    }
+
+    void BPlusTree::destroy(Page* page) {
+        // Slots past count are stale copies, every entry and separator is owned by exactly one live slot.
+        uint32_t count = page->count.load(std::memory_order_relaxed);
+        if (!page->level) {
+            Leaf* leaf = static_cast<Leaf*>(page);
+            for (uint32_t i = 0; i < count; i++) reclaim_entry(leaf->entries[i].load(std::memory_order_relaxed), nullptr);
+            delete leaf;
+            return;
+        }
+        Inner* inner = static_cast<Inner*>(page);
+        for (uint32_t i = 0; i < count; i++) reclaim_entry(inner->entries[i].load(std::memory_order_relaxed), nullptr);
+        for (uint32_t i = 0; i <= count; i++) destroy(inner->children[i].load(std::memory_order_relaxed));
+        delete inner;
+    }
+
+    uint64_t BPlusTree::stable_version(Page* page) {
+        Backoff backoff;
+        while (true) {
+            uint64_t version = page->version.load(std::memory_order_acquire);
+            if (!(version & 1u)) return version;
+            backoff.pause();
+        }
+    }
+
+    BPlusTree::Entry* BPlusTree::make_entry(std::span<const unsigned char> key, Value value) {
+        Entry* entry = new (::operator new(sizeof(Entry) + key.size())) Entry{ std::move(value), uint32_t(key.size()) };
+        if (!key.empty()) std::memcpy(reinterpret_cast<unsigned char*>(entry + 1), key.data(), key.size());
+        return entry;
+    }
+
+    void BPlusTree::reclaim_entry(void* entry, void*) {
+        static_cast<Entry*>(entry)->~Entry();
+        ::operator delete(entry);
+    }
+
+    int BPlusTree::compare(std::span<const unsigned char> a, std::span<const unsigned char> b) {
+        size_t common = std::min(a.size(), b.size());
+        int order = common ? std::memcmp(a.data(), b.data(), common) : 0;
+        if (order != 0) return order;
+        return (a.size() > b.size()) - (a.size() < b.size());
+    }
+
+    template <class P>
+    uint32_t BPlusTree::rank(const P& page, uint32_t count, const Probe& probe, bool inclusive) {
+        uint32_t lo = 0, hi = count;
+        while (lo < hi) {
+            uint32_t mid = (lo + hi) / 2;
+            uint64_t high = page.heads[2 * mid].load(std::memory_order_acquire);
+            uint64_t low = page.heads[2 * mid + 1].load(std::memory_order_acquire);
+            int order;
+            if (high != probe.head.high) order = high < probe.head.high ? -1 : 1;
+            else if (low != probe.head.low) order = low < probe.head.low ? -1 : 1;
+            else { // the first 16 bytes tie, only now the key itself is read
+                Entry* entry = page.entries[mid].load(std::memory_order_acquire);
+                order = entry ? compare(entry->key(), probe.bytes) : 0;
+            }
+            if (order < 0 || (inclusive && order == 0)) lo = mid + 1;
+            else hi = mid;
+        }
+        return lo;
+    }
+
+    BPlusTree::Entry* BPlusTree::matching(const Leaf& leaf, uint32_t slot, uint32_t count, const Probe& probe) {
+        if (slot >= count || leaf.heads[2 * slot].load(std::memory_order_acquire) != probe.head.high
+            || leaf.heads[2 * slot + 1].load(std::memory_order_acquire) != probe.head.low) return nullptr;
+        Entry* entry = leaf.entries[slot].load(std::memory_order_acquire);
+        return entry && compare(entry->key(), probe.bytes) == 0 ? entry : nullptr;
+    }
+
+    template <class To, class From>
+    void BPlusTree::copy_slot(To& to, uint32_t at, const From& from, uint32_t slot) {
+        to.heads[2 * at].store(from.heads[2 * slot].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        to.heads[2 * at + 1].store(from.heads[2 * slot + 1].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        to.entries[at].store(from.entries[slot].load(std::memory_order_relaxed), std::memory_order_relaxed);
+    }
+
+    template <class P>
+    void BPlusTree::set_slot(P& page, uint32_t at, const Head& head, Entry* entry) {
+        page.heads[2 * at].store(head.high, std::memory_order_relaxed);
+        page.heads[2 * at + 1].store(head.low, std::memory_order_relaxed);
+        page.entries[at].store(entry, std::memory_order_relaxed);
+    }
+
+    void BPlusTree::prefetch_page(const Page* page) {
+        const char* bytes = reinterpret_cast<const char*>(page);
+        for (size_t offset = 0; offset < PAGE_BYTES; offset += 64) prefetch(bytes + offset);
+    }
+
+    BPlusTree::Leaf* BPlusTree::descend(const Probe& probe, uint64_t& version) {
+        Page* page = root.load(std::memory_order_acquire);
+        uint64_t seen = page->version.load(std::memory_order_acquire);
+        if ((seen & 1u) || root.load(std::memory_order_acquire) != page) return nullptr;
+        while (page->level) {
+            Inner* inner = static_cast<Inner*>(page);
+            uint32_t count = inner->count.load(std::memory_order_acquire);
+            Page* child = inner->children[rank(*inner, count, probe, true)].load(std::memory_order_acquire);
+            if (!child) return nullptr; // torn read of a page being written
+            prefetch_page(child);
+            uint64_t child_version = child->version.load(std::memory_order_acquire);
+            // The child is only trusted once its parent is validated after reading it.
+            if (inner->version.load(std::memory_order_acquire) != seen || (child_version & 1u)) return nullptr;
+            page = child;
+            seen = child_version;
+        }
+        version = seen;
+        return static_cast<Leaf*>(page);
+    }
+
+    std::vector<unsigned char> BPlusTree::get(std::span<const unsigned char> key) {
+        auto value = find(key);
+        return value ? *value : NULL_VALUE;
+    }
+
+    Value BPlusTree::find(std::span<const unsigned char> key) {
+        counters.add(Counter::Finds);
+        auto guard = epoch.pin();
+        const Probe probe(key);
+        Backoff backoff;
+        while (true) {
+            uint64_t version;
+            if (Leaf* leaf = descend(probe, version)) {
+                uint32_t count = leaf->count.load(std::memory_order_acquire);
+                uint32_t slot = rank(*leaf, count, probe, false);
+                Entry* entry = matching(*leaf, slot, count, probe);
+                Value value = entry ? std::atomic_load(&entry->value) : nullptr;
+                if (leaf->version.load(std::memory_order_acquire) == version) return value;
+            }
+            counters.add(Counter::Restarts);
+            backoff.pause();
+        }
+    }
+
+    Value BPlusTree::find(std::string_view key) {
+        return find(bytes(key));
+    }
+
+    void BPlusTree::put(std::span<const unsigned char> key, std::vector<unsigned char> value) {
+        put(key, std::make_shared<const std::vector<unsigned char>>(std::move(value)));
+    }
+
+    void BPlusTree::put(std::span<const unsigned char> key, Value value) {
+        counters.add(Counter::Puts);
+        auto guard = epoch.pin();
+        const Probe probe(key);
+        Backoff backoff;
+        while (true) {
+            Attempt attempt = try_put(probe, value);
+            if (attempt == Attempt::Done) return;
+            if (attempt == Attempt::Split) continue;
+            counters.add(Counter::Restarts);
+            backoff.pause();
+        }
+    }
+
+    BPlusTree::Attempt BPlusTree::try_put(const Probe& probe, const Value& value) {
+        Inner* parent = nullptr;
+        uint64_t parent_version = 0;
+        Page* page = root.load(std::memory_order_acquire);
+        uint64_t version = page->version.load(std::memory_order_acquire);
+        if ((version & 1u) || root.load(std::memory_order_acquire) != page) return Attempt::Raced;
+        while (true) {
+            // Split before entering, a page is never full once a writer stands in it, so a split never climbs.
+            uint32_t count = page->count.load(std::memory_order_acquire);
+            if (count == (page->level ? Inner::SLOTS : Leaf::SLOTS)) {
+                return split(parent, parent_version, page, version) ? Attempt::Split : Attempt::Raced;
+            }
+            if (!page->level) break;
+            Inner* inner = static_cast<Inner*>(page);
+            Page* child = inner->children[rank(*inner, count, probe, true)].load(std::memory_order_acquire);
+            if (!child) return Attempt::Raced;
+            prefetch_page(child);
+            uint64_t child_version = child->version.load(std::memory_order_acquire);
+            if (inner->version.load(std::memory_order_acquire) != version || (child_version & 1u)) return Attempt::Raced;
+            parent = inner;
+            parent_version = version;
+            page = child;
+            version = child_version;
+        }
+
+        // The leaf still carries the version its slots were read at, or nothing is written.
+        Leaf* leaf = static_cast<Leaf*>(page);
+        if (!try_begin_write(leaf, version)) return Attempt::Raced;
+        uint32_t count = leaf->count.load(std::memory_order_relaxed);
+        uint32_t slot = rank(*leaf, count, probe, false);
+        if (Entry* entry = matching(*leaf, slot, count, probe)) {
+            std::atomic_store(&entry->value, value);
+            end_write(leaf);
+            return Attempt::Done;
+        }
+        for (uint32_t i = count; i > slot; i--) copy_slot(*leaf, i, *leaf, i - 1);
+        set_slot(*leaf, slot, probe.head, make_entry(probe.bytes, value));
+        leaf->count.store(count + 1, std::memory_order_release);
+        end_write(leaf);
+        counters.add(Counter::Inserts);
+        return Attempt::Done;
+    }
+
+    bool BPlusTree::split(Inner* parent, uint64_t parent_version, Page* page, uint64_t version) {
+        // Top down, like every writer, and only if neither page changed since the walk read it. The parent isn't full,
+        // the walk would have split it first.
+        if (parent && !try_begin_write(parent, parent_version)) return false;
+        if (!try_begin_write(page, version)) {
+            if (parent) abort_write(parent);
+            return false;
+        }
+
+        uint32_t count = page->count.load(std::memory_order_relaxed);
+        uint32_t kept = count / 2;
+        Entry* separator;
+        Page* sibling;
+        if (!page->level) {
+            // The upper half moves to a new right sibling, a copy of its first key goes up.
+            Leaf* leaf = static_cast<Leaf*>(page);
+            Leaf* right = new Leaf();
+            for (uint32_t i = kept; i < count; i++) copy_slot(*right, i - kept, *leaf, i);
+            right->count.store(count - kept, std::memory_order_relaxed);
+            right->next.store(leaf->next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            separator = make_entry(right->entries[0].load(std::memory_order_relaxed)->key(), nullptr);
+            leaf->next.store(right, std::memory_order_release);
+            leaf->count.store(kept, std::memory_order_release);
+            sibling = right;
+        }
+        else {
+            // Separators above the middle one move right, the middle one itself goes up.
+            Inner* inner = static_cast<Inner*>(page);
+            Inner* right = new Inner(inner->level);
+            separator = inner->entries[kept].load(std::memory_order_relaxed);
+            for (uint32_t i = kept + 1; i < count; i++) copy_slot(*right, i - kept - 1, *inner, i);
+            for (uint32_t i = kept + 1; i <= count; i++) {
+                right->children[i - kept - 1].store(inner->children[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+            }
+            right->count.store(count - kept - 1, std::memory_order_relaxed);
+            inner->count.store(kept, std::memory_order_release);
+            sibling = right;
+        }
+
+        if (!parent) {
+            // A new root above the two halves. Readers holding the old one restart on its version.
+            Inner* top = new Inner(page->level + 1);
+            set_slot(*top, 0, Head(separator->key()), separator);
+            top->children[0].store(page, std::memory_order_relaxed);
+            top->children[1].store(sibling, std::memory_order_relaxed);
+            top->count.store(1, std::memory_order_relaxed);
+            root.store(top, std::memory_order_release);
+            end_write(page);
+            return true;
+        }
+        uint32_t parent_count = parent->count.load(std::memory_order_relaxed);
+        uint32_t at = 0;
+        while (parent->children[at].load(std::memory_order_relaxed) != page) at++;
+        for (uint32_t i = parent_count; i > at; i--) {
+            copy_slot(*parent, i, *parent, i - 1);
+            parent->children[i + 1].store(parent->children[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        set_slot(*parent, at, Head(separator->key()), separator);
+        parent->children[at + 1].store(sibling, std::memory_order_relaxed);
+        parent->count.store(parent_count + 1, std::memory_order_release);
+        end_write(page);
+        end_write(parent);
+        return true;
+    }
+
+    bool BPlusTree::erase(std::span<const unsigned char> key) {
+        counters.add(Counter::Erases);
+        auto guard = epoch.pin();
+        const Probe probe(key);
+        Backoff backoff;
+        while (true) {
+            uint64_t version;
+            Leaf* leaf = descend(probe, version);
+            if (leaf && try_begin_write(leaf, version)) {
+                uint32_t count = leaf->count.load(std::memory_order_relaxed);
+                uint32_t slot = rank(*leaf, count, probe, false);
+                Entry* entry = matching(*leaf, slot, count, probe);
+                if (!entry) {
+                    abort_write(leaf);
+                    return false;
+                }
+                for (uint32_t i = slot + 1; i < count; i++) copy_slot(*leaf, i - 1, *leaf, i);
+                leaf->count.store(count - 1, std::memory_order_release);
+                end_write(leaf);
+                // Optimistic readers may still hold the entry.
+                guard.retire(entry, reclaim_entry);
+                counters.add(Counter::Removals);
+                return true;
+            }
+            counters.add(Counter::Restarts);
+            backoff.pause();
+        }
+    }
+
+    void BPlusTree::scan(std::span<const unsigned char> lo, std::span<const unsigned char> hi, const ScanVisitor& visitor) {
+        visit(lo, &hi, visitor);
+    }
+
+    void BPlusTree::visit(std::span<const unsigned char> lo, const std::span<const unsigned char>* hi, const ScanVisitor& visitor) {
+        counters.add(Counter::Scans);
+        auto guard = epoch.pin();
+        const Probe probe(lo);
+        Backoff backoff;
+        uint64_t version;
+        Leaf* leaf;
+        while (!(leaf = descend(probe, version))) backoff.pause();
+
+        // A leaf's range only ever shrinks from the right, into new siblings after it. Every key at or above lo is
+        // in the first leaf or one linked after it, and the keys a leaf loses to a split are found again in the next.
+        std::vector<std::pair<Entry*, Value>> batch;
+        Entry* last = nullptr; // last key visited
+        while (leaf) {
+            batch.clear();
+            bool done = false;
+            uint32_t count = leaf->count.load(std::memory_order_acquire);
+            Leaf* next = leaf->next.load(std::memory_order_acquire);
+            for (uint32_t i = 0; i < count; i++) {
+                Entry* entry = leaf->entries[i].load(std::memory_order_acquire);
+                if (!entry) break; // torn read, the version check fails below
+                std::span<const unsigned char> key = entry->key();
+                if (last ? compare(key, last->key()) <= 0 : compare(key, lo) < 0) continue;
+                if (hi && compare(key, *hi) >= 0) {
+                    done = true;
+                    break;
+                }
+                batch.emplace_back(entry, std::atomic_load(&entry->value));
+            }
+            if (leaf->version.load(std::memory_order_acquire) != version) {
+                counters.add(Counter::Restarts);
+                version = stable_version(leaf);
+                continue;
+            }
+            for (auto& [entry, value] : batch) {
+                if (!visitor(entry->key(), value)) return;
+            }
+            if (!batch.empty()) last = batch.back().first;
+            if (done) return;
+            leaf = next;
+            if (leaf) version = stable_version(leaf);
+        }
+    }
+
+    TreeStats BPlusTree::stats() {
+        TreeStats stats;
+        counters.snapshot(stats);
+#if SYNC_TREE_STATS
+        // Pages are never freed while the tree lives and a page's level never changes, the root's is enough.
+        stats.height = root.load(std::memory_order_acquire)->level + 1;
+#endif
+        return stats;
+    }
+
+    void BPlusTree::printList() {
+        visit({}, nullptr, [](std::span<const unsigned char> key, const Value& value) {
+            std::cout << parse(key) << " : " << parse(*value) << '\n';
+            return true;
+        });
+    }
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include "platform.h"
+
+#include <atomic>
+#include <cstdint>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "concurrent.h"
+#include "epoch.h"
+#include "stats.h"
+
+namespace sync {
+
+    // Wide fanout engine with the put/get surface of ConcurrentTree, for workloads where one cache miss per level of a
+    // binary tree dominates: a B+tree of 1 KiB pages holding sorted key slots. A slot keeps the first 16 key bytes
+    // inline, so a search reads the page and only dereferences a key that ties on them. Pages carry the same odd/even
+    // version word as the tree's nodes and are read with optimistic lock coupling: a child's version is read before
+    // its parent is validated, writers lock only the pages they change. Full pages are split on the way down, so a
+    // split never has to climb. Leaves are linked left to right, scans walk them without descending again.
+    //
+    // Pages are never merged or freed while the tree lives, a leaf emptied by erases stays in place for later keys.
+    // Erased entries are retired to an epoch domain. Snapshots, batches, read-modify-write, the hash index and the
+    // other extras stay with ConcurrentTree.
+    class BPlusTree {
+    public:
+        using ScanVisitor = ConcurrentTree::ScanVisitor;
+
+        const std::vector<unsigned char> NULL_VALUE{ {} };
+        BPlusTree();
+        ~BPlusTree();
+        BPlusTree(const BPlusTree&) = delete;
+        BPlusTree& operator=(const BPlusTree&) = delete;
+
+        void put(std::span<const unsigned char> key, std::vector<unsigned char> value);
+        void put(std::span<const unsigned char> key, Value value);
+        std::vector<unsigned char> get(std::span<const unsigned char> key);
+        Value find(std::span<const unsigned char> key);
+        Value find(std::string_view key);
+        bool erase(std::span<const unsigned char> key);
+        // Visits every key in [lo, hi) in ascending order, one leaf at a time. A leaf is read optimistically and its
+        // keys are visited once its version validates, writers aren't blocked.
+        void scan(std::span<const unsigned char> lo, std::span<const unsigned char> hi, const ScanVisitor& visitor);
+        // Same counters as ConcurrentTree::stats, the ones about rotations and colors stay zero.
+        TreeStats stats();
+        void printList();
+
+    private:
+        static constexpr size_t PAGE_BYTES = 1024;
+
+        // Key bytes follow the struct. Leaves point at the entry of every key, inner pages at copies of their separators.
+        struct Entry {
+            Value value; // nullptr for separators
+            uint32_t key_size;
+            std::span<const unsigned char> key() const { return { reinterpret_cast<const unsigned char*>(this + 1), key_size }; }
+        };
+
+        // First 16 key bytes as two big endian words, zero padded. Keys with unequal heads are ordered by them.
+        struct Head {
+            uint64_t high;
+            uint64_t low;
+            explicit Head(std::span<const unsigned char> key)
+                : high(key_prefix(key)), low(key_prefix(key.size() > 8 ? key.subspan(8) : std::span<const unsigned char>())) {};
+        };
+
+        // A key being searched for and its head.
+        struct Probe {
+            std::span<const unsigned char> bytes;
+            Head head;
+            explicit Probe(std::span<const unsigned char> bytes) : bytes(bytes), head(bytes) {};
+        };
+
+        struct Page {
+            std::atomic<uint64_t> version{ 0 };
+            std::atomic<uint32_t> count{ 0 }; // keys, or separators of an inner page
+            const uint32_t level;             // 0 for leaves
+            explicit Page(uint32_t level) : level(level) {};
+        };
+
+        // Slot i holds heads[2i], heads[2i + 1] and its entry. Slots past count may hold stale entries, an erased one
+        // among them once it is retired, so they are never read but by a pinned reader that validates the version.
+        struct alignas(64) Leaf : Page {
+            static constexpr uint32_t SLOTS = 41;
+            std::atomic<Leaf*> next{ nullptr };
+            std::atomic<uint64_t> heads[2 * SLOTS];
+            std::atomic<Entry*> entries[SLOTS];
+            Leaf() : Page(0) {};
+        };
+
+        // Same slots, holding the separators. children[i] holds the keys in [separator i - 1, separator i).
+        struct alignas(64) Inner : Page {
+            static constexpr uint32_t SLOTS = 31;
+            std::atomic<uint64_t> heads[2 * SLOTS];
+            std::atomic<Entry*> entries[SLOTS];
+            std::atomic<Page*> children[SLOTS + 1];
+            explicit Inner(uint32_t level) : Page(level) {};
+        };
+
+        static_assert(sizeof(Leaf) <= PAGE_BYTES && sizeof(Inner) <= PAGE_BYTES);
+
+        std::atomic<Page*> root;
+        EpochDomain epoch;
+        StatsCollector counters;
+
+        // The version protocol of ConcurrentTree's nodes, pages are never erased so there is no obsolete bit.
+        static inline bool try_begin_write(Page* page, uint64_t version) {
+            return !(version & 1u) && page->version.compare_exchange_strong(version, version + 1, std::memory_order_acq_rel, std::memory_order_relaxed);
+        }
+
+        static inline void end_write(Page* page) {
+            page->version.fetch_add(1, std::memory_order_release);
+        }
+
+        static inline void abort_write(Page* page) {
+            page->version.fetch_sub(1, std::memory_order_release);
+        }
+
+        // Waits out a writer, returns the even version the page is read at.
+        static uint64_t stable_version(Page* page);
+
+        static Entry* make_entry(std::span<const unsigned char> key, Value value);
+        static void reclaim_entry(void* entry, void*);
+        static int compare(std::span<const unsigned char> a, std::span<const unsigned char> b);
+        // Slots whose key is below probe, or not above it when inclusive. Heads come from an optimistic read, the
+        // rank is only meaningful once the page validates.
+        template <class P>
+        static uint32_t rank(const P& page, uint32_t count, const Probe& probe, bool inclusive);
+        // Entry of slot if it holds probe's key, nullptr otherwise.
+        static Entry* matching(const Leaf& leaf, uint32_t slot, uint32_t count, const Probe& probe);
+        // Slot writes, only while the page is locked or not yet published.
+        template <class To, class From>
+        static void copy_slot(To& to, uint32_t at, const From& from, uint32_t slot);
+        template <class P>
+        static void set_slot(P& page, uint32_t at, const Head& head, Entry* entry);
+        // Requests every line of page, its misses overlap instead of coming one per step of the binary search.
+        static void prefetch_page(const Page* page);
+
+        // Leaf whose range holds probe and the version it was reached at, nullptr if a writer raced the descent.
+        Leaf* descend(const Probe& probe, uint64_t& version);
+        void visit(std::span<const unsigned char> lo, const std::span<const unsigned char>* hi, const ScanVisitor& visitor);
+        enum class Attempt : uint8_t {
+            Done,
+            Split, // split a page on the way, walks again
+            Raced  // a writer changed a page the walk read, walks again after a pause
+        };
+        Attempt try_put(const Probe& probe, const Value& value);
+        // Splits a full page under parent, nullptr when page is the root. Both must still carry the versions seen,
+        // false if they don't.
+        bool split(Inner* parent, uint64_t parent_version, Page* page, uint64_t version);
+        void destroy(Page* page);
+    };
+}
@@ -0,0 +1,59 @@
+#include "concurrent.h"
+
+// Cache mode. Inserts, value replacements and unlinks charge the bytes they add or free to used, and the writer that
+// pushed it over capacity runs a CLOCK hand over the keys: finds set a node's referenced bit, the hand clears set bits
+// as it passes and evicts keys it finds clear, so a key survives as long as it is found again within one turn of the
+// hand. The hand walks an ordinary Iterator and remembers the key it stopped at, eviction is erase() and takes the
+// same locks as any other.
+namespace sync {
+    void ConcurrentTree::setCapacity(size_t bytes) {
+        if (bytes && !capacity.load(std::memory_order_relaxed)) {
+            // Nothing was accounted while unbounded, the keys held so far are counted once.
+            int64_t held = 0;
+            for (Iterator it = begin(); it.valid(); it.next()) held += footprint(it.key().size(), it.value());
+            used.store(held, std::memory_order_relaxed);
+        }
+        if (!bytes) used.store(0, std::memory_order_relaxed);
+        capacity.store(bytes, std::memory_order_release);
+        enforce_capacity();
+    }
+
+    size_t ConcurrentTree::value_bytes(const Value& value) const {
+        // The buffer, the vector holding it and make_shared's control block, a vtable pointer and two counts.
+        if (inline_width.load(std::memory_order_relaxed)) return 0;
+        return value ? sizeof(std::vector<unsigned char>) + value->capacity() + 2 * sizeof(void*) : 0;
+    }
+
+    size_t ConcurrentTree::footprint(size_t key_size, const Value& value) const {
+        return sizeof(Node) + (key_size > INLINE_KEY ? key_size : 0) + value_bytes(value);
+    }
+
+    void ConcurrentTree::evict() {
+        // One hand at a time. A writer finding it taken goes on, the one holding it keeps sweeping while over budget.
+        std::unique_lock<std::mutex> held(eviction, std::try_to_lock);
+        if (!held) return;
+        std::vector<std::vector<unsigned char>> victims;
+        while (used.load(std::memory_order_relaxed) > int64_t(capacity.load(std::memory_order_relaxed))) {
+            bool from_start = hand.empty();
+            size_t swept = 0;
+            {
+                Iterator it = lower_bound(hand);
+                for (; it.valid() && victims.size() < EVICTION_BATCH; it.next(), swept++) {
+                    Node* node = it.current;
+                    if (node->referenced.load(std::memory_order_relaxed)) node->referenced.store(0, std::memory_order_relaxed);
+                    else victims.emplace_back(it.key().begin(), it.key().end());
+                    // Resumes just past this key, a zero byte appended is the least key above it.
+                    hand.assign(it.key().begin(), it.key().end());
+                    hand.push_back(0);
+                }
+                if (!it.valid()) hand.clear();
+            }
+            // Erased once the sweep is done, every erase would send the iterator's next step back to the root.
+            for (const auto& key : victims) {
+                if (erase(key)) counters.add(Counter::Evictions);
+            }
+            victims.clear();
+            if (!swept && from_start) break; // the tree is empty
+        }
+    }
+}
@@ -0,0 +1,65 @@
+#include "concurrent.h"
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+// Flat combining for put(). Writers racing for the same insertion parent lose its version to each other and walk
+// again, the more of them the more often. Combining trades that for one writer at a time: every put publishes
+// itself in a slot, and the writer holding the combiner lock applies all published puts as one sorted multiPut,
+// whose inserts into the same gap go in as one chain and are rebalanced after it is linked.
+namespace sync {
+    void ConcurrentTree::setCombining(bool enabled) {
+        if (enabled && !publications) publications = std::make_unique<Publication[]>(PUBLICATIONS);
+        combining.store(enabled, std::memory_order_release);
+    }
+
+    bool ConcurrentTree::combine(std::span<const unsigned char> key, const Value& value) {
+        // Each thread starts probing at a slot of its own, threads whose hints collide take the next free one.
+        static thread_local const size_t hint = std::hash<std::thread::id>{}(std::this_thread::get_id()) % PUBLICATIONS;
+        Publication* mine = nullptr;
+        for (size_t i = 0; i < PUBLICATIONS && !mine; i++) {
+            Publication& slot = publications[(hint + i) % PUBLICATIONS];
+            uint8_t free = Publication::Free;
+            if (slot.state.load(std::memory_order_relaxed) != Publication::Free) continue;
+            if (slot.state.compare_exchange_strong(free, Publication::Claimed, std::memory_order_acquire, std::memory_order_relaxed)) mine = &slot;
+        }
+        if (!mine) return false;
+
+        mine->key = key;
+        mine->value = &value;
+        mine->state.store(Publication::Pending, std::memory_order_release);
+        // Either some combiner picks the put up, or this writer becomes the combiner and applies it with the rest.
+        Backoff backoff;
+        while (mine->state.load(std::memory_order_acquire) != Publication::Applied) {
+            if (combiner.try_lock()) {
+                apply_published(mine);
+                combiner.unlock();
+                continue;
+            }
+            backoff.pause();
+        }
+        mine->state.store(Publication::Free, std::memory_order_release);
+        return true;
+    }
+
+    void ConcurrentTree::apply_published(const Publication* own) {
+        combined.clear();
+        taken.clear();
+        for (size_t i = 0; i < PUBLICATIONS; i++) {
+            Publication& slot = publications[i];
+            if (slot.state.load(std::memory_order_acquire) != Publication::Pending) continue;
+            combined.push_back({ slot.key, *slot.value });
+            taken.push_back(&slot);
+        }
+        if (combined.empty()) return;
+        // Alone, the put goes the direct way, a batch of one gains nothing from sorting and descending as a batch.
+        if (combined.size() == 1) put_direct(combined[0].key, combined[0].value);
+        else multiPut(combined);
+        // The combiner's own put is among them unless an earlier combiner took it before this one got the lock.
+        counters.add(Counter::CombinedPuts, taken.size() - std::count(taken.begin(), taken.end(), own));
+        // Released last, a writer may return and reuse its key and value as soon as it sees Applied.
+        combined.clear();
+        for (Publication* slot : taken) slot->state.store(Publication::Applied, std::memory_order_release);
+    }
+}
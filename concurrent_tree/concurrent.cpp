@@ -1,342 +1,1182 @@
 #include "concurrent.h"
 
+#include <bit>
+#include <cassert>
+#include <thread>
+
 namespace sync {
-    void ConcurrentTree::left_rotate(Node* node) {
+    void ConcurrentTree::rotate(Node* node, bool left) {
+        // The child on the other side takes node's place and node becomes its child on this side, that child's inner
+        // subtree moving over to node. The caller holds node's parent, node, the child and the inner subtree's root.
+        Node* first = child_of(node, !left);
+        Node* second = child_of(first, left);
+        Node* grandparent = node->parent.load(std::memory_order_relaxed);
+        set_child(node, !left, second);
+        if (second) second->parent.store(node, std::memory_order_relaxed);
+        first->parent.store(grandparent, std::memory_order_relaxed);
+        replace_child(grandparent, node, first);
+        set_child(first, left, node);
+        node->parent.store(first, std::memory_order_relaxed);
+        counters.add(Counter::Rotations);
+    }
+
+    std::vector<unsigned char> ConcurrentTree::get(std::span<const unsigned char> key) {
+        auto value = find(key);
+        return value ? *value : NULL_VALUE;
+    }
+
+    Value ConcurrentTree::find(std::span<const unsigned char> key) {
+        counters.add(Counter::Finds);
+        auto guard = epoch.pin();
+        Value value;
+        if (!search(SearchKey(key), [&](const Node* node) { value = load_value(node); })) return nullptr;
+        return value;
+    }
+
+    template <class Load>
+    bool ConcurrentTree::search(const SearchKey& search, Load&& load) {
+        std::span<const unsigned char> key = search.bytes;
+        // One probe and one version validation. A miss, or a node being written, takes the tree walk below.
+        if (index) {
+            Node* node = index->find(HashIndex::hash(key), [&search](Node* node) { return compare(node, search) == 0 && !is_obsolete(node); });
+            uint64_t version = node ? node->version.load(std::memory_order_acquire) : 1;
+            if (!(version & 1u)) {
+                load(node);
+                if (node->version.load(std::memory_order_acquire) == version) {
+                    counters.add(Counter::IndexHits);
+                    touch(node);
+                    return true;
+                }
+            }
+        }
+        uint64_t seen_relinks = relinks.load(std::memory_order_acquire);
+        Path path(*this);
+        enter_fence(search, path, seen_relinks);
+        Backoff backoff;
         while (true) {
-            Node* first = node->right.load(std::memory_order_relaxed);
-            if (!first) return; // No value to rotate
-            Node* second = first->left.load(std::memory_order_relaxed);
-            Node* grandparent = node->parent.load(std::memory_order_relaxed);
-
-            // This is the set that will mutate under the rotation, which we lock from other concurrent threads.
-            // left needs be included only if we will mutate its parent.
-            std::vector<Node*> locked = { grandparent, node, first };
-            if (second) locked.push_back(second);
-            lock_adress_order(locked);
-
-            begin_write(node);
-            begin_write(first);
-            begin_write(grandparent); // if they exist
-            begin_write(second); // if they exist
-
-            // Nodes still valid, grandparent is still related to node.
-            bool valid = (node->right.load(std::memory_order_relaxed) == first)
-                && (first->left.load(std::memory_order_relaxed) == second)
-                && (node->parent.load(std::memory_order_relaxed) == grandparent)
-                && (!grandparent || grandparent->left.load(std::memory_order_relaxed) == node || grandparent->right.load(std::memory_order_relaxed) == node);
-
-            // Rollback if the state of write is invalid, i.e. another thread beat this one to execution.
-            if (!valid) {
-                end_write(second);
-                end_write(grandparent);
-                end_write(first);
-                end_write(node);
-                unlock_reverse(locked);
+            Node* current;
+            uint64_t version;
+            // Resume below the deepest unchanged ancestor, the root is only the last resort.
+            if (!path.resume(current, version) && !load_root(current, version)) {
+                backoff.pause();
                 continue;
             }
+            // If tree is uninitialized, return NULL.
+            if (!current) return false;
 
-            // Left rotation performed:
-            node->right.store(second, std::memory_order_relaxed);
-            if (second) second->parent.store(node, std::memory_order_relaxed);
-            first->parent.store(grandparent, std::memory_order_relaxed);
-            if (!grandparent) root.store(first, std::memory_order_release);
-            else if (grandparent->left.load(std::memory_order_relaxed) == node) grandparent->left.store(first, std::memory_order_relaxed);
-            else grandparent->right.store(first, std::memory_order_release);
-            first->left.store(node, std::memory_order_relaxed);
-            node->parent.store(first, std::memory_order_relaxed);
-
-            // Finish writes and release nodes. Order does not matter, here its done inside-out
-            end_write(second);
-            end_write(grandparent);
-            end_write(first);
-            end_write(node);
-            unlock_reverse(locked);
-            return;
+            // Iterate over the tree with optimistic search, a child's version is only trusted once its parent is
+            // re-validated after reading it.
+            while (true) {
+                int order = compare(current, search);
+                if (order == 0) {
+                    load(current);
+                    if (current->version.load(std::memory_order_acquire) != version) break;
+                    touch(current);
+                    return true;
+                }
+                Node* next = order < 0 ? current->right.load(std::memory_order_acquire) : current->left.load(std::memory_order_acquire);
+                uint64_t next_version = next ? next->version.load(std::memory_order_acquire) : 0;
+                // Other thread raced, resume from an ancestor
+                if (current->version.load(std::memory_order_acquire) != version) break;
+                // If touched tree edge with no match return NULL, unless an erase moved the key above us meanwhile
+                if (!next) {
+                    uint64_t relinks_now = relinks.load(std::memory_order_acquire);
+                    if (relinks_now == seen_relinks) return false;
+                    seen_relinks = relinks_now;
+                    path.clear(); // the key may now sit above any remembered node
+                    break;
+                }
+                path.push(current, version);
+                if (next_version & 1u) break;
+                // Iterate
+                current = next;
+                version = next_version;
+            }
+            backoff.pause();
+        }
+    }
+
+    bool ConcurrentTree::Path::resume(Node*& node, uint64_t& version) {
+        // Before the first attempt the only step is a fence entry, popping it walks nothing twice.
+        bool entering = !started;
+        size_t failed = entering ? 0 : depth;
+        if (started) retries++;
+        started = true;
+        // A remembered node with an unchanged version still spans the same key interval, so the key lies below it.
+        // Only the newest CAPACITY steps are kept, older ones are lost.
+        size_t oldest = depth > CAPACITY ? depth - CAPACITY : 0;
+        while (depth > oldest) {
+            Step& step = steps[--depth % CAPACITY];
+            if (step.node->version.load(std::memory_order_acquire) != step.version) continue;
+            node = step.node;
+            version = step.version;
+            if (entering) tree.counters.add(Counter::FenceEntries);
+            else rewalked += failed - depth;
+            return true;
+        }
+        depth = 0;
+        rewalked += failed;
+        return false;
+    }
+
+    Value ConcurrentTree::find(std::string_view key) {
+        return find(bytes(key));
+    }
+
+    std::vector<Value> ConcurrentTree::multiGet(std::span<const std::span<const unsigned char>> keys) {
+        std::vector<Value> values(keys.size());
+        std::vector<BatchSlot> batch;
+        batch.reserve(keys.size());
+        for (size_t i = 0; i < keys.size(); i++) batch.push_back({ SearchKey(keys[i]), i });
+        sort_batch(batch);
+
+        size_t retries = 0;
+        {
+            auto guard = epoch.pin();
+            uint64_t seen_relinks = locate(batch);
+            // An erase that moved a successor up may have carried a missed key above the node it was missed under.
+            bool relinked = relinks.load(std::memory_order_acquire) != seen_relinks;
+            for (BatchSlot& slot : batch) {
+                if (slot.outcome == BatchSlot::Found) {
+                    auto value = load_value(slot.node);
+                    if (slot.node->version.load(std::memory_order_acquire) == slot.version) {
+                        values[slot.index] = std::move(value);
+                        touch(slot.node);
+                        continue;
+                    }
+                    slot.outcome = BatchSlot::Conflict;
+                }
+                else if (slot.outcome == BatchSlot::Absent && !relinked) continue;
+                slot.outcome = BatchSlot::Conflict;
+                retries++;
+            }
+        }
+        // Retried keys are counted by find().
+        counters.add(Counter::Finds, batch.size() - retries);
+        for (BatchSlot& slot : batch) {
+            if (slot.outcome == BatchSlot::Conflict) values[slot.index] = find(slot.search.bytes);
         }
+        return values;
     }
 
-    void ConcurrentTree::right_rotate(Node* node) {
+    void ConcurrentTree::multiPut(std::span<const Record> records) {
+        std::vector<BatchSlot> batch;
+        batch.reserve(records.size());
+        for (size_t i = 0; i < records.size(); i++) batch.push_back({ SearchKey(records[i].key), i });
+        sort_batch(batch);
+        // The sort is stable, the last of equal keys is the one written last by the caller.
+        size_t kept = 0;
+        for (size_t i = 0; i < batch.size(); i++) {
+            if (i + 1 < batch.size() && compare(batch[i].search.bytes, batch[i + 1].search.bytes) == 0) continue;
+            batch[kept++] = batch[i];
+        }
+        batch.erase(batch.begin() + kept, batch.end());
+
+        size_t retries = 0;
+        {
+            auto guard = epoch.pin();
+            uint64_t seen_relinks = locate(batch);
+            // Writes go in key order and new nodes are rebalanced together once linked, so the rotations of one insert
+            // don't invalidate the places the others were located at. Keys missing from the same gap, typically a run
+            // of appends, are linked as a chain below each other: the first under the located parent, each next one
+            // right below the one before. Every UNBALANCED_LIMIT inserts the links so far are rebalanced and the rest
+            // of the batch is located again, which bounds how long the chain readers walk through gets.
+            std::vector<Node*> unbalanced;
+            const BatchSlot* gap = nullptr; // slot whose key was linked last, nullptr if its gap is closed
+            Node* tail = nullptr;
+            uint64_t tail_version = 0;
+            for (size_t i = 0; i < batch.size(); i++) {
+                BatchSlot& slot = batch[i];
+                if (unbalanced.size() == UNBALANCED_LIMIT) {
+                    for (Node* node : unbalanced) balance_insert(node);
+                    unbalanced.clear();
+                    gap = nullptr;
+                    for (BatchSlot& rest : std::span(batch).subspan(i)) rest.outcome = BatchSlot::Conflict;
+                    seen_relinks = locate(std::span(batch).subspan(i));
+                }
+                const Value& value = records[slot.index].value;
+                if (slot.outcome == BatchSlot::Found) {
+                    gap = nullptr;
+                    // Keys are immutable, a node that isn't erased still holds the key.
+                    if (begin_write(slot.node)) {
+                        store_value(slot.node, value, guard);
+                        uint64_t sequence = sequence_change();
+                        end_write(slot.node);
+                        publish_change(sequence, slot.search.bytes, value);
+                        continue;
+                    }
+                }
+                else if (slot.outcome == BatchSlot::Absent && slot.node) {
+                    // A key of the gap the last one went into belongs right below it, on its still empty right. Any
+                    // other writer reaching that place locks the last node first, and its version tells.
+                    bool chained = gap && gap->node == slot.node && gap->go_right == slot.go_right;
+                    Node* parent = chained ? tail : slot.node;
+                    uint64_t version = chained ? tail_version : slot.version;
+                    bool go_right = chained || slot.go_right;
+                    gap = nullptr;
+                    if (try_begin_write(parent, version)) {
+                        if (relinks.load(std::memory_order_acquire) == seen_relinks) {
+                            Node* node = make_node(slot.search.bytes, value);
+                            node->parent.store(parent, std::memory_order_relaxed);
+                            if (go_right) parent->right.store(node, std::memory_order_relaxed);
+                            else parent->left.store(node, std::memory_order_relaxed);
+                            uint64_t sequence = sequence_change();
+                            end_write(parent);
+                            publish_change(sequence, slot.search.bytes, value);
+                            index_node(node);
+                            charge(footprint(node->key_size, value));
+                            elements.add(1);
+                            counters.add(Counter::Inserts);
+                            unbalanced.push_back(node);
+                            gap = &slot;
+                            tail = node;
+                            tail_version = node->version.load(std::memory_order_relaxed);
+                            continue;
+                        }
+                        abort_write(parent);
+                    }
+                }
+                slot.outcome = BatchSlot::Conflict;
+                retries++;
+            }
+            for (Node* node : unbalanced) balance_insert(node);
+        }
+        // Retried keys, and every key of a batch put into an empty tree, are counted by put_direct(). Not put(), a
+        // combining tree applies its published puts with this very call.
+        counters.add(Counter::Puts, batch.size() - retries);
+        for (BatchSlot& slot : batch) {
+            if (slot.outcome == BatchSlot::Conflict) put_direct(slot.search.bytes, records[slot.index].value);
+        }
+        enforce_capacity();
+    }
+
+    void ConcurrentTree::sort_batch(std::vector<BatchSlot>& batch) {
+        std::stable_sort(batch.begin(), batch.end(), [](const BatchSlot& a, const BatchSlot& b) {
+            if (a.search.prefix != b.search.prefix) return a.search.prefix < b.search.prefix;
+            return compare(a.search.bytes, b.search.bytes) < 0;
+        });
+    }
+
+    uint64_t ConcurrentTree::locate(std::span<BatchSlot> sorted) {
+        Backoff backoff;
         while (true) {
-            Node* first = node->left.load(std::memory_order_relaxed);
-            if (!first) return; // No value to rotate
-            Node* second = first->right.load(std::memory_order_relaxed);
-            Node* grandparent = node->parent.load(std::memory_order_relaxed);
-
-            // This is the set that will mutate under the rotation, which we lock from other concurrent threads.
-            // left needs be included only if we will mutate its parent.
-            std::vector<Node*> locked = { grandparent, node, first };
-            if (second) locked.push_back(second);
-            lock_adress_order(locked);
-
-            begin_write(node);
-            begin_write(first);
-            begin_write(grandparent); // if they exist
-            begin_write(second); // if they exist
-
-            // Nodes still valid, grandparent is still related to node.
-            bool valid = (node->left.load(std::memory_order_relaxed) == first)
-                && (first->right.load(std::memory_order_relaxed) == second)
-                && (node->parent.load(std::memory_order_relaxed) == grandparent)
-                && (!grandparent || grandparent->left.load(std::memory_order_relaxed) == node || grandparent->right.load(std::memory_order_relaxed) == node);
-
-            // Rollback if the state of write is invalid, i.e. another thread beat this one to execution.
-            if (!valid) {
-                end_write(second);
-                end_write(grandparent);
-                end_write(first);
-                end_write(node);
-                unlock_reverse(locked);
+            uint64_t seen_relinks = relinks.load(std::memory_order_acquire);
+            Node* node;
+            uint64_t version;
+            if (!load_root(node, version)) {
+                backoff.pause();
                 continue;
             }
+            if (node) locate(node, version, sorted);
+            else for (BatchSlot& slot : sorted) slot.outcome = BatchSlot::Absent;
+            return seen_relinks;
+        }
+    }
 
-            // Right rotation performed:
-            node->left.store(second, std::memory_order_relaxed);
-            if (second) second->parent.store(node, std::memory_order_relaxed);
-            first->parent.store(grandparent, std::memory_order_relaxed);
-            if (!grandparent) root.store(first, std::memory_order_release);
-            else if (grandparent->left.load(std::memory_order_relaxed) == node) grandparent->left.store(first, std::memory_order_relaxed);
-            else grandparent->right.store(first, std::memory_order_release);
-            first->right.store(node, std::memory_order_relaxed);
-            node->parent.store(first, std::memory_order_relaxed);
-
-            // Finish writes and release nodes. Order does not matter, here its done inside-out
-            end_write(second);
-            end_write(grandparent);
-            end_write(first);
-            end_write(node);
-            unlock_reverse(locked);
-            return;
+    void ConcurrentTree::locate(Node* node, uint64_t version, std::span<BatchSlot> sorted) {
+        // Keys below the node's key go left, equal ones stop here, the rest go right.
+        auto equal = std::partition_point(sorted.begin(), sorted.end(), [node](const BatchSlot& slot) { return compare(node, slot.search) > 0; });
+        auto above = std::partition_point(equal, sorted.end(), [node](const BatchSlot& slot) { return compare(node, slot.search) == 0; });
+        std::span<BatchSlot> left_batch(sorted.begin(), equal);
+        std::span<BatchSlot> right_batch(above, sorted.end());
+
+        // Both children are requested before either is read, their misses overlap instead of queueing.
+        Node* left = left_batch.empty() ? nullptr : node->left.load(std::memory_order_acquire);
+        Node* right = right_batch.empty() ? nullptr : node->right.load(std::memory_order_acquire);
+        if (left) prefetch(left);
+        if (right) prefetch(right);
+        uint64_t left_version = left ? left->version.load(std::memory_order_acquire) : 0;
+        uint64_t right_version = right ? right->version.load(std::memory_order_acquire) : 0;
+        // A writer raced, the whole sub-batch is left as Conflict and retried key by key.
+        if (node->version.load(std::memory_order_acquire) != version) return;
+
+        for (auto slot = equal; slot != above; ++slot) {
+            slot->outcome = BatchSlot::Found;
+            slot->node = node;
+            slot->version = version;
         }
+        auto branch = [&](std::span<BatchSlot> batch, Node* child, uint64_t child_version, bool go_right) {
+            if (batch.empty() || (child_version & 1u)) return;
+            if (child) return locate(child, child_version, batch);
+            for (BatchSlot& slot : batch) {
+                slot.outcome = BatchSlot::Absent;
+                slot.node = node;
+                slot.version = version;
+                slot.go_right = go_right;
+            }
+        };
+        branch(left_batch, left, left_version, false);
+        branch(right_batch, right, right_version, true);
     }
 
-    std::vector<unsigned char> ConcurrentTree::get(std::vector<unsigned char> key) {
-        while (Node* current = root.load(std::memory_order_acquire)) {
-            // Iterate over the tree with optimistic search
-            while (true) {
-                // If touched tree edge with no match return NULL
-                if (!current) return NULL_VALUE;
-                uint64_t version_first = current->version.load(std::memory_order_acquire);
-                // Other thread acting on the node, reset to root
-                if (version_first & 1u) break;
-                Node* next;
-                if (current->key == key) {
-                    auto value = std::atomic_load(&current->value);
-                    uint64_t version_second = current->version.load(std::memory_order_acquire);
-                    if (version_first == version_second && !(version_second & 1u)) return *value;
-                    continue;
-                }
-                else if (current->key < key) next = current->right.load(std::memory_order_relaxed);
-                else next = current->left.load(std::memory_order_relaxed);
-                uint64_t version_second = current->version.load(std::memory_order_acquire);
-                // Other tree raced, reset to root
-                if (version_first != version_second || version_second & 1u) break;
-                // Iterate
-                current = next;
+    void ConcurrentTree::put(std::span<const unsigned char> key, std::vector<unsigned char> value) {
+        put(key, std::make_shared<const std::vector<unsigned char>>(std::move(value)));
+    }
+
+    ConcurrentTree::~ConcurrentTree() {
+        repairs.stop(); // the maintainers are the last threads that may still be inside
+        stop_fence_maintainer();
+        delete fence.load(std::memory_order_relaxed);
+        // No thread may be inside the tree anymore, retired nodes can go right away.
+        epoch.drain();
+        if (!allocator->release_all(reclaim, this)) deleteTree(root.load(std::memory_order_acquire));
+    }
+
+    TreeStats ConcurrentTree::stats() {
+        TreeStats stats;
+        counters.snapshot(stats);
+#if SYNC_TREE_STATS
+        // Unsynchronised walk of every node, the epoch guard keeps them alive. A rotation racing the walk may hide
+        // or repeat a subtree, so the height is exact once the tree is quiescent. Paths longer than any red-black
+        // tree can hold are only seen mid-rotation and are cut off.
+        constexpr uint64_t HEIGHT_LIMIT = 128;
+        auto guard = epoch.pin();
+        std::vector<std::pair<Node*, uint64_t>> pending;
+        if (Node* top = root.load(std::memory_order_acquire)) pending.emplace_back(top, 1);
+        while (!pending.empty()) {
+            auto [node, level] = pending.back();
+            pending.pop_back();
+            stats.height = std::max(stats.height, level);
+            if (level == HEIGHT_LIMIT) continue;
+            if (Node* left = node->left.load(std::memory_order_acquire)) pending.emplace_back(left, level + 1);
+            if (Node* right = node->right.load(std::memory_order_acquire)) pending.emplace_back(right, level + 1);
+        }
+#endif
+        return stats;
+    }
+
+    bool ConcurrentTree::validate() {
+        auto guard = epoch.pin();
+        Node* top = root.load(std::memory_order_acquire);
+        if (!top) return true;
+        return !top->parent.load(std::memory_order_relaxed) && load_color(top) == BLACK && checked_height(top, nullptr, nullptr) >= 0;
+    }
+
+    int64_t ConcurrentTree::checked_height(Node* node, const Node* lo, const Node* hi) {
+        if (!node) return 0;
+        if (node->version.load(std::memory_order_acquire) & (OBSOLETE | 1u)) return -1; // erased or still locked
+        if ((lo && compare(lo->key(), node->key()) >= 0) || (hi && compare(node->key(), hi->key()) >= 0)) return -1;
+        Node* left = node->left.load(std::memory_order_acquire);
+        Node* right = node->right.load(std::memory_order_acquire);
+        for (Node* child : { left, right }) {
+            if (child && child->parent.load(std::memory_order_relaxed) != node) return -1;
+            if (child && load_color(node) == RED && load_color(child) == RED) return -1;
+        }
+        int64_t below = checked_height(left, lo, node);
+        if (below < 0 || checked_height(right, node, hi) != below) return -1;
+        return below + (load_color(node) == BLACK);
+    }
+
+    Node* ConcurrentTree::make_node(std::span<const unsigned char> key, Value value) {
+        unsigned char* spill = key.size() > INLINE_KEY ? allocator->allocate_bytes(key.size()) : nullptr;
+        uint64_t word = 0;
+        if (inline_width.load(std::memory_order_relaxed)) word = to_word(std::exchange(value, nullptr));
+        Node* node = new (allocator->allocate_node(sizeof(Node), alignof(Node))) Node(key, spill, std::move(value));
+        node->word.store(word, std::memory_order_relaxed);
+        // Inserts call this with the insertion parent locked, so the stamp is read under the lock like for updates.
+        node->stamp.store(clock.load(std::memory_order_seq_cst), std::memory_order_relaxed);
+        return node;
+    }
+
+    Value ConcurrentTree::load_value(const Node* node) const {
+        size_t width = inline_width.load(std::memory_order_relaxed);
+        if (!width) return std::atomic_load(&node->value);
+        uint64_t word = node->word.load(std::memory_order_acquire);
+        auto value = std::make_shared<std::vector<unsigned char>>(width);
+        std::memcpy(value->data(), &word, width);
+        return value;
+    }
+
+    uint64_t ConcurrentTree::to_word(const Value& value) const {
+        uint64_t word = 0;
+        if (value) std::memcpy(&word, value->data(), std::min<size_t>(value->size(), inline_width.load(std::memory_order_relaxed)));
+        return word;
+    }
+
+    bool ConcurrentTree::setInlineValues(size_t width) {
+        if (width < 1 || width > sizeof(uint64_t) || root.load(std::memory_order_acquire)) return false;
+        inline_width.store(uint8_t(width), std::memory_order_release);
+        return true;
+    }
+
+    void ConcurrentTree::putInline(std::span<const unsigned char> key, uint64_t word) {
+        // An existing key takes the word in place, only an insert builds a buffer, to go through put() like any other.
+        {
+            auto guard = epoch.pin();
+            Node* node = nullptr;
+            if (search(SearchKey(key), [&node](Node* found) { node = found; }) && begin_write(node)) {
+                counters.add(Counter::Puts);
+                store_word(node, word, guard);
+                uint64_t sequence = sequence_change();
+                Value value = sequence ? load_value(node) : nullptr;
+                end_write(node);
+                publish_change(sequence, key, value);
+                return;
             }
         }
-        // If tree is uninitialized, first while will eval to false, therefore we return NULL.
-        return NULL_VALUE;
+        auto value = std::make_shared<std::vector<unsigned char>>(inline_width.load(std::memory_order_relaxed));
+        std::memcpy(value->data(), &word, value->size());
+        put(key, std::move(value));
     }
 
-    void ConcurrentTree::put(const std::vector<unsigned char>& key, const std::vector<unsigned char>& value) {
+    bool ConcurrentTree::getInline(std::span<const unsigned char> key, uint64_t& word) {
+        counters.add(Counter::Finds);
+        auto guard = epoch.pin();
+        return search(SearchKey(key), [&word](const Node* node) { word = node->word.load(std::memory_order_acquire); });
+    }
+
+    void ConcurrentTree::index_node(Node* node) {
+        if (!index) return;
+        uint64_t hash = HashIndex::hash(node->key());
+        if (!index->insert(hash, node)) return;
+        // Pairs with unindex(), an erase that raced the insert either finds the entry or is seen here.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (node->version.load(std::memory_order_relaxed) & OBSOLETE) index->remove(hash, node);
+    }
+
+    void ConcurrentTree::unindex(Node* node) {
+        if (!index) return;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        index->remove(HashIndex::hash(node->key()), node);
+    }
+
+    void ConcurrentTree::destroy_node(Node* node) {
+        reclaim_history(node->history.load(std::memory_order_relaxed), nullptr);
+        if (node->spilled()) allocator->release_bytes(node->key_spill, node->key_size);
+        node->~Node();
+        allocator->release_node(node, sizeof(Node), alignof(Node));
+    }
+
+    void ConcurrentTree::put(std::span<const unsigned char> key, Value value) {
+        if (!combining.load(std::memory_order_acquire) || !combine(key, value)) put_direct(key, value);
+        enforce_capacity();
+    }
+
+    void ConcurrentTree::put_direct(std::span<const unsigned char> key, const Value& value) {
+        upsert(key, [&value](const Value&) { return value; });
+    }
+
+    bool ConcurrentTree::putIfAbsent(std::span<const unsigned char> key, std::vector<unsigned char> value) {
+        return putIfAbsent(key, std::make_shared<const std::vector<unsigned char>>(std::move(value)));
+    }
+
+    bool ConcurrentTree::putIfAbsent(std::span<const unsigned char> key, Value value) {
+        bool inserted = false;
+        upsert(key, [&](const Value& current) {
+            inserted = !current;
+            return inserted ? value : nullptr;
+        });
+        enforce_capacity();
+        return inserted;
+    }
+
+    bool ConcurrentTree::compareAndSet(std::span<const unsigned char> key, const Value& expected, Value desired) {
+        if (!desired) return false;
+        bool matched = false;
+        upsert(key, [&](const Value& current) {
+            matched = current == expected || (current && expected && *current == *expected);
+            return matched ? desired : nullptr;
+        });
+        enforce_capacity();
+        return matched;
+    }
+
+    Value ConcurrentTree::compute(std::span<const unsigned char> key, const ComputeFn& fn) {
+        Value value = upsert(key, fn);
+        enforce_capacity();
+        return value;
+    }
+
+    template <class Update>
+    Value ConcurrentTree::upsert(std::span<const unsigned char> key, Update&& update) {
         // For this to work, we have to keep the value and key of the node immutable.
-        Node* node = new Node(key, value);
+        counters.add(Counter::Puts);
+        auto guard = epoch.pin();
+        const SearchKey search(key);
+        uint64_t seen_relinks = relinks.load(std::memory_order_acquire);
+        Path path(*this);
+        enter_fence(search, path, seen_relinks);
+        Backoff backoff;
 
         while (true) {
             // Empty Tree
             Node* _root = root.load(std::memory_order_acquire);
             if (!_root) {
+                // No node to lock yet, update runs again if another thread adds the first key meanwhile.
+                Value value = update(Value());
+                if (!value) return nullptr;
+                Node* node = make_node(key, value);
+                node->color.store(BLACK, std::memory_order_relaxed);
+                // Published locked and stamped only then, a snapshot opened before the CAS never sees the key.
+                node->version.store(1, std::memory_order_relaxed);
                 if (root.compare_exchange_strong(_root, node, std::memory_order_release, std::memory_order_acquire)) {
-                    node->color.store(BLACK, std::memory_order_relaxed);
-                    return;
+                    node->stamp.store(clock.load(std::memory_order_seq_cst), std::memory_order_relaxed);
+                    uint64_t sequence = sequence_change();
+                    end_write(node);
+                    publish_change(sequence, key, value);
+                    index_node(node);
+                    charge(footprint(node->key_size, value));
+                    elements.add(1);
+                    counters.add(Counter::Inserts);
+                    return value;
                 }
-                continue; // Other thread raced.
+                destroy_node(node); // Other thread raced, node was never visible.
+                continue;
             }
 
-            Node* current = _root;
+            Node* current;
+            uint64_t version;
+            // Resume below the deepest unchanged ancestor, the root is only the last resort.
+            if (!path.resume(current, version)) {
+                seen_relinks = relinks.load(std::memory_order_acquire);
+                if (!load_root(current, version)) {
+                    backoff.pause();
+                    continue;
+                }
+                if (!current) continue; // emptied meanwhile
+            }
+
+            // Optimistic search, this loop will iterate through the tree until the place of insertion and resume
+            // from an ancestor when someone else raced. A child's version is only trusted once its parent is
+            // re-validated after reading it.
             Node* parent = nullptr;
             bool go_right = false;
-
-            // Optimistic search, this loop will iterate through the tree until the place of insertion and reset to root
-            // when someone else raced.
             while (true) {
-                uint64_t version_first = current->version.load(std::memory_order_acquire);
-                // Write in process from other thread
-                if (version_first & 1u) {
-                    current = root.load(std::memory_order_acquire);
-                    if (!current) break;
-                    parent = nullptr;
-                    continue;
-                }
-                if (current->key == key) { // If key is the same, replace value.
-                    auto new_value = std::make_shared<const std::vector<unsigned char>>(value);
-                    std::unique_lock<std::mutex> lock(current->lock); // serialize writers on this node.
-                    begin_write(current);
-                    std::atomic_store(&current->value, new_value);
+                int order = compare(current, search);
+                if (order == 0) { // If key is the same, replace value in place under the node's lock.
+                    if (!begin_write(current)) break; // erased meanwhile, retry as an insert.
+                    Value old = load_value(current);
+                    Value value = update(old);
+                    if (!value) { // nothing to change, readers keep their validated version
+                        abort_write(current);
+                        return old;
+                    }
+                    store_value(current, value, guard);
+                    uint64_t sequence = sequence_change();
                     end_write(current);
-                    return;
+                    publish_change(sequence, key, value);
+                    return value;
                 }
-                parent = current;
-                go_right = current->key < key;
+                go_right = order < 0;
                 Node* next = go_right ? current->right.load(std::memory_order_acquire) : current->left.load(std::memory_order_acquire);
+                uint64_t next_version = next ? next->version.load(std::memory_order_acquire) : 0;
 
-                uint64_t version_second = current->version.load(std::memory_order_acquire);
-                if (version_first != version_second || version_second & 1) { // Some thread raced, changing versions.
-                    current = root.load(std::memory_order_acquire);
-                    parent = nullptr;
-                    continue;
+                if (current->version.load(std::memory_order_acquire) != version) break; // Some thread raced, changing versions.
+                if (!next) { // found insertion parent.
+                    parent = current;
+                    break;
                 }
-                if (!next) break; // found insertion parent.
+                path.push(current, version);
+                if (next_version & 1u) break;
                 current = next;
+                version = next_version;
             }
-            if (!parent) continue; // Tree changed; Retry the operation.
-
-            std::unique_lock<std::mutex> lock(parent->lock);
-            begin_write(parent);
 
-            Node* observed = go_right ? parent->right.load(std::memory_order_acquire) : parent->left.load(std::memory_order_acquire);
-            if (observed != nullptr) { // lost race for the node.
-                end_write(parent);
-                lock.unlock();
+            // Lock the parent only if nothing touched it since it was validated, its empty slot is then still ours.
+            if (!parent || !try_begin_write(parent, version)) {
+                backoff.pause();
+                continue; // Tree changed; Retry the operation.
+            }
+            // An erase that moved a successor up may have carried our key above the node we resumed from.
+            if (relinks.load(std::memory_order_acquire) != seen_relinks) {
+                abort_write(parent);
+                path.clear();
                 continue;
             }
 
+            // The slot is ours, the key is known to be absent for as long as the parent stays locked.
+            Value value = update(Value());
+            if (!value) {
+                abort_write(parent);
+                return nullptr;
+            }
+
+            // Insertion is certain now, only this path allocates a node.
+            Node* node = make_node(key, value);
             node->parent.store(parent, std::memory_order_relaxed);
             if (go_right) parent->right.store(node, std::memory_order_relaxed);
             else parent->left.store(node, std::memory_order_relaxed);
+            uint64_t sequence = sequence_change();
             end_write(parent);
-            lock.unlock();
-            fixInsert(node); // Rebalancing of RED / BLACK tree after insertion.
+            publish_change(sequence, key, value);
+            index_node(node);
+            charge(footprint(node->key_size, value));
+            elements.add(1);
+            counters.add(Counter::Inserts);
+            balance_insert(node); // Rebalancing of RED / BLACK tree after insertion.
+            return value;
+        }
+    }
+
+    void ConcurrentTree::fixInsert(Node* leaf) {
+        // Checked before waiting for the lock: a BLACK node only turns RED while its children turn BLACK, so a leaf
+        // under a BLACK parent never needs a repair later.
+        if (!violates(leaf)) return;
+        std::lock_guard<std::mutex> held(restructuring);
+        fixRed(leaf);
+    }
+
+    void ConcurrentTree::fixRed(Node* leaf) {
+        Node* node = leaf;
+        while (node) {
+            Node* resume = nullptr; // the violation left pending below while repairing one above it
+            while (true) {
+                // Settled meanwhile by the repair of another insert, or erased, its eraser rebalances from there.
+                if (!violates(node)) break;
+                Node* parent = node->parent.load(std::memory_order_relaxed);
+                Node* grandparent = parent->parent.load(std::memory_order_relaxed);
+                if (!grandparent) { // a RED root, a violation held up below may be waiting on it
+                    blacken_root();
+                    break;
+                }
+                // A RED grandparent means the violation above is still pending, from a racing insert or a deferred one
+                // in relaxed balance. Recoloring or rotating below it would leave the black heights uneven, it goes
+                // first.
+                if (load_color(grandparent) == RED) {
+                    if (!resume) resume = node;
+                    node = parent;
+                    continue;
+                }
+
+                bool parent_is_left = child_of(grandparent, true) == parent;
+                bool node_is_left = child_of(parent, true) == node;
+                Node* uncle = child_of(grandparent, !parent_is_left);
+                Node* top = grandparent->parent.load(std::memory_order_relaxed);
+                // Revalidated once the nodes are locked, a put may have linked a leaf into any empty place meanwhile.
+                auto linked = [&] {
+                    return node->parent.load(std::memory_order_relaxed) == parent && child_of(parent, node_is_left) == node
+                        && parent->parent.load(std::memory_order_relaxed) == grandparent && child_of(grandparent, parent_is_left) == parent
+                        && child_of(grandparent, !parent_is_left) == uncle && grandparent->parent.load(std::memory_order_relaxed) == top
+                        && (top ? child_of(top, true) == grandparent || child_of(top, false) == grandparent : root.load(std::memory_order_relaxed) == grandparent);
+                };
+
+                // Case I: uncle RED, recolor and go on from the grandparent.
+                if (load_color(uncle) == RED) {
+                    bool valid = restructure({ grandparent, parent, uncle }, linked, [&] {
+                        parent->color.store(BLACK, std::memory_order_relaxed);
+                        uncle->color.store(BLACK, std::memory_order_relaxed);
+                        grandparent->color.store(RED, std::memory_order_relaxed);
+                    });
+                    if (valid) node = grandparent;
+                    continue;
+                }
+
+                // Case II: uncle BLACK, node on the outer side. One rotation around the grandparent lifts parent above it.
+                if (node_is_left == parent_is_left) {
+                    Node* inner = child_of(parent, !node_is_left);
+                    bool valid = restructure({ top, grandparent, parent, inner },
+                        [&] { return linked() && child_of(parent, !node_is_left) == inner; },
+                        [&] {
+                            parent->color.store(BLACK, std::memory_order_relaxed);
+                            grandparent->color.store(RED, std::memory_order_relaxed);
+                            rotate(grandparent, !parent_is_left);
+                        });
+                    if (valid) break;
+                }
+                // Case III: uncle BLACK, node on the inner side. Two rotations lift node above both, as one step.
+                else {
+                    Node* left = child_of(node, true);
+                    Node* right = child_of(node, false);
+                    bool valid = restructure({ top, grandparent, parent, node, left, right },
+                        [&] { return linked() && child_of(node, true) == left && child_of(node, false) == right; },
+                        [&] {
+                            node->color.store(BLACK, std::memory_order_relaxed);
+                            grandparent->color.store(RED, std::memory_order_relaxed);
+                            rotate(parent, parent_is_left);
+                            rotate(grandparent, !parent_is_left);
+                        });
+                    if (valid) break;
+                }
+                counters.add(Counter::RotationRetries);
+            }
+            // Having settled a violation above it, go back to the one it held up.
+            node = resume && violates(resume) ? resume : nullptr;
+        }
+
+        blacken_root();
+    }
+
+    void ConcurrentTree::balance_insert(Node* node) {
+        // Under a BLACK parent nothing needs repairing, in relaxed mode only RED-RED links are queued.
+        if (load_color(node->parent.load(std::memory_order_relaxed)) == RED && repairs.push(node->key())) {
+            counters.add(Counter::DeferredRepairs);
             return;
         }
+        fixInsert(node);
     }
 
-    void ConcurrentTree::fixInsert(Node* node) {
+    void ConcurrentTree::setChangeFeed(bool enabled) {
+        if (enabled && !feed) feed = std::make_unique<ChangeFeed>();
+        feeding.store(enabled, std::memory_order_release);
+    }
+
+    void ConcurrentTree::setBalance(Balance mode, std::chrono::milliseconds interval) {
+        if (mode == Balance::Relaxed) {
+            repairs.start([this] { rebalance(); }, interval);
+            return;
+        }
+        repairs.stop();
+        rebalance();
+    }
+
+    size_t ConcurrentTree::rebalance() {
+        std::vector<std::vector<unsigned char>> keys;
+        repairs.drain(keys);
+        // In key order, consecutive repairs climb through the same upper levels while they are still cached. Keys
+        // are looked up again, a queued node may have been erased and reclaimed since.
+        std::sort(keys.begin(), keys.end(), [](const std::vector<unsigned char>& a, const std::vector<unsigned char>& b) {
+            return compare(a, b) < 0;
+        });
+        for (const auto& key : keys) {
+            Iterator it = lower_bound(key);
+            if (it.valid() && compare(it.key(), key) == 0) fixInsert(it.current);
+        }
+        return keys.size();
+    }
+
+    void ConcurrentTree::blacken_root() {
+        // Root must be BLACK
+        while (Node* _root = root.load(std::memory_order_acquire)) {
+            if (!begin_write(_root)) continue; // root erased under us, recolor the new one.
+            _root->color.store(BLACK, std::memory_order_relaxed);
+            end_write(_root);
+            return;
+        }
+    }
+
+    bool ConcurrentTree::erase(std::span<const unsigned char> key) {
+        counters.add(Counter::Erases);
+        auto guard = epoch.pin();
+        const SearchKey search(key);
+
         while (true) {
-            Node* parent = node->parent.load(std::memory_order_relaxed);
-            if (!parent || parent->color.load(std::memory_order_relaxed) == BLACK) break;
+            uint64_t seen_relinks = relinks.load(std::memory_order_acquire);
+            Node* target = root.load(std::memory_order_acquire);
+            bool raced = false;
 
-            Node* grandparent = parent->parent.load(std::memory_order_relaxed);
-            if (!grandparent) break;
+            // Optimistic search for the node holding the key, same protocol as get().
+            while (target) {
+                uint64_t version_first = target->version.load(std::memory_order_acquire);
+                if (version_first & 1u) { raced = true; break; }
+                int order = compare(target, search);
+                if (order == 0) break;
+                Node* next = order < 0 ? target->right.load(std::memory_order_acquire) : target->left.load(std::memory_order_acquire);
+                uint64_t version_second = target->version.load(std::memory_order_acquire);
+                if (version_first != version_second) { raced = true; break; }
+                target = next;
+            }
+            if (raced) continue;
+            if (!target) {
+                if (relinks.load(std::memory_order_acquire) == seen_relinks) return false;
+                continue; // a successor moved up past us, search again.
+            }
 
-            bool parent_is_left = (grandparent->left.load(std::memory_order_relaxed) == parent);
-            Node* uncle = parent_is_left
-                ? grandparent->right.load(std::memory_order_relaxed)
-                : grandparent->left.load(std::memory_order_relaxed);
+            Node* parent = target->parent.load(std::memory_order_relaxed);
+            Node* left = target->left.load(std::memory_order_relaxed);
+            Node* right = target->right.load(std::memory_order_relaxed);
+            Node* successor = nullptr;
+            Node* successor_parent = nullptr;
+            Node* successor_right = nullptr;
 
-            // Case I: recolor if uncle is RED
-            if (uncle && uncle->color.load(std::memory_order_relaxed) == RED) {
-                std::vector<Node*> locked{ grandparent, parent, uncle };
-                lock_adress_order(locked);
+            // With two children the in-order successor takes the place of target, since keys are immutable.
+            LockSet<7> locked{ parent, target, left, right };
+            if (left && right) {
+                successor = right;
+                while (Node* next = successor->left.load(std::memory_order_acquire)) successor = next;
+                successor_parent = successor->parent.load(std::memory_order_relaxed);
+                successor_right = successor->right.load(std::memory_order_relaxed);
+                locked.add(successor);
+                locked.add(successor_parent);
+                locked.add(successor_right);
+            }
+            // Unlinking a BLACK node leaves its paths one short until fixErase is done, no other repair may see that.
+            std::unique_lock<std::mutex> held(restructuring);
+            if (!locked.lock(*this)) continue;
 
-                begin_write(grandparent);
-                begin_write(parent);
-                begin_write(uncle);
+            bool valid = (target->parent.load(std::memory_order_relaxed) == parent)
+                && (target->left.load(std::memory_order_relaxed) == left)
+                && (target->right.load(std::memory_order_relaxed) == right)
+                && (parent ? (parent->left.load(std::memory_order_relaxed) == target || parent->right.load(std::memory_order_relaxed) == target)
+                    : root.load(std::memory_order_relaxed) == target);
+            if (valid && successor) {
+                valid = !successor->left.load(std::memory_order_relaxed)
+                    && (successor->parent.load(std::memory_order_relaxed) == successor_parent)
+                    && (successor->right.load(std::memory_order_relaxed) == successor_right)
+                    && (successor == right || successor_parent->left.load(std::memory_order_relaxed) == successor);
+            }
 
-                bool valid = (parent->parent.load(std::memory_order_relaxed) == grandparent)
-                    && ((grandparent->left.load(std::memory_order_relaxed) == parent)
-                        || (grandparent->right.load(std::memory_order_relaxed) == parent))
-                    && (uncle == (parent_is_left ? grandparent->right.load(std::memory_order_relaxed) : grandparent->left.load(std::memory_order_relaxed)))
-                    && (parent->color.load(std::memory_order_relaxed) == RED)
-                    && (uncle->color.load(std::memory_order_relaxed) == RED);
+            // Rollback, another writer restructured the neighbourhood first.
+            if (!valid) {
+                locked.abort();
+                continue;
+            }
 
-                if (valid) {
-                    parent->color.store(BLACK, std::memory_order_relaxed);
-                    uncle->color.store(BLACK, std::memory_order_relaxed);
-                    grandparent->color.store(RED, std::memory_order_relaxed);
+            bury(target);
+            Node* child; // takes the place of the removed position, rebalancing starts from it
+            Node* child_parent;
+            uint8_t removed_color;
+            bool child_is_left;
+            if (!successor) {
+                child = left ? left : right;
+                child_parent = parent;
+                child_is_left = parent && child_of(parent, true) == target;
+                removed_color = target->color.load(std::memory_order_relaxed);
+                replace_child(parent, target, child);
+                if (child) child->parent.store(parent, std::memory_order_relaxed);
+            }
+            else {
+                child = successor_right;
+                if (successor != right) {
+                    successor_parent->left.store(successor_right, std::memory_order_relaxed);
+                    if (successor_right) successor_right->parent.store(successor_parent, std::memory_order_relaxed);
+                    successor->right.store(right, std::memory_order_relaxed);
+                    right->parent.store(successor, std::memory_order_relaxed);
+                    child_parent = successor_parent;
+                    child_is_left = true;
+                }
+                else {
+                    child_parent = successor;
+                    child_is_left = false;
                 }
+                successor->left.store(left, std::memory_order_relaxed);
+                left->parent.store(successor, std::memory_order_relaxed);
+                successor->parent.store(parent, std::memory_order_relaxed);
+                replace_child(parent, target, successor);
+                removed_color = successor->color.load(std::memory_order_relaxed);
+                successor->color.store(target->color.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                relinks.fetch_add(1, std::memory_order_release);
+            }
 
-                end_write(uncle);
-                end_write(parent);
-                end_write(grandparent);
-                unlock_reverse(locked);
+            // target stays write-locked forever, every other node is released.
+            mark_obsolete(target);
+            unindex(target);
+            unlist(target);
+            // Pairs with the fence in rebuildFence(), either the builder sees the node obsolete or this sees it fenced.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (target->fenced.load(std::memory_order_relaxed)) drop_fence(guard);
+            if (capacity.load(std::memory_order_relaxed)) charge(-int64_t(footprint(target->key_size, load_value(target))));
+            uint64_t sequence = sequence_change();
+            locked.unlock();
+            if (removed_color == BLACK) fixErase(child, child_parent, child_is_left);
+            // Taking the color of a RED target under a RED parent, the successor now holds a link only target's
+            // queued key stood for in relaxed mode.
+            if (successor && violates(successor)) fixRed(successor);
+            held.unlock();
+            publish_change(sequence, key, nullptr);
+            guard.retire(target, reclaim, this);
+            elements.add(-1);
+            counters.add(Counter::Removals);
+            return true;
+        }
+    }
 
-                if (valid) {
-                    node = grandparent;
-                    continue;
-                }
-                else continue; // retry this step
+    void ConcurrentTree::replace_child(Node* parent, Node* old_child, Node* new_child) {
+        if (!parent) root.store(new_child, std::memory_order_release);
+        else if (parent->left.load(std::memory_order_relaxed) == old_child) parent->left.store(new_child, std::memory_order_release);
+        else parent->right.store(new_child, std::memory_order_release);
+    }
+
+    template <class Valid, class Apply>
+    bool ConcurrentTree::restructure(LockSet<6> locked, Valid&& valid, Apply&& apply) {
+        if (!locked.lock(*this)) return false;
+        bool applied = valid();
+        if (applied) {
+            apply();
+            locked.unlock();
+            counters.add(Counter::Recolors);
+        }
+        else locked.abort();
+        return applied;
+    }
+
+    void ConcurrentTree::fixErase(Node* node, Node* parent, bool node_is_left) {
+        // The place of node carries an extra BLACK. It is followed by parent and side: node may be a nullptr leaf, and
+        // only a put can touch the neighbourhood while the restructuring lock is held, linking a RED leaf into it.
+        std::vector<Node*> lifted; // siblings that took a RED parent's color, under a RED node in relaxed mode
+        while (parent) {
+            node = child_of(parent, node_is_left);
+            if (load_color(node) == RED) break; // refilled by a put, or pushed up to a RED node, it absorbs the BLACK
+            Node* sibling = child_of(parent, !node_is_left);
+            assert(sibling); // the other side of an extra BLACK holds at least one BLACK node
+            Node* near = child_of(sibling, node_is_left);
+            Node* far = child_of(sibling, !node_is_left);
+            Node* top = parent->parent.load(std::memory_order_relaxed);
+            // Revalidated once the nodes are locked, every case rotates or recolors in the same step.
+            auto linked = [&] {
+                return child_of(parent, node_is_left) == node && child_of(parent, !node_is_left) == sibling
+                    && child_of(sibling, node_is_left) == near && child_of(sibling, !node_is_left) == far;
+            };
+
+            // Case I: sibling RED, recolor and rotate towards node so the new sibling is BLACK. The parent is BLACK
+            // unless a RED-RED link waits for the maintainer, the sibling takes its color either way.
+            if (load_color(sibling) == RED) {
+                bool valid = restructure({ top, parent, sibling, near }, linked, [&] {
+                    sibling->color.store(parent->color.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                    parent->color.store(RED, std::memory_order_relaxed);
+                    rotate(parent, node_is_left);
+                });
+                if (!valid) counters.add(Counter::RotationRetries);
+                else if (load_color(sibling) == RED) lifted.push_back(sibling);
+                continue;
             }
 
-            // Case II : Uncle BLACK, left / right rotations
-            if (parent_is_left) {
-                if (parent->right.load(std::memory_order_relaxed) == node) {
-                    left_rotate(parent);// Left Rotation around parent
+            // Case II: both nephews BLACK, push the extra BLACK up.
+            if (load_color(near) == BLACK && load_color(far) == BLACK) {
+                bool valid = restructure({ parent, sibling, near, far }, linked, [&] { sibling->color.store(RED, std::memory_order_relaxed); });
+                if (valid) {
+                    if (top) node_is_left = child_of(top, true) == parent;
                     node = parent;
-                    parent = node->parent.load(std::memory_order_relaxed);
-                    grandparent = parent ? parent->parent.load(std::memory_order_relaxed) : nullptr;
-                    if (!parent || !grandparent) break;
+                    parent = top;
                 }
-                right_rotate(grandparent);// Right Rotate around grand parent
+                continue;
+            }
+
+            // Case III: far nephew BLACK, rotate the near RED nephew into its place.
+            if (load_color(far) == BLACK) {
+                Node* moved = child_of(near, !node_is_left);
+                bool valid = restructure({ parent, sibling, near, moved },
+                    [&] { return linked() && child_of(near, !node_is_left) == moved; },
+                    [&] {
+                        near->color.store(BLACK, std::memory_order_relaxed);
+                        sibling->color.store(RED, std::memory_order_relaxed);
+                        rotate(sibling, !node_is_left);
+                    });
+                if (!valid) counters.add(Counter::RotationRetries);
+                continue;
+            }
+
+            // Case IV: far nephew RED, one rotation around parent absorbs the extra BLACK.
+            bool valid = restructure({ top, parent, sibling, near, far }, linked, [&] {
+                sibling->color.store(parent->color.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                parent->color.store(BLACK, std::memory_order_relaxed);
+                far->color.store(BLACK, std::memory_order_relaxed);
+                rotate(parent, node_is_left);
+            });
+            if (valid) {
+                if (load_color(sibling) == RED) lifted.push_back(sibling);
+                node = nullptr;
+                break;
+            }
+            counters.add(Counter::RotationRetries);
+        }
 
-                std::vector<Node*> locked{ parent, grandparent };
-                lock_adress_order(locked);
-                begin_write(parent);
-                begin_write(grandparent);
+        if (node) restructure({ node }, [] { return true; }, [&] { node->color.store(BLACK, std::memory_order_relaxed); });
+        blacken_root();
+        // Black heights are even again, the RED-RED links the lifted siblings took over from their parents follow.
+        for (Node* sibling : lifted) {
+            if (violates(sibling)) fixRed(sibling);
+        }
+    }
 
-                bool valid = (grandparent->parent.load(std::memory_order_relaxed) == parent)
-                    && ((parent->left.load(std::memory_order_relaxed) == grandparent) ||
-                        (parent->right.load(std::memory_order_relaxed) == grandparent));
+    ConcurrentTree::Iterator ConcurrentTree::begin() {
+        return lower_bound({});
+    }
 
-                if (valid) {
-                    parent->color.store(BLACK, std::memory_order_relaxed);
-                    grandparent->color.store(RED, std::memory_order_relaxed);
-                }
+    ConcurrentTree::Iterator ConcurrentTree::lower_bound(std::span<const unsigned char> key) {
+        Iterator it(*this);
+        it.seek(SearchKey(key), true);
+        return it;
+    }
 
-                end_write(grandparent);
-                end_write(parent);
-                unlock_reverse(locked);
+    void ConcurrentTree::scan(std::span<const unsigned char> lo, std::span<const unsigned char> hi, const ScanVisitor& visitor) {
+        counters.add(Counter::Scans);
+        for (Iterator it = lower_bound(lo); it.valid(); it.next()) {
+            if (compare(it.key(), hi) >= 0) return;
+            if (!visitor(it.key(), it.value())) return;
+        }
+    }
+
+    void ConcurrentTree::Iterator::next() {
+        // Keys are immutable and the node is pinned, so the current key can be the search key in place.
+        seek(SearchKey(current->key()), false);
+    }
 
-                if (!valid) continue;
+    void ConcurrentTree::Iterator::seek(const SearchKey& key, bool inclusive) {
+        Backoff backoff;
+        while (true) {
+            // A remembered node with an unchanged version still spans the same key interval, so the answer lies
+            // below it. Nodes that changed are dropped, the root is the resume point of last resort.
+            while (!path.empty() && path.back().node->version.load(std::memory_order_acquire) != path.back().version) path.pop_back();
+
+            bool consistent;
+            if (!path.empty()) {
+                Step from = path.back();
+                path.pop_back();
+                consistent = descend(from.node, from.version, key, inclusive);
+            }
+            else if (Node* _root = tree->root.load(std::memory_order_acquire)) {
+                uint64_t version = _root->version.load(std::memory_order_acquire);
+                consistent = !(version & 1u) && tree->root.load(std::memory_order_acquire) == _root && descend(_root, version, key, inclusive);
+            }
+            else consistent = true;
+            if (!consistent) {
+                backoff.pause();
+                continue;
             }
-            else {
-                if (parent->left.load(std::memory_order_relaxed) == node) {
-                    right_rotate(parent);
-                    node = parent;
-                    parent = node->parent.load(std::memory_order_relaxed);
-                    grandparent = parent ? parent->parent.load(std::memory_order_relaxed) : nullptr;
-                    if (!parent || !grandparent) break;
-                }
-                left_rotate(grandparent);
 
-                std::vector<Node*> locked{ parent, grandparent };
-                lock_adress_order(locked);
-                begin_write(parent);
-                begin_write(grandparent);
+            // The last node the path turned left at is the answer, empty path means past the end.
+            if (path.empty()) {
+                current = nullptr;
+                current_value = nullptr;
+                return;
+            }
+            Step found = path.back();
+            Value value = tree->load_value(found.node);
+            if (found.node->version.load(std::memory_order_acquire) != found.version) {
+                backoff.pause();
+                continue;
+            }
+            current = found.node;
+            current_value = std::move(value);
+            return;
+        }
+    }
 
-                bool valid = (grandparent->parent.load(std::memory_order_relaxed) == parent)
-                    && ((parent->left.load(std::memory_order_relaxed) == grandparent)
-                        || (parent->right.load(std::memory_order_relaxed) == grandparent));
+    bool ConcurrentTree::Iterator::descend(Node* node, uint64_t version, const SearchKey& key, bool inclusive) {
+        // Hand over hand: a child's version only counts once its parent is re-validated after reading it.
+        while (true) {
+            int order = compare(node, key);
+            bool go_left = inclusive ? order >= 0 : order > 0;
+            if (go_left) path.push_back({ node, version });
+            Node* next = go_left ? node->left.load(std::memory_order_acquire) : node->right.load(std::memory_order_acquire);
+            uint64_t next_version = next ? next->version.load(std::memory_order_acquire) : 0;
+            if (node->version.load(std::memory_order_acquire) != version) return false;
+            if (!next) return true;
+            if (next_version & 1u) return false;
+            node = next;
+            version = next_version;
+        }
+    }
 
-                if (valid) {
-                    parent->color.store(BLACK, std::memory_order_relaxed);
-                    grandparent->color.store(RED, std::memory_order_relaxed);
-                }
+    bool ConcurrentTree::bulkLoad(std::span<const Record> sorted, BulkMode mode, unsigned threads) {
+        // Checked in every build, one pass over the keys is cheap next to building the nodes, and unsorted or duplicate
+        // keys would leave a tree searches go astray in.
+        bool ascending = std::adjacent_find(sorted.begin(), sorted.end(), [](const Record& a, const Record& b) {
+            return compare(a.key, b.key) >= 0;
+        }) == sorted.end();
+        if (!ascending) return false;
+        if (!threads) threads = std::max(1u, std::thread::hardware_concurrency());
+        if (mode == BulkMode::Build && root.load(std::memory_order_acquire)) return false;
+        const std::span<const Record> loaded = sorted; // a merge adds the old keys to sorted
+        auto guard = epoch.pin();
 
-                end_write(grandparent);
-                end_write(parent);
-                unlock_reverse(locked);
+        // Without writers the old tree holds still, its nodes are read in order and merged with the records.
+        std::vector<Node*> old;
+        std::vector<Node*> stack;
+        for (Node* node = root.load(std::memory_order_acquire); node || !stack.empty();) {
+            if (node) {
+                stack.push_back(node);
+                node = node->left.load(std::memory_order_acquire);
+                continue;
+            }
+            node = stack.back();
+            stack.pop_back();
+            old.push_back(node);
+            node = node->right.load(std::memory_order_acquire);
+        }
+        if (!old.empty() && mode == BulkMode::Build) return false;
+        if (sorted.empty()) return true;
 
-                if (!valid) continue;
+        std::vector<Record> merged;
+        if (!old.empty()) {
+            merged.reserve(old.size() + sorted.size());
+            size_t i = 0, j = 0;
+            while (i < old.size() || j < sorted.size()) {
+                int order = i == old.size() ? 1 : j == sorted.size() ? -1 : compare(old[i]->key(), sorted[j].key);
+                if (order < 0) {
+                    merged.push_back({ old[i]->key(), load_value(old[i]) });
+                    i++;
+                    continue;
+                }
+                merged.push_back(sorted[j++]);
+                if (order == 0) i++;
             }
+            sorted = merged;
+        }
 
-            break; // Rotation path finished
+        // Null links sit at depth h or h + 1 of a midpoint built tree, where h = floor(log2(n + 1)). Nodes on the
+        // deepest level are RED, so every path counts h BLACK nodes.
+        size_t red_depth = std::bit_width(sorted.size() + 1) - 1;
+        Node* built = build(sorted, 0, red_depth, threads);
+
+        if (old.empty()) {
+            Node* empty = nullptr;
+            if (!root.compare_exchange_strong(empty, built, std::memory_order_release, std::memory_order_relaxed)) {
+                deleteTree(built); // a writer broke the precondition, nobody saw the new nodes
+                return false;
+            }
+        }
+        else {
+            root.store(built, std::memory_order_release);
+            drop_fence(guard); // its nodes are about to be retired
+            // Readers still inside the old tree fail their next validation and restart from the new root.
+            for (Node* node : old) {
+                begin_write(node);
+                mark_obsolete(node);
+                unindex(node);
+                unlist(node);
+                guard.retire(node, reclaim, this);
+            }
+        }
+        // Indexed only once published, until then the index holds no key the tree doesn't.
+        if (index) {
+            for (Node* node = built; node || !stack.empty();) {
+                if (node) {
+                    stack.push_back(node);
+                    node = node->left.load(std::memory_order_acquire);
+                    continue;
+                }
+                node = stack.back();
+                stack.pop_back();
+                index_node(node);
+                node = node->right.load(std::memory_order_acquire);
+            }
         }
+        if (capacity.load(std::memory_order_relaxed)) {
+            int64_t bytes = 0;
+            for (const Record& record : sorted) bytes += footprint(record.key.size(), record.value);
+            for (Node* node : old) bytes -= footprint(node->key_size, load_value(node));
+            charge(bytes);
+        }
+        elements.add(int64_t(sorted.size()) - int64_t(old.size()));
+        counters.add(Counter::Inserts, sorted.size() - old.size());
+        // Reported once published. No other thread writes meanwhile, so the numbers follow the records' order.
+        if (feeding.load(std::memory_order_relaxed)) {
+            for (const Record& record : loaded) publish_change(sequence_change(), record.key, record.value);
+        }
+        enforce_capacity();
+        return true;
+    }
 
-        // Root must be BLACK
-        Node* _root = root.load(std::memory_order_acquire);
-        if (_root) {
-            std::unique_lock<std::mutex> locked(_root->lock);
-            begin_write(_root);
-            _root->color.store(BLACK, std::memory_order_relaxed);
-            end_write(_root);
+    Node* ConcurrentTree::build(std::span<const Record> sorted, size_t depth, size_t red_depth, unsigned threads) {
+        if (sorted.empty()) return nullptr;
+        size_t middle = sorted.size() / 2;
+        Node* node = make_node(sorted[middle].key, sorted[middle].value);
+        node->color.store(depth == red_depth ? RED : BLACK, std::memory_order_relaxed);
+
+        Node* left;
+        Node* right;
+        if (threads > 1 && sorted.size() >= PARALLEL_BUILD) {
+            std::thread worker([&] { left = build(sorted.first(middle), depth + 1, red_depth, threads / 2); });
+            right = build(sorted.subspan(middle + 1), depth + 1, red_depth, threads - threads / 2);
+            worker.join();
         }
+        else {
+            left = build(sorted.first(middle), depth + 1, red_depth, 1);
+            right = build(sorted.subspan(middle + 1), depth + 1, red_depth, 1);
+        }
+        node->left.store(left, std::memory_order_relaxed);
+        node->right.store(right, std::memory_order_relaxed);
+        if (left) left->parent.store(node, std::memory_order_relaxed);
+        if (right) right->parent.store(node, std::memory_order_relaxed);
+        return node;
     }
+
     void ConcurrentTree::deleteTree(Node* node) {
         if (node != nullptr) {
             deleteTree(node->left);
             deleteTree(node->right);
-            delete node;
+            destroy_node(node);
         }
     }
 
@@ -354,7 +1194,7 @@ namespace sync {
             }
             std::string sColor
                 = (root->color == RED) ? "RED" : "BLACK";
-            std::cout << parse(root->key) << " : " << parse(*(root->value)) << "(" << sColor << ")"
+            std::cout << parse(root->key()) << " : " << parse(*load_value(root)) << "(" << sColor << ")"
                 << std::endl;
             printHelper(root->left, false, indent);
             printHelper(root->right, true, indent);
@@ -371,17 +1211,8 @@ namespace sync {
     }
 
     void ConcurrentTree::printList() {
-        inOrder(root, [&](const auto& k, const auto& v) {
-            std::cout << parse(k) << " : " << parse(v) << '\n';
-        });
-    }
-
-    template <typename Visitor, class... Args> 
-    void ConcurrentTree::inOrder(Node* node, Visitor&& visit, Args&&... args) const {
-        if (!node) return;
-        inOrder(node->left, visit, args...);
-        std::invoke(visit, node->key, *(node->value), args...);
-        inOrder(node->right, visit, args...);
+        for (Iterator it = begin(); it.valid(); it.next()) {
+            std::cout << parse(it.key()) << " : " << parse(*it.value()) << '\n';
+        }
     }
-}
-
+}
\ No newline at end of file
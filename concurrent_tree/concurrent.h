@@ -1,16 +1,39 @@
 #pragma once
 #define _SILENCE_CXX20_OLD_SHARED_PTR_ATOMIC_SUPPORT_DEPRECATION_WARNING
 
+#include "platform.h"
+
 #include <iostream>
+#include <string>
 #include <vector>
+#include <memory>
+#include <atomic>
+#include <cstdint>
 #include <span>
-#include <mutex>
+#include <string_view>
+#include <cstring>
 #include <functional>
 #include <algorithm>
 #include <new>
 #include <variant>
+#include <map>
+#include <mutex>
+#include <set>
+#include <unordered_set>
+#include <thread>
+#include <utility>
+#include <chrono>
+#include <condition_variable>
 
-inline std::string parse(std::vector<unsigned char> data) {
+#include "allocator.h"
+#include "backoff.h"
+#include "epoch.h"
+#include "feed.h"
+#include "hash_index.h"
+#include "repair.h"
+#include "stats.h"
+
+inline std::string parse(std::span<const unsigned char> data) {
     return std::string(data.begin(), data.end());
 }
 
@@ -18,76 +41,669 @@ inline std::vector<unsigned char> data(std::string key) {
     return std::vector<unsigned char>(key.begin(), key.end());
 }
 
+// Views the characters of key as bytes, without copying them.
+inline std::span<const unsigned char> bytes(std::string_view key) {
+    return { reinterpret_cast<const unsigned char*>(key.data()), key.size() };
+}
+
 namespace sync {
 
     constexpr uint8_t BLACK = 0;
     constexpr uint8_t RED = 1;
 
+    // Set on the version of a node unlinked by erase(). The node keeps its odd (write) version forever,
+    // so optimistic readers restart, and lockers must check it before touching the node.
+    constexpr uint64_t OBSOLETE = 1ull << 63;
+
+    // Shared handle to an immutable value buffer, nullptr when the key is not in the tree.
+    using Value = std::shared_ptr<const std::vector<unsigned char>>;
+
+    // Keys up to INLINE_KEY bytes live inside the node, longer ones spill to the tree's NodeAllocator.
+    constexpr size_t INLINE_KEY = 16;
+
+    // First 8 key bytes, big endian and zero padded. Unequal prefixes order two keys without touching the rest.
+    inline uint64_t key_prefix(std::span<const unsigned char> key) {
+        uint64_t prefix = 0;
+        for (size_t i = 0; i < key.size() && i < 8; i++) prefix |= uint64_t(key[i]) << (56 - 8 * i);
+        return prefix;
+    }
+
+    // Starts loading the cache line at address without waiting for it, so misses of independent lookups overlap.
+    inline void prefetch(const void* address) {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        _mm_prefetch(static_cast<const char*>(address), _MM_HINT_T0);
+#elif defined(__GNUC__)
+        __builtin_prefetch(address);
+#endif
+    }
+
+    // A key being searched for, its prefix is computed once per operation instead of once per level.
+    struct SearchKey {
+        std::span<const unsigned char> bytes;
+        uint64_t prefix;
+        explicit SearchKey(std::span<const unsigned char> bytes) : bytes(bytes), prefix(key_prefix(bytes)) {};
+    };
+
+    // A value a node held before it was overwritten, kept while an open snapshot may still read it.
+    struct ValueVersion {
+        Value value;
+        uint64_t stamp;                    // clock reading of the write that stored value
+        std::atomic<ValueVersion*> older;  // next older version, cut once no snapshot can reach it
+    };
+
+    // Everything a traversal reads (version, key, children) sits in the first cache line.
     struct alignas(64) Node {
-        const std::vector<unsigned char> key;
-        std::shared_ptr<const std::vector<unsigned char>> value;
+        std::atomic<uint64_t> version;
+        const uint64_t prefix;
+        const uint32_t key_size;
+        std::atomic<uint8_t> color;
+        // Cache mode's CLOCK bit, set by finds and cleared by the passing hand. Sits in the padding of the first line
+        // and is only written when it changes. New keys start referenced, the hand passes them once before they go.
+        std::atomic<uint8_t> referenced{ 1 };
+        // Set once the node is in a fence, its erase then drops the fence before the node is retired. Never cleared.
+        std::atomic<uint8_t> fenced{ 0 };
+        // Set while the node is on its tree's list of nodes with history, written under the node's lock.
+        std::atomic<uint8_t> listed{ 0 };
+        union {
+            unsigned char key_inline[INLINE_KEY];
+            unsigned char* key_spill; // allocated by the tree when key_size > INLINE_KEY
+        };
         std::atomic<Node*> left;
         std::atomic <Node*> right;
         std::atomic<Node*> parent;
-        std::atomic<uint64_t> version;
-        std::atomic<uint8_t> color;
-        std::mutex lock;
-        Node(std::vector<unsigned char> key, std::vector<unsigned char> value,
+        Value value;
+        // Clock reading of the write that stored value, and the values before it, newest first. Both only change
+        // under the node's lock and are read by snapshots only.
+        std::atomic<uint64_t> stamp{ 0 };
+        std::atomic<ValueVersion*> history{ nullptr };
+        // The value itself, in place of the buffer, in a tree that keeps values inline. See setInlineValues.
+        std::atomic<uint64_t> word{ 0 };
+        Node(std::span<const unsigned char> key, unsigned char* spill, Value value,
             Node* _left = nullptr, Node* _right = nullptr, Node* _parent = nullptr,
-            uint64_t _version = 0, uint8_t _color = RED) : value(std::make_shared<const std::vector<unsigned char>>(std::move(value))), key(std::move(key)) {
+            uint64_t _version = 0, uint8_t _color = RED) : prefix(key_prefix(key)), key_size(uint32_t(key.size())), value(std::move(value)) {
+            unsigned char* bytes = spilled() ? (key_spill = spill) : key_inline;
+            if (!key.empty()) std::memcpy(bytes, key.data(), key.size());
             left.store(_left, std::memory_order_relaxed);
             right.store(_right, std::memory_order_relaxed);
             parent.store(_parent, std::memory_order_relaxed);
             version.store(_version, std::memory_order_relaxed);
             color.store(_color, std::memory_order_relaxed);
         };
+        bool spilled() const { return key_size > INLINE_KEY; }
+        std::span<const unsigned char> key() const { return { spilled() ? key_spill : key_inline, key_size }; }
     };
 
     class ConcurrentTree {
     public:
+        class Iterator;
+        class Snapshot;
+        // Key and value handed to bulkLoad.
+        struct Record {
+            std::span<const unsigned char> key;
+            Value value;
+        };
+        enum class BulkMode {
+            Build, // only into an empty tree
+            Merge  // into the current keys, a record replaces the value of an existing key
+        };
+        enum class Balance {
+            Strict, // every insert rebalances before put() returns
+            Relaxed // inserts only link the leaf, a maintainer thread rebalances them in batches
+        };
+        // Maps a key's current value, nullptr when absent, to its new one, nullptr to leave the key as it is.
+        using ComputeFn = std::function<Value(const Value& current)>;
+        // Receives each key and value of a scan in order, returns false to stop early.
+        using ScanVisitor = std::function<bool(std::span<const unsigned char> key, const Value& value)>;
+        // Receives each key and value of a parallelForEach, called from several threads at once.
+        using ForEachVisitor = std::function<void(std::span<const unsigned char> key, const Value& value)>;
+
         const std::vector<unsigned char> NULL_VALUE{ {} };
-        ConcurrentTree() : root(nullptr) {};
-        ~ConcurrentTree() { deleteTree(root.load(std::memory_order_acquire)); }
-        void put(const std::vector<unsigned char>& key, const std::vector<unsigned char>& value);
-        std::vector<unsigned char> get(std::vector<unsigned char> key);
+        ConcurrentTree() : ConcurrentTree(std::make_unique<SlabAllocator>(sizeof(Node), alignof(Node))) {};
+        // With a HashIndex, find() and get() try one probe of the index before walking the tree.
+        explicit ConcurrentTree(std::unique_ptr<HashIndex> index) : ConcurrentTree(std::make_unique<SlabAllocator>(sizeof(Node), alignof(Node)), std::move(index)) {};
+        explicit ConcurrentTree(std::unique_ptr<NodeAllocator> allocator, std::unique_ptr<HashIndex> index = nullptr)
+            : root(nullptr), allocator(std::move(allocator)), index(std::move(index)) {};
+        ~ConcurrentTree();
+        // value is moved into the node when passed as an rvalue, a Value handle is shared as is.
+        void put(std::span<const unsigned char> key, std::vector<unsigned char> value);
+        void put(std::span<const unsigned char> key, Value value);
+        // Copying lookup, returns NULL_VALUE for a missing key.
+        std::vector<unsigned char> get(std::span<const unsigned char> key);
+        // Zero-copy lookup, returns the node's value handle or nullptr for a missing key.
+        Value find(std::span<const unsigned char> key);
+        Value find(std::string_view key);
+        bool erase(std::span<const unsigned char> key);
+        // Batched lookups and writes. The batch is sorted and the tree descended once for all of it, split at every
+        // node, only keys that raced with a writer are retried one by one. multiGet returns the values in the order
+        // of keys, of several records for one key multiPut stores the last.
+        std::vector<Value> multiGet(std::span<const std::span<const unsigned char>> keys);
+        void multiPut(std::span<const Record> records);
+        // Read-modify-write in one traversal, applied in place under the node's version lock like put() updates.
+        // Inserts value unless the key is present, returns whether it did.
+        bool putIfAbsent(std::span<const unsigned char> key, std::vector<unsigned char> value);
+        bool putIfAbsent(std::span<const unsigned char> key, Value value);
+        // Stores desired only while the value equals expected byte for byte, nullptr expecting the key to be absent.
+        bool compareAndSet(std::span<const unsigned char> key, const Value& expected, Value desired);
+        // Stores fn(current) and returns the key's value afterwards. fn runs while the node (or the insertion parent)
+        // is write-locked, so it has to be short and must not call into the tree. It runs once, unless the tree was
+        // empty and another thread added the first key first.
+        Value compute(std::span<const unsigned char> key, const ComputeFn& fn);
+        // Builds a balanced red-black tree straight from records sorted by key without duplicates, in O(n) and split
+        // across threads (0 picks the core count) for large inputs. Returns false, leaving the tree as it was, if the
+        // keys aren't strictly ascending, or for Build if the tree isn't empty. Both modes build a new tree and publish
+        // its root in place of the old one, so no other thread may write during either, not even into other key
+        // ranges: a write made meanwhile may be lost. Readers see the old keys until the new root is published.
+        bool bulkLoad(std::span<const Record> sorted, BulkMode mode = BulkMode::Build, unsigned threads = 0);
+        // Streams every key and value to path in key order, see snapshot.cpp for the format. The dump reads through an
+        // openSnapshot(), so the file holds the tree as of the call, and writers aren't blocked. False on a write
+        // error or a key or value too large for the format.
+        bool snapshot(const std::string& path);
+        // Maps a snapshot file and bulk loads it, false if the file is missing, truncated or corrupt.
+        bool restore(const std::string& path, BulkMode mode = BulkMode::Build);
+        // Ordered iteration that stays safe while other threads write, see Iterator.
+        Iterator begin();
+        Iterator lower_bound(std::span<const unsigned char> key);
+        // Visits every key in [lo, hi) in ascending order.
+        void scan(std::span<const unsigned char> lo, std::span<const unsigned char> hi, const ScanVisitor& visitor);
+        // Visits every key once on up to threads threads (0 picks the core count). The keys are split into disjoint
+        // ranges at the keys of the upper levels, a few per thread, and each range is walked by an Iterator, so it is
+        // as safe with concurrent writes as one: keys present throughout are visited once, keys put or erased meanwhile
+        // may or may not be. The order in which ranges are visited is unspecified.
+        void parallelForEach(const ForEachVisitor& visitor, unsigned threads = 0);
+        // Folds map(key, value) over every key the way parallelForEach visits them. Each range folds into its own
+        // accumulator starting at identity, the accumulators are then combined in key order, so combine has to be
+        // associative but need not commute.
+        template <class T, class Map, class Combine>
+        T reduce(T identity, Map&& map, Combine&& combine, unsigned threads = 0);
+        // Keys in the tree, from per-thread counts summed in constant time. Exact once writers are quiescent,
+        // writes in flight may or may not be counted yet.
+        size_t size() const { return size_t(std::max<int64_t>(elements.load(), 0)); }
+        // Relaxed starts the maintainer, which repairs deferred inserts every interval or once a batch waits. Up to
+        // RepairQueue::BACKLOG inserts wait at a time, beyond that writers rebalance on their own, which bounds how far
+        // the height drifts. Strict stops it and repairs what is left. Switch while no puts are in flight.
+        void setBalance(Balance mode, std::chrono::milliseconds interval = std::chrono::milliseconds(1));
+        // Rebalances every deferred insert on the calling thread, returns how many there were.
+        size_t rebalance();
+        // With combining on, put() publishes its key and value instead of walking the tree itself. Whichever waiting
+        // writer takes the combiner lock applies every published put as one multiPut batch, the others spin on their
+        // slot until it is done. Meant for many threads writing into the same region, appends above all, where they
+        // would otherwise keep invalidating each other's insertion parent. The other writes are not combined. Switch
+        // while no puts are in flight.
+        void setCombining(bool enabled);
+        // Cache mode. With a capacity, writers keep the accounted bytes (nodes, spilled keys, value buffers with their
+        // vector and control block) under it by evicting keys, the least recently found first, approximately: a CLOCK
+        // hand sweeps the keys in order, clearing the referenced bit finds set and evicting keys whose bit is clear.
+        // Reads only set the bit, the hand is run by one writer at a time and the others never wait for it. Values kept
+        // for open snapshots aren't accounted. 0 turns it off. Turning it on walks the tree once to account what it
+        // already holds, switch while no writes are in flight.
+        void setCapacity(size_t bytes);
+        // Accounted bytes, 0 unless a capacity is set.
+        size_t footprint() const { return size_t(std::max<int64_t>(used.load(std::memory_order_relaxed), 0)); }
+        // Fence index. A read only copy of the top levels' keys in Eytzinger order, a complete binary tree laid out
+        // breadth first in one array, so a lookup searches the first levels in a few contiguous cache lines instead of
+        // chasing a node per level, and enters the tree at the deepest separator it passed. That node's version at
+        // build time must still hold, else the walk starts at the root as usual. Readers swap to a rebuilt fence by
+        // RCU: the maintainer rebuilds it every interval and retires the old one to the epoch domain. Up to
+        // MAX_FENCE_LEVELS levels, fewer while the top of the tree isn't complete that deep. An erase that moves a
+        // successor up disables it until the next rebuild. 0 levels stops the maintainer and drops the fence.
+        void setFence(size_t levels, std::chrono::milliseconds interval = std::chrono::milliseconds(100));
+        // Rebuilds the fence right away, false if writers raced the build or no fence is set.
+        bool rebuildFence();
+        // Change data capture. While on, every insert, update and erase, also those of batches, read-modify-writes,
+        // bulk loads and evictions, is reported to the tree's ChangeFeed: a few stores into a ring of the writer's own
+        // and one shared increment for its sequence number, taken while the write still holds its lock. Erases are
+        // reported with a nullptr value. Switch while no writes are in flight.
+        void setChangeFeed(bool enabled);
+        // The feed to poll, nullptr until setChangeFeed(true). It stays for the tree's lifetime, switching it back on
+        // resumes the same sequence.
+        ChangeFeed* changeFeed() { return feed.get(); }
+        // Keeps values of width bytes (1 to 8) inline, in a word of their node instead of a shared buffer: an update is
+        // one atomic store under the node's lock and a read one atomic load, neither allocates nor counts references.
+        // Values written through the byte API are cut or zero padded to width bytes, reads through it copy the word into
+        // a new buffer. Only for an empty tree, false otherwise.
+        bool setInlineValues(size_t width);
+        // The fixed width path of inline values. The word holds the value's bytes as they lie in memory, the first
+        // width of them. getInline returns false for a missing key.
+        void putInline(std::span<const unsigned char> key, uint64_t word);
+        bool getInline(std::span<const unsigned char> key, uint64_t& word);
+        // Opens a repeatable view of the tree as of now, see Snapshot. Writers are never blocked by it.
+        Snapshot openSnapshot();
+        // Operation and contention counters summed over all threads, zeros when built with SYNC_TREE_STATS=0.
+        TreeStats stats();
+        // Checks the whole tree: key order, parent links, a BLACK root, no RED node under a RED one, the same number of
+        // BLACK nodes on every path and no node left locked. Only conclusive while no writer is in flight.
+        bool validate();
         void printList();
         void printTree();
     private:
         std::atomic<Node*> root{nullptr};
+        // Bumped whenever erase() moves a successor up the tree, a reader that missed its key validates against it.
+        std::atomic<uint64_t> relinks{ 0 };
+        std::unique_ptr<NodeAllocator> allocator;
+        std::unique_ptr<HashIndex> index; // optional
+        EpochDomain epoch;
+        StatsCollector counters;
+        RepairQueue repairs;
+        std::atomic<uint8_t> inline_width{ 0 }; // 0 unless values are inline, see setInlineValues
+        // Held by every change of black heights: erase() unlinking a node and the repairs of inserts and erases. Only
+        // searches, value updates and the linking of new RED leaves run alongside, so a repair never meets another
+        // half done or a path left short by an unlink it could carry elsewhere.
+        std::mutex restructuring;
+
+        // Flat combining, see setCombining. A slot is claimed by a writer, filled and marked Pending, a combiner marks
+        // it Applied and its writer frees it. key and value point into the waiting writer's frame.
+        struct alignas(64) Publication {
+            enum State : uint8_t { Free, Claimed, Pending, Applied };
+            std::atomic<uint8_t> state{ Free };
+            std::span<const unsigned char> key;
+            const Value* value = nullptr;
+        };
+        static constexpr size_t PUBLICATIONS = 64;
+        std::atomic<bool> combining{ false };
+        std::unique_ptr<Publication[]> publications; // allocated when combining is first turned on
+        std::mutex combiner;                         // held by the thread applying the published puts
+        std::vector<Record> combined;                // the batch being applied, guarded by combiner
+        std::vector<Publication*> taken;             // and the slots it came from
+
+        ShardedCount elements; // inserts less removals
 
-        static inline void begin_write(Node* node) {
-            if (!node) return;
-            node->version.fetch_add(1, std::memory_order_acq_rel);
+        // Change data capture, see setChangeFeed.
+        std::unique_ptr<ChangeFeed> feed;
+        std::atomic<bool> feeding{ false };
+
+        // Fence index, see setFence. Slot k's children are slots 2k and 2k + 1, slot 0 is unused.
+        struct Fence {
+            struct alignas(64) Line {
+                uint64_t prefixes[8];
+            };
+            size_t levels;
+            uint64_t relinks;              // the tree's relinks when built, the fence is only entered while unchanged
+            std::vector<Line> lines;       // node prefixes, a search reads one per level
+            std::vector<Node*> nodes;      // the separators, read when prefixes tie and at the entry
+            std::vector<uint64_t> versions;
+            uint64_t& prefix(size_t slot) { return lines[slot / 8].prefixes[slot % 8]; }
+            uint64_t prefix(size_t slot) const { return lines[slot / 8].prefixes[slot % 8]; }
+        };
+        static constexpr size_t MAX_FENCE_LEVELS = 16;
+        std::atomic<Fence*> fence{ nullptr };
+        std::mutex fence_build;            // serializes builds and guards fence_levels
+        size_t fence_levels = 0;
+        std::mutex fence_control;          // guards the maintainer's start and stop
+        std::condition_variable fence_wake;
+        bool fence_stopping = false;
+        std::thread fence_maintainer;
+
+        // Cache mode, see setCapacity.
+        static constexpr size_t EVICTION_BATCH = 64; // keys the hand picks before they are erased
+        std::atomic<size_t> capacity{ 0 };           // 0 when unbounded, nothing is accounted then
+        std::atomic<int64_t> used{ 0 };
+        std::mutex eviction;                         // held by the writer running the hand
+        std::vector<unsigned char> hand;             // the hand resumes at the first key at or above it, guarded by eviction
+
+        // Multi-versioning. The clock only moves when a snapshot opens, writes are stamped with its reading while
+        // their node is locked: a write stamped at or below a snapshot's stamp is visible to it, later ones aren't.
+        static constexpr uint64_t NO_SNAPSHOT = ~0ull;
+        // Values of an erased key, kept while a snapshot older than the erase is open.
+        struct Tombstone {
+            uint64_t erased;                                  // clock reading of the erase
+            std::vector<std::pair<uint64_t, Value>> versions; // stamp and value, newest first
+        };
+        std::atomic<uint64_t> clock{ 1 };
+        std::atomic<uint64_t> oldest_snapshot{ NO_SNAPSHOT }; // at or below the stamp of every open snapshot
+        std::atomic<size_t> buried{ 0 };                       // graveyard size, lets scans skip the lock
+        std::mutex history_lock;                               // guards the three below, taken after a node lock
+        std::multiset<uint64_t> open_snapshots;
+        std::multimap<std::vector<unsigned char>, Tombstone> graveyard;
+        std::unordered_set<Node*> historied;                   // linked nodes that may hold a history, see listed
+
+        // The version word doubles as the node lock: a writer makes it odd, so optimistic readers restart,
+        // and every completed write leaves a new even version behind. Fails if the node was erased.
+        bool begin_write(Node* node) {
+            Backoff backoff;
+            StatsCollector::LockWait wait;
+            while (true) {
+                uint64_t version = node->version.load(std::memory_order_relaxed);
+                if (version & OBSOLETE) return false;
+                if (!(version & 1u) && node->version.compare_exchange_weak(version, version + 1, std::memory_order_acq_rel, std::memory_order_relaxed)) {
+                    counters.acquired(wait);
+                    return true;
+                }
+                wait.waiting();
+                backoff.pause();
+            }
         }
 
+        // Optimistic lock upgrade, only succeeds if node still carries the version a traversal validated.
+        static inline bool try_begin_write(Node* node, uint64_t version) {
+            return !(version & 1u) && node->version.compare_exchange_strong(version, version + 1, std::memory_order_acq_rel, std::memory_order_relaxed);
+        }
+
+        // Erased nodes are never released.
         static inline void end_write(Node* node) {
-            if (!node) return;
+            if (node->version.load(std::memory_order_relaxed) & OBSOLETE) return;
             node->version.fetch_add(1, std::memory_order_release);
         }
 
-        static void lock_adress_order(std::vector<Node*>& nodes) {
-            nodes.erase(std::remove(nodes.begin(), nodes.end(), nullptr), nodes.end());
-            std::sort(nodes.begin(), nodes.end(), std::less<Node*>{});
-            nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
-            for (Node* node : nodes) node->lock.lock();
+        // Releases a write that changed nothing, readers validating against the old version still succeed.
+        static inline void abort_write(Node* node) {
+            node->version.fetch_sub(1, std::memory_order_release);
         }
 
-        static void unlock_reverse(std::vector<Node*>& nodes) {
-            for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
-                (*it)->lock.unlock();
+        // Fixed capacity set of nodes written together. Locked in address order, so writers never deadlock,
+        // and kept on the stack, so the write path never allocates.
+        template <size_t N>
+        class LockSet {
+        public:
+            LockSet(std::initializer_list<Node*> init) { for (Node* node : init) add(node); }
+            void add(Node* node) {
+                if (!node || std::find(nodes, nodes + count, node) != nodes + count) return;
+                nodes[count++] = node;
+            }
+            // Fails, with nothing left locked, if one of the nodes was erased.
+            bool lock(ConcurrentTree& tree) {
+                // Insertion sort, a set holds a handful of nodes at most.
+                for (size_t i = 1; i < count; i++) {
+                    for (size_t j = i; j > 0 && std::less<Node*>{}(nodes[j], nodes[j - 1]); j--) std::swap(nodes[j], nodes[j - 1]);
+                }
+                for (size_t i = 0; i < count; i++) {
+                    if (tree.begin_write(nodes[i])) continue;
+                    while (i-- > 0) abort_write(nodes[i]);
+                    return false;
+                }
+                return true;
+            }
+            void unlock() { for (size_t i = count; i-- > 0;) end_write(nodes[i]); }
+            void abort() { for (size_t i = count; i-- > 0;) abort_write(nodes[i]); }
+        private:
+            Node* nodes[N];
+            size_t count = 0;
+        };
+
+        // Nodes a traversal went through, each with the version it was validated at. A failed validation resumes
+        // below the deepest of them that is unchanged instead of at the root. Bounded and on the stack, retries and
+        // re-walked levels are added to the tree's stats once the operation ends.
+        class Path {
+        public:
+            static constexpr size_t CAPACITY = 32;
+            explicit Path(ConcurrentTree& tree) : tree(tree) {};
+            ~Path() {
+                if (!retries) return;
+                tree.counters.add(Counter::Restarts, retries);
+                tree.counters.add(Counter::RewalkedLevels, rewalked);
             }
+            void push(Node* node, uint64_t version) { steps[depth++ % CAPACITY] = { node, version }; }
+            // Starts the first attempt at node, below the root, if its version still is the one given.
+            void enter(Node* node, uint64_t version) { push(node, version); }
+            // Forgets every step, the next attempt starts at the root.
+            void clear() { rewalked += depth; depth = 0; }
+            // Called before every attempt, pops the resume point. False when the walk has to start at the root.
+            bool resume(Node*& node, uint64_t& version);
+        private:
+            struct Step {
+                Node* node;
+                uint64_t version;
+            };
+            ConcurrentTree& tree;
+            Step steps[CAPACITY];
+            size_t depth = 0;
+            uint64_t retries = 0;
+            uint64_t rewalked = 0;
+            bool started = false;
+        };
+
+        // Root and its version as one snapshot, false if a writer holds the root or it was rotated down meanwhile.
+        bool load_root(Node*& node, uint64_t& version) {
+            node = root.load(std::memory_order_acquire);
+            if (!node) return true;
+            version = node->version.load(std::memory_order_acquire);
+            return !(version & 1u) && root.load(std::memory_order_acquire) == node;
+        }
+
+        // Three way byte compare of a node key against a lookup key, one pass per tree level.
+        static inline int compare(std::span<const unsigned char> node_key, std::span<const unsigned char> key) {
+            size_t common = std::min(node_key.size(), key.size());
+            int order = common ? std::memcmp(node_key.data(), key.data(), common) : 0;
+            if (order != 0) return order;
+            return (node_key.size() > key.size()) - (node_key.size() < key.size());
+        }
+
+        // Decided by the cached prefixes unless they tie, only then the key bytes are read. Keys of up to 8 bytes are
+        // whole in their zero padded prefixes, of two such only the lengths are left to compare.
+        static inline int compare(const Node* node, const SearchKey& key) {
+            if (node->prefix != key.prefix) return node->prefix < key.prefix ? -1 : 1;
+            if (node->key_size <= 8 && key.bytes.size() <= 8) return (node->key_size > key.bytes.size()) - (node->key_size < key.bytes.size());
+            return compare(node->key(), key.bytes);
+        }
+
+        static inline bool is_obsolete(Node* node) {
+            return node && (node->version.load(std::memory_order_acquire) & OBSOLETE);
         }
 
         static inline uint8_t load_color(Node* node) {
             return node ? node->color.load(std::memory_order_relaxed) : BLACK;
         }
 
-        void left_rotate(Node* node_root);
-        void right_rotate(Node* node_root);
+        // Unlinked node left write-locked for good, then handed to the epoch domain. Only valid while locked.
+        static inline void mark_obsolete(Node* node) {
+            node->version.fetch_or(OBSOLETE, std::memory_order_release);
+        }
+
+        static void reclaim(void* node, void* tree) {
+            static_cast<ConcurrentTree*>(tree)->destroy_node(static_cast<Node*>(node));
+        }
+
+        // Frees a chain of value versions cut off a node's history.
+        static void reclaim_history(void* version, void*) {
+            for (auto* past = static_cast<ValueVersion*>(version); past;) delete std::exchange(past, past->older.load(std::memory_order_relaxed));
+        }
+
+        // Subtrees smaller than this are built by the calling thread.
+        static constexpr size_t PARALLEL_BUILD = 1 << 15;
+
+        // One key of a multiGet or multiPut batch and where the shared descent left it.
+        struct BatchSlot {
+            enum Outcome : uint8_t { Conflict, Found, Absent };
+            SearchKey search;
+            size_t index;          // position in the caller's batch
+            Node* node = nullptr;  // node holding the key, or the parent it would be inserted under
+            uint64_t version = 0;  // node's version when the descent validated it
+            Outcome outcome = Conflict;
+            bool go_right = false; // side of node a missing key would be inserted on
+        };
+
+        // New nodes a multiPut links before rebalancing them.
+        static constexpr size_t UNBALANCED_LIMIT = 64;
+
+        static void sort_batch(std::vector<BatchSlot>& batch);
+        // Descends once for the whole sorted batch and returns the relinks count seen before it started. Keys left
+        // Absent under a null node were looked up in an empty tree.
+        uint64_t locate(std::span<BatchSlot> sorted);
+        void locate(Node* node, uint64_t version, std::span<BatchSlot> sorted);
+        // Shared by put() and the read-modify-write operations: finds key once and stores update(current value), or
+        // leaves the key alone when update returns nullptr. Returns the key's value afterwards.
+        template <class Update>
+        Value upsert(std::span<const unsigned char> key, Update&& update);
+        // put() of the calling thread, without combining.
+        void put_direct(std::span<const unsigned char> key, const Value& value);
+        // put() with combining on, false if every slot was taken and the caller has to write on its own.
+        bool combine(std::span<const unsigned char> key, const Value& value);
+        // Applies every pending put, own is the combiner's slot, not counted as combined.
+        void apply_published(const Publication* own);
+        Node* make_node(std::span<const unsigned char> key, Value value);
+        // The value of node as a buffer, a copy of its word when values are inline.
+        Value load_value(const Node* node) const;
+        // The first inline_width bytes of value, zero padded.
+        uint64_t to_word(const Value& value) const;
+        // The walk of find(): calls load(node) on the node holding key, then validates the node's version, again
+        // after every retry. False if the key is missing. The caller pins the epoch.
+        template <class Load>
+        bool search(const SearchKey& key, Load&& load);
+        Node* build(std::span<const Record> sorted, size_t depth, size_t red_depth, unsigned threads);
+        void destroy_node(Node* node);
+        // Index maintenance, no-ops without an index. A node is indexed once linked and taken out once marked obsolete,
+        // before it is retired.
+        void index_node(Node* node);
+        void unindex(Node* node);
+
+        // Sequence number of a write, taken before its lock is released, 0 without a change feed.
+        uint64_t sequence_change() { return feeding.load(std::memory_order_relaxed) ? feed->reserve() : 0; }
+        // Appends the change once the write is unlocked, every number taken has to be published.
+        void publish_change(uint64_t sequence, std::span<const unsigned char> key, const Value& value) {
+            if (sequence) feed->publish(sequence, key, value);
+        }
+
+        // Seeds path with the fence's entry node for search, if a fence is usable. seen_relinks is the relinks count
+        // the walk validates its misses against.
+        void enter_fence(const SearchKey& search, Path& path, uint64_t seen_relinks);
+        // Unpublishes the fence, it is freed once no reader can still be searching it.
+        void drop_fence(EpochDomain::Guard& guard);
+        void stop_fence_maintainer();
+        static void reclaim_fence(void* fence, void*) { delete static_cast<Fence*>(fence); }
+
+        // Parallel traversal. RANGES_PER_THREAD ranges per thread let threads that finish early take over others.
+        static constexpr size_t RANGES_PER_THREAD = 4;
+        // Sorted distinct keys of the upper levels splitting the tree into about parts ranges, read without locks.
+        std::vector<std::vector<unsigned char>> split_keys(size_t parts);
+        // Visits range i, [splits[i - 1], splits[i]) with open ends for the first and last range.
+        void visit_range(const std::vector<std::vector<unsigned char>>& splits, size_t range, const ForEachVisitor& visitor);
+        // Runs task(0) to task(tasks - 1) on up to threads threads, the caller's among them.
+        static void run_parallel(size_t tasks, unsigned threads, const std::function<void(size_t)>& task);
+
+        // Bytes a key and its value account for in cache mode, an inline value none besides its node.
+        size_t footprint(size_t key_size, const Value& value) const;
+        size_t value_bytes(const Value& value) const;
+        void charge(int64_t bytes) {
+            if (capacity.load(std::memory_order_relaxed)) used.fetch_add(bytes, std::memory_order_relaxed);
+        }
+        // Marks a found node as recently used, a no-op outside cache mode.
+        void touch(Node* node) {
+            if (capacity.load(std::memory_order_relaxed) && !node->referenced.load(std::memory_order_relaxed)) node->referenced.store(1, std::memory_order_relaxed);
+        }
+        // Called by writers once their operation is done and their locks are released.
+        void enforce_capacity() {
+            size_t bytes = capacity.load(std::memory_order_relaxed);
+            if (bytes && used.load(std::memory_order_relaxed) > int64_t(bytes)) evict();
+        }
+        void evict();
+        // Replaces the value of a write-locked node, keeping the old one in its history while a snapshot may need it.
+        void store_value(Node* node, Value value, EpochDomain::Guard& guard);
+        // The same for an inline value.
+        void store_word(Node* node, uint64_t word, EpochDomain::Guard& guard);
+        // The history half of both: keeps the node's current value while a snapshot may need it, returns the stamp of
+        // the write.
+        uint64_t keep_history(Node* node, EpochDomain::Guard& guard);
+        // Detaches and returns the versions of a chain no snapshot can reach: all of them once every snapshot sees
+        // the value stamped newest, otherwise the ones behind the first at or below oldest. kept becomes the rest.
+        static ValueVersion* cut_history(ValueVersion*& kept, uint64_t newest, uint64_t oldest);
+        // Takes a write-locked node that is about to be retired off the historied list.
+        void unlist(Node* node);
+        // Saves the versions of a write-locked node about to be erased for the snapshots that still see it.
+        void bury(Node* node);
+        void close_snapshot(uint64_t stamp);
+        // Value of node as of stamp. False if the node held none then or has been erased, the graveyard decides.
+        bool read_at(Node* node, uint64_t stamp, Value& value);
+        // Appends the visible values of erased keys in [from, to), from included unless exclusive, to out. No to is
+        // no upper bound.
+        void buried_between(std::span<const unsigned char> from, bool exclusive, const std::span<const unsigned char>* to, uint64_t stamp,
+            std::vector<std::pair<std::vector<unsigned char>, Value>>& out);
+
+        static inline Node* child_of(Node* node, bool left) {
+            return left ? node->left.load(std::memory_order_relaxed) : node->right.load(std::memory_order_relaxed);
+        }
+        static inline void set_child(Node* node, bool left, Node* child) {
+            (left ? node->left : node->right).store(child, std::memory_order_relaxed);
+        }
+        // A RED node under a RED parent, the violation an insert leaves behind. False for erased nodes.
+        static inline bool violates(Node* node) {
+            return !is_obsolete(node) && load_color(node) == RED && load_color(node->parent.load(std::memory_order_acquire)) == RED;
+        }
+        // Lifts the child on the other side of node into its place, toward left.
+        void rotate(Node* node, bool left);
         void fixInsert(Node* node_leaf);
+        // Repairs the RED-RED link above leaf and any pending one it runs into on the way up, restructuring held.
+        void fixRed(Node* leaf);
+        // fixInsert now, or later by the maintainer in relaxed mode.
+        void balance_insert(Node* node);
+        void fixErase(Node* node, Node* parent, bool node_is_left);
+        void blacken_root();
+        void replace_child(Node* parent, Node* old_child, Node* new_child);
+        // One step of a repair. Locks the nodes, and only if valid() still holds then, applies the recoloring and the
+        // rotations that go with it, so no other writer ever sees a step half done.
+        template <class Valid, class Apply>
+        bool restructure(LockSet<6> locked, Valid&& valid, Apply&& apply);
+        // BLACK nodes on every path down from node, or -1 if its subtree breaks an invariant. Its keys lie between
+        // those of lo and hi, either missing for no bound.
+        int64_t checked_height(Node* node, const Node* lo, const Node* hi);
         void deleteTree(Node* node);
         void printHelper(Node* root, bool last, std::string indent = "");
-        template <class Visitor, class... Args>
-        void inOrder(Node* node, Visitor&& visitor, Args&&... args) const;
     };
-}
\ No newline at end of file
+
+    // Read only view of the tree as of the moment it was opened: finds and scans through it return the values that
+    // were current then, however often the keys were overwritten or erased since. Writers keep going meanwhile,
+    // they keep the values an open snapshot can still see, so don't keep one open longer than needed. bulkLoad and
+    // restore aren't versioned, a snapshot sees what they loaded.
+    class ConcurrentTree::Snapshot {
+    public:
+        Snapshot(Snapshot&& other) noexcept : tree(std::exchange(other.tree, nullptr)), stamp(other.stamp) {};
+        Snapshot& operator=(const Snapshot&) = delete;
+        ~Snapshot() { if (tree) tree->close_snapshot(stamp); }
+        Value find(std::span<const unsigned char> key);
+        Value find(std::string_view key);
+        std::vector<unsigned char> get(std::span<const unsigned char> key);
+        // Visits every key in [lo, hi) that existed when the snapshot opened, in ascending order.
+        void scan(std::span<const unsigned char> lo, std::span<const unsigned char> hi, const ScanVisitor& visitor);
+        uint64_t timestamp() const { return stamp; }
+    private:
+        friend class ConcurrentTree;
+        Snapshot(ConcurrentTree& tree, uint64_t stamp) : tree(&tree), stamp(stamp) {};
+        // scan, without an upper bound when hi is nullptr.
+        void visit(std::span<const unsigned char> lo, const std::span<const unsigned char>* hi, const ScanVisitor& visitor);
+        ConcurrentTree* tree;
+        uint64_t stamp;
+    };
+
+    // Forward cursor over the tree in key order, usable while other threads put and erase. It keeps the nodes
+    // its path turned left at, each with the version it was validated at. next() resumes below the deepest of them
+    // nobody changed since and only falls back to the root when all changed. A live iterator pins the tree's epoch
+    // domain, so keep it short lived.
+    class ConcurrentTree::Iterator {
+    public:
+        Iterator(Iterator&&) = default;
+        bool valid() const { return current != nullptr; }
+        std::span<const unsigned char> key() const { return current->key(); }
+        const Value& value() const { return current_value; }
+        void next();
+    private:
+        friend class ConcurrentTree;
+        friend class ConcurrentTree::Snapshot;
+        struct Step {
+            Node* node;
+            uint64_t version;
+        };
+
+        Iterator(ConcurrentTree& tree) : tree(&tree), guard(tree.epoch.pin()) {};
+        void seek(const SearchKey& key, bool inclusive);
+        bool descend(Node* node, uint64_t version, const SearchKey& key, bool inclusive);
+
+        ConcurrentTree* tree;
+        EpochDomain::Guard guard;
+        std::vector<Step> path;
+        Node* current = nullptr;
+        Value current_value;
+    };
+
+    template <class T, class Map, class Combine>
+    T ConcurrentTree::reduce(T identity, Map&& map, Combine&& combine, unsigned threads) {
+        if (!threads) threads = std::max(1u, std::thread::hardware_concurrency());
+        auto splits = split_keys(threads * RANGES_PER_THREAD);
+        std::vector<T> partial(splits.size() + 1, identity);
+        run_parallel(partial.size(), threads, [&](size_t range) {
+            visit_range(splits, range, [&](std::span<const unsigned char> key, const Value& value) {
+                partial[range] = combine(std::move(partial[range]), map(key, value));
+            });
+        });
+        T total = std::move(identity);
+        for (T& part : partial) total = combine(std::move(total), std::move(part));
+        return total;
+    }
+}
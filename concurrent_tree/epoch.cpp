@@ -0,0 +1,101 @@
+#include "epoch.h"
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+namespace sync {
+    EpochDomain::~EpochDomain() {
+        drain();
+    }
+
+    EpochDomain::Guard EpochDomain::pin() {
+        // Each thread starts probing from its own slot so uncontended pins stay on a thread-private cache line.
+        static thread_local const size_t hint = std::hash<std::thread::id>{}(std::this_thread::get_id()) % SLOTS;
+        for (size_t probe = 0;; ++probe) {
+            size_t i = (hint + probe) % SLOTS;
+            Slot& slot = slots[i];
+            bool expected = false;
+            if (slot.owned.load(std::memory_order_relaxed)
+                || !slot.owned.compare_exchange_strong(expected, true, std::memory_order_acquire, std::memory_order_relaxed)) {
+                if (probe % SLOTS == SLOTS - 1) std::this_thread::yield(); // every slot taken
+                continue;
+            }
+            // Announce the epoch we observe; the fence orders it before any pointer loads of the operation.
+            slot.epoch.store(global_epoch.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            return Guard(*this, i);
+        }
+    }
+
+    void EpochDomain::unpin(size_t index) {
+        Slot& slot = slots[index];
+        slot.epoch.store(IDLE, std::memory_order_release);
+        // A list short of the threshold is still freed once old enough. While one waits, here or in a slot nobody
+        // pins anymore, every few unpins push the epoch so it gets there even when nothing else retires.
+        bool waiting = !slot.retired.empty();
+        if (waiting || orphaned.load(std::memory_order_relaxed)) {
+            if (++slot.unpins == ADVANCE_PERIOD) {
+                slot.unpins = 0;
+                try_advance();
+            }
+            if (waiting && slot.retired.front().epoch + 2 <= global_epoch.load(std::memory_order_acquire)) collect(slot);
+            waiting = !slot.retired.empty();
+        }
+        slot.owned.store(false, std::memory_order_release);
+        // Raised after the slot is released: a sweep that found it owned and skipped it clears the flag first.
+        if (waiting && !orphaned.load(std::memory_order_relaxed)) orphaned.store(true, std::memory_order_seq_cst);
+    }
+
+    void EpochDomain::retire(size_t index, void* object, Reclaim reclaim, void* context) {
+        Slot& slot = slots[index];
+        slot.retired.push_back({ object, reclaim, context, global_epoch.load(std::memory_order_acquire) });
+        slot.pending.store(slot.retired.size(), std::memory_order_relaxed);
+        if (slot.retired.size() < RETIRE_THRESHOLD) return;
+        try_advance();
+        collect(slot);
+    }
+
+    bool EpochDomain::try_advance() {
+        uint64_t current = global_epoch.load(std::memory_order_acquire);
+        for (Slot& slot : slots) {
+            uint64_t observed = slot.epoch.load(std::memory_order_acquire);
+            if (observed != IDLE && observed != current) return false; // a reader still lives in an older epoch
+        }
+        if (!global_epoch.compare_exchange_strong(current, current + 1, std::memory_order_acq_rel)) return false;
+        if (!orphaned.exchange(false, std::memory_order_seq_cst)) return true;
+        // Help the slots whose last owner left a list behind, taking each like pin() does. Owned ones are left to
+        // their owner, which raises the flag again on unpin if its list outlives it.
+        bool left = false;
+        for (Slot& slot : slots) {
+            if (!slot.pending.load(std::memory_order_relaxed) || slot.owned.load(std::memory_order_relaxed)) continue;
+            bool expected = false;
+            if (!slot.owned.compare_exchange_strong(expected, true, std::memory_order_acquire, std::memory_order_relaxed)) continue;
+            collect(slot);
+            left |= !slot.retired.empty();
+            slot.owned.store(false, std::memory_order_release);
+        }
+        if (left) orphaned.store(true, std::memory_order_seq_cst);
+        return true;
+    }
+
+    void EpochDomain::collect(Slot& slot) {
+        // Objects retired in epoch e are unreachable for every pinned thread once the global epoch reached e + 2.
+        // The list is in retirement order, so they are a prefix of it and the oldest entry stays in front.
+        uint64_t safe = global_epoch.load(std::memory_order_acquire);
+        auto alive = std::find_if(slot.retired.begin(), slot.retired.end(), [safe](const Retired& r) {
+            return r.epoch + 2 > safe;
+        });
+        for (auto it = slot.retired.begin(); it != alive; ++it) it->reclaim(it->object, it->context);
+        slot.retired.erase(slot.retired.begin(), alive);
+        slot.pending.store(slot.retired.size(), std::memory_order_relaxed);
+    }
+
+    void EpochDomain::drain() {
+        for (Slot& slot : slots) {
+            for (Retired& r : slot.retired) r.reclaim(r.object, r.context);
+            slot.retired.clear();
+            slot.pending.store(0, std::memory_order_relaxed);
+        }
+    }
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "platform.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+
+namespace sync {
+
+    // Epoch based reclamation domain. Threads pin a slot for the duration of an operation, nodes unlinked
+    // from the tree are retired into the pinned slot and only freed once every pinned thread has moved past
+    // the epoch in which they were retired, so optimistic readers never touch freed memory. A slot's list is
+    // collected when it reaches RETIRE_THRESHOLD, on unpin once it is old enough, and by whichever thread
+    // advances the epoch for slots nobody pins anymore.
+    class EpochDomain {
+    public:
+        using Reclaim = void(*)(void* object, void* context);
+
+        static constexpr size_t SLOTS = 128;
+        static constexpr size_t RETIRE_THRESHOLD = 64;
+        // Unpins of a slot between two attempts to advance the epoch from it, while a list waits to be freed.
+        static constexpr uint32_t ADVANCE_PERIOD = 16;
+
+        class Guard {
+        public:
+            Guard(EpochDomain& domain, size_t slot) : domain(&domain), slot(slot) {};
+            Guard(Guard&& other) noexcept : domain(other.domain), slot(other.slot) { other.domain = nullptr; };
+            Guard(const Guard&) = delete;
+            Guard& operator=(const Guard&) = delete;
+            ~Guard() { if (domain) domain->unpin(slot); }
+            // Hands object to the domain, reclaim(object, context) runs once no reader can still observe it.
+            void retire(void* object, Reclaim reclaim, void* context = nullptr) { domain->retire(slot, object, reclaim, context); }
+        private:
+            EpochDomain* domain;
+            size_t slot;
+        };
+
+        EpochDomain() = default;
+        ~EpochDomain();
+        EpochDomain(const EpochDomain&) = delete;
+        EpochDomain& operator=(const EpochDomain&) = delete;
+
+        Guard pin();
+        // Frees every retired object. Only safe when no thread is pinned, i.e. on teardown.
+        void drain();
+
+    private:
+        static constexpr uint64_t IDLE = ~0ull;
+
+        struct Retired {
+            void* object;
+            Reclaim reclaim;
+            void* context;
+            uint64_t epoch;
+        };
+
+        struct alignas(64) Slot {
+            std::atomic<bool> owned{ false };
+            std::atomic<uint64_t> epoch{ IDLE };
+            std::vector<Retired> retired;     // only touched by the thread owning the slot
+            std::atomic<size_t> pending{ 0 }; // retired.size(), read by helpers that don't own the slot
+            uint32_t unpins = 0;              // since the last advance attempt, owner only
+        };
+
+        std::atomic<uint64_t> global_epoch{ 1 };
+        std::atomic<bool> orphaned{ false }; // an unpinned slot was left with a list, cleared by the helping sweep
+        Slot slots[SLOTS];
+
+        void unpin(size_t slot);
+        void retire(size_t slot, void* object, Reclaim reclaim, void* context);
+        // Moves the epoch on if every pinned thread has seen the current one. The thread that moves it collects
+        // the lists of idle slots, which no owner may come back to.
+        bool try_advance();
+        void collect(Slot& slot);
+    };
+}
@@ -0,0 +1,75 @@
+#include "feed.h"
+
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+#include "backoff.h"
+
+namespace sync {
+    ChangeFeed::ChangeFeed() {
+        for (Ring& ring : rings) {
+            ring.cells = std::make_unique<Cell[]>(RING_CAPACITY);
+            for (size_t i = 0; i < RING_CAPACITY; i++) ring.cells[i].turn.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    void ChangeFeed::publish(uint64_t sequence, std::span<const unsigned char> key, const Value& value) {
+        // Threads whose hints collide share a ring, the sequence numbers keep their changes apart.
+        static thread_local const size_t hint = std::hash<std::thread::id>{}(std::this_thread::get_id()) % RINGS;
+        Ring& ring = rings[hint];
+        Backoff backoff;
+        uint64_t position = ring.tail.load(std::memory_order_relaxed);
+        while (true) {
+            Cell& cell = ring.cells[position & (RING_CAPACITY - 1)];
+            int64_t lag = int64_t(cell.turn.load(std::memory_order_acquire) - position);
+            if (lag == 0) {
+                if (!ring.tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) continue;
+                cell.sequence = sequence;
+                cell.key.assign(key.begin(), key.end());
+                cell.value = value;
+                cell.turn.store(position + 1, std::memory_order_release);
+                return;
+            }
+            // Still holding the change of the previous lap, the ring is full until the consumer takes it.
+            if (lag < 0) backoff.pause();
+            position = ring.tail.load(std::memory_order_relaxed);
+        }
+    }
+
+    size_t ChangeFeed::poll(std::vector<Change>& batch, size_t max) {
+        std::lock_guard<std::mutex> held(consumer);
+        auto later = [](const Change& a, const Change& b) { return a.sequence > b.sequence; };
+        auto ready = [&] { return !pending.empty() && pending.front().sequence == expected; };
+        // One change off every ring per pass, whatever its number, until max of them wait and the next one is among
+        // them. A change ahead of its turn still frees its cell, so the writer holding the missing number never waits
+        // on a ring full of its successors, while a consumer that polls slowly keeps the rings full and the writers
+        // waiting.
+        for (bool took = true; took && (pending.size() < max || !ready());) {
+            took = false;
+            for (Ring& ring : rings) {
+                Cell& cell = ring.cells[ring.head & (RING_CAPACITY - 1)];
+                if (cell.turn.load(std::memory_order_acquire) != ring.head + 1) continue;
+                pending.push_back({ cell.sequence, cell.key, std::move(cell.value) });
+                std::push_heap(pending.begin(), pending.end(), later);
+                cell.turn.store(ring.head + RING_CAPACITY, std::memory_order_release);
+                ring.head++;
+                took = true;
+            }
+        }
+        size_t handed = 0;
+        while (handed < max && ready()) {
+            std::pop_heap(pending.begin(), pending.end(), later);
+            batch.push_back(std::move(pending.back()));
+            pending.pop_back();
+            expected++;
+            handed++;
+        }
+        return handed;
+    }
+
+    uint64_t ChangeFeed::position() {
+        std::lock_guard<std::mutex> held(consumer);
+        return expected;
+    }
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "platform.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <vector>
+
+namespace sync {
+
+    using Value = std::shared_ptr<const std::vector<unsigned char>>;
+
+    // One write as the change feed reports it.
+    struct Change {
+        uint64_t sequence;
+        std::vector<unsigned char> key;
+        Value value; // nullptr for an erase
+    };
+
+    // Change data capture for a ConcurrentTree, see ConcurrentTree::setChangeFeed. Writers take a sequence number
+    // while they still hold the lock of the write, so the writes to one key are numbered in the order they were
+    // applied, and append the change once unlocked to one of RINGS bounded lock free rings, picked per thread. The
+    // numbers are dense, the consumer merges the rings and hands out changes strictly in sequence, holding back any
+    // whose predecessors are still on their way. A full ring makes its writers wait for the consumer, which is the
+    // backpressure: a feed that is never polled stops the writes.
+    class ChangeFeed {
+    public:
+        static constexpr size_t RINGS = 16;
+        static constexpr size_t RING_CAPACITY = 1024; // changes per ring, a power of two
+
+        ChangeFeed();
+        ChangeFeed(const ChangeFeed&) = delete;
+        ChangeFeed& operator=(const ChangeFeed&) = delete;
+
+        // Writer side. Every reserved number has to be published, the consumer waits for each one in turn.
+        uint64_t reserve() { return next.fetch_add(1, std::memory_order_relaxed); }
+        void publish(uint64_t sequence, std::span<const unsigned char> key, const Value& value);
+
+        // Appends up to max changes in sequence order, the ones right after those the last poll returned, and
+        // returns how many. Fewer, or none, while the next change is still being appended. One consumer at a time.
+        size_t poll(std::vector<Change>& batch, size_t max);
+        // Sequence number the next poll starts at, every change before it was handed out.
+        uint64_t position();
+
+    private:
+        // Bounded multi producer queue, the consumer reads it single threaded. A cell is free for the producer of
+        // position p when its turn is p, holds that producer's change when its turn is p + 1.
+        struct alignas(64) Cell {
+            std::atomic<uint64_t> turn;
+            uint64_t sequence;
+            std::vector<unsigned char> key; // assigned in place, keeps its capacity once the ring has wrapped
+            Value value;
+        };
+
+        struct alignas(64) Ring {
+            std::atomic<uint64_t> tail{ 0 };
+            uint64_t head = 0; // consumer only
+            std::unique_ptr<Cell[]> cells;
+        };
+
+        std::atomic<uint64_t> next{ 1 };
+        Ring rings[RINGS];
+
+        std::mutex consumer;            // guards the fields below
+        uint64_t expected = 1;          // the sequence number poll hands out next
+        std::vector<Change> pending;    // min heap by sequence of changes taken off the rings ahead of their turn
+    };
+}
@@ -0,0 +1,130 @@
+#include "concurrent.h"
+
+#include <bit>
+
+// Fence index. The first levels of the tree are read like an optimistic descent, every child's version trusted only
+// once its parent validates again, and copied into a fence: a node that still carries the version it was copied at
+// spans the same key interval as then, which is all a walk entering the tree there needs. Rotations and recolors bump
+// the versions of the nodes they touch, so entries go stale one by one and the walk falls back to the root for them.
+// An erase that moves a successor up is the one change that narrows an interval without touching the node, it is
+// caught by the relinks count the fence was built at.
+namespace sync {
+    void ConcurrentTree::setFence(size_t levels, std::chrono::milliseconds interval) {
+        stop_fence_maintainer();
+        {
+            std::lock_guard<std::mutex> held(fence_build);
+            fence_levels = std::min(levels, MAX_FENCE_LEVELS);
+            if (!fence_levels) {
+                auto guard = epoch.pin();
+                drop_fence(guard);
+                return;
+            }
+        }
+        rebuildFence();
+        std::lock_guard<std::mutex> held(fence_control);
+        fence_stopping = false;
+        fence_maintainer = std::thread([this, interval] {
+            std::unique_lock<std::mutex> held(fence_control);
+            while (!fence_wake.wait_for(held, interval, [this] { return fence_stopping; })) {
+                // Builds read the tree, setFence and the destructor must not wait for one to stop.
+                held.unlock();
+                rebuildFence();
+                held.lock();
+            }
+        });
+    }
+
+    void ConcurrentTree::stop_fence_maintainer() {
+        std::thread stopped;
+        {
+            std::lock_guard<std::mutex> held(fence_control);
+            fence_stopping = true;
+            stopped = std::move(fence_maintainer);
+        }
+        fence_wake.notify_all();
+        if (stopped.joinable()) stopped.join();
+    }
+
+    bool ConcurrentTree::rebuildFence() {
+        std::lock_guard<std::mutex> held(fence_build);
+        if (!fence_levels) return false;
+        auto guard = epoch.pin();
+        uint64_t seen_relinks = relinks.load(std::memory_order_acquire);
+        Node* top;
+        uint64_t version;
+        if (!load_root(top, version) || !top) return false;
+
+        // Breadth first, the order the fence is laid out in. A level is kept only when it is complete.
+        std::vector<Node*> nodes{ nullptr, top };
+        std::vector<uint64_t> versions{ 0, version };
+        size_t levels = 1;
+        for (; levels < fence_levels; levels++) {
+            size_t first = size_t(1) << (levels - 1);
+            bool complete = true;
+            for (size_t slot = first; slot < 2 * first; slot++) {
+                Node* parent = nodes[slot];
+                for (Node* child : { parent->left.load(std::memory_order_acquire), parent->right.load(std::memory_order_acquire) }) {
+                    uint64_t child_version = child ? child->version.load(std::memory_order_acquire) : 1;
+                    complete = complete && !(child_version & 1u);
+                    nodes.push_back(child);
+                    versions.push_back(child_version);
+                }
+                if (parent->version.load(std::memory_order_acquire) != versions[slot]) return false; // a writer raced
+            }
+            if (complete) continue;
+            nodes.resize(2 * first);
+            versions.resize(2 * first);
+            break;
+        }
+
+        auto built = std::make_unique<Fence>();
+        built->levels = levels;
+        built->relinks = seen_relinks;
+        built->lines.resize((nodes.size() + 7) / 8);
+        for (size_t slot = 1; slot < nodes.size(); slot++) {
+            built->prefix(slot) = nodes[slot]->prefix;
+            nodes[slot]->fenced.store(1, std::memory_order_relaxed);
+        }
+        built->nodes = std::move(nodes);
+        built->versions = std::move(versions);
+        // Pairs with the fence in erase(), either its eraser sees a node fenced and drops the fence, or the check
+        // below sees the node obsolete.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        Fence* published = built.release();
+        if (Fence* old = fence.exchange(published, std::memory_order_acq_rel)) guard.retire(old, reclaim_fence);
+        for (size_t slot = 1; slot < published->nodes.size(); slot++) {
+            if (!is_obsolete(published->nodes[slot])) continue;
+            Fence* expected = published;
+            if (fence.compare_exchange_strong(expected, nullptr, std::memory_order_acq_rel)) guard.retire(published, reclaim_fence);
+            return false;
+        }
+        return true;
+    }
+
+    void ConcurrentTree::drop_fence(EpochDomain::Guard& guard) {
+        if (Fence* dropped = fence.exchange(nullptr, std::memory_order_acq_rel)) guard.retire(dropped, reclaim_fence);
+    }
+
+    void ConcurrentTree::enter_fence(const SearchKey& search, Path& path, uint64_t seen_relinks) {
+        const Fence* current = fence.load(std::memory_order_acquire);
+        if (!current || current->relinks != seen_relinks) return;
+        // Branch free per level but for prefix ties. Four levels down are the 16 slots from 16k on, requested early
+        // so the last levels' lines are already on their way.
+        size_t slots = current->nodes.size();
+        size_t slot = 1;
+        size_t entry = 0;
+        for (size_t level = 0; level < current->levels; level++) {
+            if (16 * slot < slots) prefetch(&current->lines[2 * slot]);
+            uint64_t prefix = current->prefix(slot);
+            int order = prefix != search.prefix ? (prefix < search.prefix ? -1 : 1) : compare(current->nodes[slot]->key(), search.bytes);
+            if (order == 0) {
+                entry = slot;
+                break;
+            }
+            slot = 2 * slot + (order < 0);
+        }
+        // Without a match the walk enters at the last separator passed, the parent of the gap the key falls into.
+        if (!entry) entry = slot >> 1;
+        path.enter(current->nodes[entry], current->versions[entry]);
+    }
+}
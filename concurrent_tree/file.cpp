@@ -0,0 +1,78 @@
+#include "file.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include <filesystem>
+
+namespace sync {
+    bool flush_to_disk(std::FILE* file) {
+        if (std::fflush(file) != 0) return false;
+#if defined(_WIN32)
+        return _commit(_fileno(file)) == 0;
+#else
+        return fsync(fileno(file)) == 0;
+#endif
+    }
+
+    bool sync_directory(const std::string& path) {
+#if defined(_WIN32)
+        (void)path;
+        return true;
+#else
+        std::string directory = std::filesystem::path(path).parent_path().string();
+        int fd = open(directory.empty() ? "." : directory.c_str(), O_RDONLY | O_DIRECTORY);
+        if (fd < 0) return false;
+        bool synced = fsync(fd) == 0;
+        close(fd);
+        return synced;
+#endif
+    }
+
+    MappedFile::MappedFile(const std::string& path) {
+#if defined(_WIN32)
+        HANDLE handle = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (handle == INVALID_HANDLE_VALUE) return;
+        file = handle;
+        LARGE_INTEGER length;
+        if (!GetFileSizeEx(handle, &length) || length.QuadPart == 0) return;
+        mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        if (!mapping) return;
+        void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        if (!view) return;
+        data = static_cast<const unsigned char*>(view);
+        size = size_t(length.QuadPart);
+#else
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) return;
+        struct stat info;
+        if (fstat(fd, &info) == 0 && info.st_size > 0) {
+            void* view = mmap(nullptr, size_t(info.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (view != MAP_FAILED) {
+                madvise(view, size_t(info.st_size), MADV_SEQUENTIAL);
+                data = static_cast<const unsigned char*>(view);
+                size = size_t(info.st_size);
+            }
+        }
+        close(fd); // the mapping keeps the file alive
+#endif
+    }
+
+    MappedFile::~MappedFile() {
+#if defined(_WIN32)
+        if (data) UnmapViewOfFile(data);
+        if (mapping) CloseHandle(mapping);
+        if (file) CloseHandle(file);
+#else
+        if (data) munmap(const_cast<unsigned char*>(data), size);
+#endif
+    }
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "platform.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <span>
+#include <string>
+
+// Helpers shared by the on-disk formats, snapshots and the write-ahead log. Integers are stored little endian.
+namespace sync {
+
+    inline void store_u32(unsigned char* out, uint32_t value) {
+        for (int i = 0; i < 4; i++) out[i] = static_cast<unsigned char>(value >> (8 * i));
+    }
+
+    inline void store_u64(unsigned char* out, uint64_t value) {
+        for (int i = 0; i < 8; i++) out[i] = static_cast<unsigned char>(value >> (8 * i));
+    }
+
+    inline uint32_t load_u32(const unsigned char* in) {
+        uint32_t value = 0;
+        for (int i = 0; i < 4; i++) value |= uint32_t(in[i]) << (8 * i);
+        return value;
+    }
+
+    inline uint64_t load_u64(const unsigned char* in) {
+        uint64_t value = 0;
+        for (int i = 0; i < 8; i++) value |= uint64_t(in[i]) << (8 * i);
+        return value;
+    }
+
+    // FNV-1a, fed in pieces.
+    struct Checksum {
+        uint64_t hash = 0xCBF29CE484222325ull;
+        void add(const unsigned char* bytes, size_t size) {
+            for (size_t i = 0; i < size; i++) {
+                hash ^= bytes[i];
+                hash *= 0x100000001B3ull;
+            }
+        }
+    };
+
+    // Flushes the C buffers and asks the OS to put the file on disk.
+    bool flush_to_disk(std::FILE* file);
+
+    // Puts the directory entries of the directory holding path on disk, so a file created or renamed there survives
+    // a crash. NTFS journals its metadata and has no directory sync, Windows only reports success.
+    bool sync_directory(const std::string& path);
+
+    // Read only view of a whole file, unmapped on destruction. Empty if the file is missing or empty.
+    class MappedFile {
+    public:
+        explicit MappedFile(const std::string& path);
+        ~MappedFile();
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+
+        std::span<const unsigned char> bytes() const { return { data, size }; }
+
+    private:
+        const unsigned char* data = nullptr;
+        size_t size = 0;
+#if defined(_WIN32)
+        void* file = nullptr;
+        void* mapping = nullptr;
+#endif
+    };
+}
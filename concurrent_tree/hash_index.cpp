@@ -0,0 +1,43 @@
+#include "hash_index.h"
+
+#include <algorithm>
+#include <bit>
+#include <functional>
+#include <string_view>
+
+namespace sync {
+    HashIndex::HashIndex(size_t capacity) : mask(std::bit_ceil(std::max<size_t>(capacity, PROBE_LIMIT)) - 1) {
+        slots = std::make_unique<Slot[]>(mask + 1);
+    }
+
+    uint64_t HashIndex::hash(std::span<const unsigned char> key) {
+        std::string_view view(reinterpret_cast<const char*>(key.data()), key.size());
+        uint64_t hash = std::hash<std::string_view>{}(view);
+        // Mixed, std::hash may be the identity on some standard libraries and the low bits pick the slot.
+        hash ^= hash >> 33;
+        hash *= 0xff51afd7ed558ccdull;
+        hash ^= hash >> 33;
+        return hash;
+    }
+
+    bool HashIndex::insert(uint64_t hash, Node* node) {
+        for (size_t i = 0; i < PROBE_LIMIT; i++) {
+            Slot& slot = slots[(hash + i) & mask];
+            Node* current = slot.node.load(std::memory_order_relaxed);
+            if (current && current != tombstone()) continue;
+            if (!slot.node.compare_exchange_strong(current, node, std::memory_order_seq_cst, std::memory_order_relaxed)) continue;
+            slot.hash.store(hash, std::memory_order_release);
+            return true;
+        }
+        return false;
+    }
+
+    void HashIndex::remove(uint64_t hash, Node* node) {
+        for (size_t i = 0; i < PROBE_LIMIT; i++) {
+            Slot& slot = slots[(hash + i) & mask];
+            Node* current = slot.node.load(std::memory_order_relaxed);
+            if (!current) return;
+            if (current == node && slot.node.compare_exchange_strong(current, tombstone(), std::memory_order_seq_cst, std::memory_order_relaxed)) return;
+        }
+    }
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include "platform.h"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <span>
+
+namespace sync {
+
+    struct Node;
+
+    // Optional point lookup index next to a ConcurrentTree: a fixed size, open addressing table from key hash to
+    // node, passed to the tree's constructor. Lock free and allowed to miss: a key whose probe window is full, or
+    // whose insert is still being published, just isn't found here and the lookup walks the tree. Entries only ever
+    // point at linked nodes, erase() takes a node out before retiring it, and ordering and scans stay with the tree.
+    class HashIndex {
+    public:
+        // Slots looked at per key, a key whose window has no free slot is left out of the index.
+        static constexpr size_t PROBE_LIMIT = 16;
+
+        // Rounded up to a power of two. Twice the expected key count keeps probe windows short.
+        explicit HashIndex(size_t capacity);
+        HashIndex(const HashIndex&) = delete;
+        HashIndex& operator=(const HashIndex&) = delete;
+
+        static uint64_t hash(std::span<const unsigned char> key);
+        size_t capacity() const { return mask + 1; }
+
+        // False if the window was full.
+        bool insert(uint64_t hash, Node* node);
+        void remove(uint64_t hash, Node* node);
+        // First node in the window whose hash matches and for which matches(node) holds, nullptr if none.
+        template <class Match>
+        Node* find(uint64_t hash, Match&& matches) const {
+            for (size_t i = 0; i < PROBE_LIMIT; i++) {
+                const Slot& slot = slots[(hash + i) & mask];
+                Node* node = slot.node.load(std::memory_order_acquire);
+                if (!node) return nullptr; // never used, the key was not inserted past it
+                if (node == tombstone() || slot.hash.load(std::memory_order_relaxed) != hash) continue;
+                if (matches(node)) return node;
+            }
+            return nullptr;
+        }
+
+    private:
+        // A removed entry, probing goes on past it and inserts reuse it.
+        static Node* tombstone() { return reinterpret_cast<Node*>(uintptr_t(1)); }
+
+        // The hash is written after the node is claimed and may lag behind it, matches() always checks the key.
+        struct Slot {
+            std::atomic<uint64_t> hash{ 0 };
+            std::atomic<Node*> node{ nullptr };
+        };
+
+        std::unique_ptr<Slot[]> slots;
+        size_t mask;
+    };
+}
@@ -0,0 +1,55 @@
+#include "concurrent.h"
+
+#include <bit>
+
+// Full traversals on several threads. The keys of the tree's first levels split the key space into ranges holding
+// about equal shares of a balanced tree, and every range is walked by its own Iterator. The split keys are only
+// boundaries, an erased or rotated away one still splits correctly, so they are read without any validation.
+namespace sync {
+    void ConcurrentTree::parallelForEach(const ForEachVisitor& visitor, unsigned threads) {
+        if (!threads) threads = std::max(1u, std::thread::hardware_concurrency());
+        auto splits = split_keys(threads * RANGES_PER_THREAD);
+        run_parallel(splits.size() + 1, threads, [&](size_t range) { visit_range(splits, range, visitor); });
+    }
+
+    std::vector<std::vector<unsigned char>> ConcurrentTree::split_keys(size_t parts) {
+        counters.add(Counter::Scans); // a traversal counts once, however many ranges it takes
+        std::vector<std::vector<unsigned char>> splits;
+        // The 2^levels - 1 nodes of the first levels split a balanced tree into 2^levels ranges.
+        size_t levels = std::bit_width(parts - 1);
+        auto guard = epoch.pin();
+        std::vector<std::pair<Node*, size_t>> stack;
+        if (Node* top = root.load(std::memory_order_acquire); top && levels) stack.push_back({ top, 1 });
+        while (!stack.empty()) {
+            auto [node, level] = stack.back();
+            stack.pop_back();
+            splits.emplace_back(node->key().begin(), node->key().end());
+            if (level == levels) continue;
+            // Keys are immutable and pinned nodes stay readable, a racing rotation only makes the ranges uneven.
+            if (Node* left = node->left.load(std::memory_order_acquire)) stack.push_back({ left, level + 1 });
+            if (Node* right = node->right.load(std::memory_order_acquire)) stack.push_back({ right, level + 1 });
+        }
+        std::sort(splits.begin(), splits.end(), [](const auto& a, const auto& b) { return compare(a, b) < 0; });
+        splits.erase(std::unique(splits.begin(), splits.end()), splits.end());
+        return splits;
+    }
+
+    void ConcurrentTree::visit_range(const std::vector<std::vector<unsigned char>>& splits, size_t range, const ForEachVisitor& visitor) {
+        for (Iterator it = range ? lower_bound(splits[range - 1]) : begin(); it.valid(); it.next()) {
+            if (range < splits.size() && compare(it.key(), splits[range]) >= 0) return;
+            visitor(it.key(), it.value());
+        }
+    }
+
+    void ConcurrentTree::run_parallel(size_t tasks, unsigned threads, const std::function<void(size_t)>& task) {
+        // Tasks are handed out one at a time, a thread done with a short range takes the next one.
+        std::atomic<size_t> next{ 0 };
+        auto work = [&] {
+            for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < tasks;) task(i);
+        };
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < std::min<size_t>(threads, tasks); t++) workers.emplace_back(work);
+        work();
+        for (std::thread& worker : workers) worker.join();
+    }
+}
@@ -0,0 +1,10 @@
+#pragma once
+
+// The tree lives in namespace sync, and POSIX declares a global sync() in <unistd.h>; the two can't share a
+// translation unit. On POSIX systems unistd.h is pulled in here first with its sync() renamed, later includes
+// of it are no-ops. Include the tree's headers before any standard or system header there.
+#if defined(__unix__) || defined(__APPLE__)
+#define sync posix_sync
+#include <unistd.h>
+#undef sync
+#endif
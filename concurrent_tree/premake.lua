@@ -7,7 +7,36 @@ project "ConcurrentTree"
 
   files {
     "concurrent.h",
-    "concurrent.cpp"
+    "concurrent.cpp",
+    "allocator.h",
+    "allocator.cpp",
+    "backoff.h",
+    "bplus.h",
+    "bplus.cpp",
+    "cache.cpp",
+    "combining.cpp",
+    "epoch.h",
+    "epoch.cpp",
+    "feed.h",
+    "feed.cpp",
+    "fence.cpp",
+    "file.h",
+    "file.cpp",
+    "hash_index.h",
+    "hash_index.cpp",
+    "parallel.cpp",
+    "platform.h",
+    "repair.h",
+    "repair.cpp",
+    "sharded.h",
+    "sharded.cpp",
+    "snapshot.cpp",
+    "stats.h",
+    "stats.cpp",
+    "typed.h",
+    "versions.cpp",
+    "wal.h",
+    "wal.cpp"
   }
 
   includedirs { "." }
@@ -0,0 +1,63 @@
+#include "repair.h"
+
+#include <functional>
+
+namespace sync {
+    void RepairQueue::start(std::function<void()> repair, std::chrono::milliseconds interval) {
+        std::lock_guard<std::mutex> held(lock);
+        if (maintainer.joinable()) return;
+        stopping = false;
+        accepting.store(true, std::memory_order_release);
+        maintainer = std::thread([this, repair = std::move(repair), interval] {
+            std::unique_lock<std::mutex> held(lock);
+            while (!stopping) {
+                wake.wait_for(held, interval, [this] { return stopping || pending() >= BATCH; });
+                if (stopping) break;
+                // Repairs take node locks, writers queueing meanwhile must not wait for this one.
+                held.unlock();
+                repair();
+                held.lock();
+            }
+        });
+    }
+
+    void RepairQueue::stop() {
+        accepting.store(false, std::memory_order_release);
+        std::thread stopped;
+        {
+            std::lock_guard<std::mutex> held(lock);
+            stopping = true;
+            stopped = std::move(maintainer);
+        }
+        wake.notify_all();
+        if (stopped.joinable()) stopped.join();
+    }
+
+    bool RepairQueue::push(std::span<const unsigned char> key) {
+        if (!accepting.load(std::memory_order_acquire)) return false;
+        if (count.fetch_add(1, std::memory_order_relaxed) >= BACKLOG) {
+            count.fetch_sub(1, std::memory_order_relaxed);
+            return false;
+        }
+        static thread_local const size_t hint = std::hash<std::thread::id>{}(std::this_thread::get_id()) % SHARDS;
+        Shard& shard = shards[hint];
+        {
+            std::lock_guard<std::mutex> held(shard.lock);
+            shard.keys.emplace_back(key.begin(), key.end());
+        }
+        if (pending() == BATCH) wake.notify_one();
+        return true;
+    }
+
+    void RepairQueue::drain(std::vector<std::vector<unsigned char>>& out) {
+        for (Shard& shard : shards) {
+            std::vector<std::vector<unsigned char>> keys;
+            {
+                std::lock_guard<std::mutex> held(shard.lock);
+                keys.swap(shard.keys);
+            }
+            count.fetch_sub(keys.size(), std::memory_order_relaxed);
+            for (auto& key : keys) out.push_back(std::move(key));
+        }
+    }
+}
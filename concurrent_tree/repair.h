@@ -0,0 +1,56 @@
+#pragma once
+
+#include "platform.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+namespace sync {
+
+    // Keys of inserts whose rebalancing was deferred, and the maintainer thread that repairs them in batches. Split
+    // into mutex guarded shards picked per thread, so writers queueing at the same time rarely share a lock. Bounded:
+    // push() fails once BACKLOG keys wait or while no maintainer runs, the writer then rebalances on its own and the
+    // tree's height drift stays bounded.
+    class RepairQueue {
+    public:
+        static constexpr size_t BACKLOG = 1 << 12;
+        static constexpr size_t BATCH = 256; // queued keys that wake the maintainer before its interval is up
+
+        RepairQueue() = default;
+        ~RepairQueue() { stop(); }
+        RepairQueue(const RepairQueue&) = delete;
+        RepairQueue& operator=(const RepairQueue&) = delete;
+
+        // Starts accepting keys and a thread that calls repair every interval, or sooner once BATCH keys wait.
+        void start(std::function<void()> repair, std::chrono::milliseconds interval);
+        // Stops accepting keys and joins the thread. Keys still queued stay until drained.
+        void stop();
+        bool push(std::span<const unsigned char> key);
+        void drain(std::vector<std::vector<unsigned char>>& out);
+        size_t pending() const { return count.load(std::memory_order_relaxed); }
+
+    private:
+        static constexpr size_t SHARDS = 16;
+
+        struct alignas(64) Shard {
+            std::mutex lock;
+            std::vector<std::vector<unsigned char>> keys;
+        };
+
+        Shard shards[SHARDS];
+        std::atomic<size_t> count{ 0 };
+        std::atomic<bool> accepting{ false };
+
+        std::mutex lock; // guards stopping and the maintainer's start and stop
+        std::condition_variable wake;
+        bool stopping = false;
+        std::thread maintainer;
+    };
+}
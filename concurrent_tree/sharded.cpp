@@ -0,0 +1,127 @@
+#include "sharded.h"
+
+#include <algorithm>
+#include <cassert>
+#include <functional>
+
+namespace sync {
+    static bool key_less(std::span<const unsigned char> a, std::span<const unsigned char> b) {
+        return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+    }
+
+    ShardedConcurrentTree::ShardedConcurrentTree(size_t count, Partitioning partitioning) : partitioning(partitioning) {
+        assert(count > 0);
+        if (partitioning == Partitioning::Range) {
+            for (size_t i = 1; i < count; i++) splits.push_back({ static_cast<unsigned char>(i * 256 / count) });
+            splits.erase(std::unique(splits.begin(), splits.end()), splits.end()); // more shards than byte values
+            count = splits.size() + 1;
+        }
+        for (size_t i = 0; i < count; i++) shards.push_back(std::make_unique<Shard>());
+    }
+
+    ShardedConcurrentTree::ShardedConcurrentTree(std::vector<std::vector<unsigned char>> splits)
+        : partitioning(Partitioning::Range), splits(std::move(splits)) {
+        assert(std::is_sorted(this->splits.begin(), this->splits.end()));
+        for (size_t i = 0; i <= this->splits.size(); i++) shards.push_back(std::make_unique<Shard>());
+    }
+
+    size_t ShardedConcurrentTree::shard_of(std::span<const unsigned char> key) const {
+        if (partitioning == Partitioning::Hash) {
+            std::string_view view(reinterpret_cast<const char*>(key.data()), key.size());
+            return std::hash<std::string_view>{}(view) % shards.size();
+        }
+        // Number of splits at or below key.
+        auto split = std::upper_bound(splits.begin(), splits.end(), key, [](std::span<const unsigned char> key, const std::vector<unsigned char>& split) {
+            return key_less(key, split);
+        });
+        return split - splits.begin();
+    }
+
+    void ShardedConcurrentTree::put(std::span<const unsigned char> key, std::vector<unsigned char> value) {
+        put(key, std::make_shared<const std::vector<unsigned char>>(std::move(value)));
+    }
+
+    void ShardedConcurrentTree::put(std::span<const unsigned char> key, Value value) {
+        Shard& shard = *shards[shard_of(key)];
+        shard.writes.add(1);
+        shard.tree.put(key, std::move(value));
+    }
+
+    std::vector<unsigned char> ShardedConcurrentTree::get(std::span<const unsigned char> key) {
+        Value value = find(key);
+        return value ? *value : NULL_VALUE;
+    }
+
+    Value ShardedConcurrentTree::find(std::span<const unsigned char> key) {
+        Shard& shard = *shards[shard_of(key)];
+        shard.reads.add(1);
+        return shard.tree.find(key);
+    }
+
+    Value ShardedConcurrentTree::find(std::string_view key) {
+        return find(bytes(key));
+    }
+
+    bool ShardedConcurrentTree::erase(std::span<const unsigned char> key) {
+        Shard& shard = *shards[shard_of(key)];
+        if (!shard.tree.erase(key)) return false;
+        shard.erases.add(1);
+        return true;
+    }
+
+    void ShardedConcurrentTree::scan(std::span<const unsigned char> lo, std::span<const unsigned char> hi, const ScanVisitor& visitor) {
+        visit(lo, &hi, visitor);
+    }
+
+    void ShardedConcurrentTree::printList() {
+        visit({}, nullptr, [](std::span<const unsigned char> key, const Value& value) {
+            std::cout << parse(key) << " : " << parse(*value) << std::endl;
+            return true;
+        });
+    }
+
+    size_t ShardedConcurrentTree::size() const {
+        size_t total = 0;
+        for (const auto& shard : shards) total += shard->tree.size();
+        return total;
+    }
+
+    void ShardedConcurrentTree::visit(std::span<const unsigned char> lo, const std::span<const unsigned char>* hi, const ScanVisitor& visitor) {
+        auto in_range = [hi](std::span<const unsigned char> key) { return !hi || key_less(key, *hi); };
+
+        if (partitioning == Partitioning::Range) {
+            // Shards are disjoint and ordered, walk them one at a time so only one epoch domain is pinned.
+            size_t last = hi ? shard_of(*hi) : shards.size() - 1;
+            for (size_t i = shard_of(lo); i <= last; i++) {
+                for (auto it = shards[i]->tree.lower_bound(lo); it.valid(); it.next()) {
+                    if (!in_range(it.key())) return;
+                    if (!visitor(it.key(), it.value())) return;
+                }
+            }
+            return;
+        }
+
+        // Hash shards interleave, merge one cursor per shard by always taking the smallest key.
+        std::vector<ConcurrentTree::Iterator> cursors;
+        cursors.reserve(shards.size());
+        for (auto& shard : shards) cursors.push_back(shard->tree.lower_bound(lo));
+        while (true) {
+            ConcurrentTree::Iterator* smallest = nullptr;
+            for (auto& it : cursors) {
+                if (it.valid() && (!smallest || key_less(it.key(), smallest->key()))) smallest = &it;
+            }
+            if (!smallest || !in_range(smallest->key())) return;
+            if (!visitor(smallest->key(), smallest->value())) return;
+            smallest->next();
+        }
+    }
+
+    std::vector<ShardStats> ShardedConcurrentTree::stats() const {
+        std::vector<ShardStats> result;
+        result.reserve(shards.size());
+        for (const auto& shard : shards) {
+            result.push_back({ uint64_t(shard->reads.load()), uint64_t(shard->writes.load()), uint64_t(shard->erases.load()), shard->tree.stats() });
+        }
+        return result;
+    }
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "platform.h"
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string_view>
+#include <vector>
+
+#include "concurrent.h"
+
+namespace sync {
+
+    // How ShardedConcurrentTree maps a key to a shard.
+    enum class Partitioning {
+        Hash,  // spreads any key distribution evenly, ordered scans merge every shard
+        Range  // shard i holds the keys in [splits[i - 1], splits[i]), ordered scans walk shards one after another
+    };
+
+    // Operation counts of one shard, a relaxed snapshot.
+    struct ShardStats {
+        uint64_t reads = 0;
+        uint64_t writes = 0;
+        uint64_t erases = 0; // erase() calls that removed a key
+        TreeStats tree;      // the shard's own contention counters
+    };
+
+    // Front end over independent ConcurrentTrees. Each shard has its own root, locks and epoch domain, so writers
+    // to different shards never meet at a common root while rebalancing.
+    class ShardedConcurrentTree {
+    public:
+        using ScanVisitor = ConcurrentTree::ScanVisitor;
+
+        const std::vector<unsigned char> NULL_VALUE{ {} };
+        // Range partitioning without explicit splits divides the first key byte evenly between the shards.
+        explicit ShardedConcurrentTree(size_t shards, Partitioning partitioning = Partitioning::Hash);
+        // Range partitioning on ascending split keys, one shard more than there are splits.
+        explicit ShardedConcurrentTree(std::vector<std::vector<unsigned char>> splits);
+        ShardedConcurrentTree(const ShardedConcurrentTree&) = delete;
+        ShardedConcurrentTree& operator=(const ShardedConcurrentTree&) = delete;
+
+        void put(std::span<const unsigned char> key, std::vector<unsigned char> value);
+        void put(std::span<const unsigned char> key, Value value);
+        std::vector<unsigned char> get(std::span<const unsigned char> key);
+        Value find(std::span<const unsigned char> key);
+        Value find(std::string_view key);
+        bool erase(std::span<const unsigned char> key);
+        // Visits every key in [lo, hi) in ascending order across all shards.
+        void scan(std::span<const unsigned char> lo, std::span<const unsigned char> hi, const ScanVisitor& visitor);
+        void printList();
+        // Keys over all shards, each shard's size() summed.
+        size_t size() const;
+
+        size_t shard_count() const { return shards.size(); }
+        size_t shard_of(std::span<const unsigned char> key) const;
+        ConcurrentTree& shard(size_t index) { return shards[index]->tree; }
+        std::vector<ShardStats> stats() const;
+
+    private:
+        struct alignas(64) Shard {
+            ConcurrentTree tree;
+            // Per thread slots, a shared counter would put every operation on the shard's one hot line.
+            ShardedCount reads;
+            ShardedCount writes;
+            ShardedCount erases;
+        };
+
+        Partitioning partitioning;
+        std::vector<std::vector<unsigned char>> splits;
+        std::vector<std::unique_ptr<Shard>> shards;
+
+        void visit(std::span<const unsigned char> lo, const std::span<const unsigned char>* hi, const ScanVisitor& visitor);
+    };
+}
@@ -0,0 +1,112 @@
+#include "concurrent.h"
+#include "file.h"
+
+#include <cstdio>
+#include <filesystem>
+
+// Snapshot file layout, integers little endian:
+//   header  : magic "CTSNAP01", u32 format version, u32 reserved
+//   records : u32 key size, u32 value size, key bytes, value bytes; ascending by key, keys and values under 4 GiB
+//   trailer : u64 record count, u64 FNV-1a of the record bytes, magic "CTSNAPND"
+// The trailer is written last, a snapshot cut short by a crash has none and is rejected by restore().
+namespace sync {
+    namespace {
+        constexpr unsigned char HEADER_MAGIC[8] = { 'C', 'T', 'S', 'N', 'A', 'P', '0', '1' };
+        constexpr unsigned char TRAILER_MAGIC[8] = { 'C', 'T', 'S', 'N', 'A', 'P', 'N', 'D' };
+        constexpr uint32_t FORMAT_VERSION = 1;
+        constexpr size_t HEADER_SIZE = 16;
+        constexpr size_t TRAILER_SIZE = 24;
+        constexpr size_t WRITE_BUFFER = 1 << 20;
+        constexpr size_t MAX_FIELD = 0xffffffffu; // largest size a u32 record field holds
+    }
+
+    bool ConcurrentTree::snapshot(const std::string& path) {
+        // Written next to the target and renamed over it once complete, a crash never leaves a torn snapshot behind.
+        std::string temporary = path + ".tmp";
+        std::FILE* file = std::fopen(temporary.c_str(), "wb");
+        if (!file) return false;
+        std::vector<char> buffer(WRITE_BUFFER);
+        std::setvbuf(file, buffer.data(), _IOFBF, buffer.size());
+
+        unsigned char header[HEADER_SIZE] = {};
+        std::memcpy(header, HEADER_MAGIC, sizeof(HEADER_MAGIC));
+        store_u32(header + 8, FORMAT_VERSION);
+        bool written = std::fwrite(header, 1, sizeof(header), file) == sizeof(header);
+
+        // Read as of one stamp, writes made during the dump keep their older values for it instead of tearing it.
+        uint64_t count = 0;
+        Checksum checksum;
+        if (written) openSnapshot().visit({}, nullptr, [&](std::span<const unsigned char> key, const Value& stored) {
+            static const std::vector<unsigned char> empty;
+            const std::vector<unsigned char>& value = stored ? *stored : empty;
+            if (key.size() > MAX_FIELD || value.size() > MAX_FIELD) {
+                written = false;
+                return false;
+            }
+            unsigned char sizes[8];
+            store_u32(sizes, uint32_t(key.size()));
+            store_u32(sizes + 4, uint32_t(value.size()));
+            checksum.add(sizes, sizeof(sizes));
+            checksum.add(key.data(), key.size());
+            checksum.add(value.data(), value.size());
+            written = std::fwrite(sizes, 1, sizeof(sizes), file) == sizeof(sizes)
+                && std::fwrite(key.data(), 1, key.size(), file) == key.size()
+                && std::fwrite(value.data(), 1, value.size(), file) == value.size();
+            count++;
+            return written;
+        });
+
+        unsigned char trailer[TRAILER_SIZE];
+        store_u64(trailer, count);
+        store_u64(trailer + 8, checksum.hash);
+        std::memcpy(trailer + 16, TRAILER_MAGIC, sizeof(TRAILER_MAGIC));
+        written = written && std::fwrite(trailer, 1, sizeof(trailer), file) == sizeof(trailer) && flush_to_disk(file);
+        written = std::fclose(file) == 0 && written;
+
+        std::error_code error;
+        if (written) std::filesystem::rename(temporary, path, error);
+        if (!written || error) {
+            std::filesystem::remove(temporary, error);
+            return false;
+        }
+        // The rename is only durable once the directory is, until then a crash may bring back the old file.
+        return sync_directory(path);
+    }
+
+    bool ConcurrentTree::restore(const std::string& path, BulkMode mode) {
+        MappedFile file(path);
+        std::span<const unsigned char> image = file.bytes();
+        if (image.size() < HEADER_SIZE + TRAILER_SIZE
+            || std::memcmp(image.data(), HEADER_MAGIC, sizeof(HEADER_MAGIC)) != 0
+            || load_u32(image.data() + 8) != FORMAT_VERSION) return false;
+        const unsigned char* trailer = image.data() + image.size() - TRAILER_SIZE;
+        if (std::memcmp(trailer + 16, TRAILER_MAGIC, sizeof(TRAILER_MAGIC)) != 0) return false;
+        uint64_t count = load_u64(trailer);
+
+        // Keys are views into the mapping, only the value buffers are copied out of it.
+        std::span<const unsigned char> body = image.subspan(HEADER_SIZE, image.size() - HEADER_SIZE - TRAILER_SIZE);
+        if (count > body.size() / 8) return false;
+        std::vector<Record> records;
+        records.reserve(size_t(count));
+        Checksum checksum;
+        checksum.add(body.data(), body.size());
+        if (checksum.hash != load_u64(trailer + 8)) return false;
+
+        size_t offset = 0;
+        while (offset < body.size()) {
+            if (body.size() - offset < 8) return false;
+            size_t key_size = load_u32(body.data() + offset);
+            size_t value_size = load_u32(body.data() + offset + 4);
+            offset += 8;
+            if (body.size() - offset < key_size + value_size) return false;
+            std::span<const unsigned char> key = body.subspan(offset, key_size);
+            std::span<const unsigned char> value = body.subspan(offset + key_size, value_size);
+            offset += key_size + value_size;
+            if (!records.empty() && compare(records.back().key, key) >= 0) return false;
+            records.push_back({ key, std::make_shared<const std::vector<unsigned char>>(value.begin(), value.end()) });
+        }
+        if (records.size() != count) return false;
+        // bulkLoad copies the keys into the nodes, the mapping may go once it returns.
+        return bulkLoad(records, mode);
+    }
+}
@@ -0,0 +1,89 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <bit>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace sync {
+    namespace {
+        std::mutex slots_lock;
+        std::vector<size_t> free_slots; // returned by exited threads, taken before next_slot grows
+        size_t next_slot = 0;
+
+        // Holds a thread's slot for its lifetime and returns it to the free list at thread exit.
+        struct SlotLease {
+            size_t slot;
+            bool owned = true;
+            SlotLease() {
+                std::lock_guard<std::mutex> lock(slots_lock);
+                if (!free_slots.empty()) {
+                    slot = free_slots.back();
+                    free_slots.pop_back();
+                }
+                else if (next_slot < THREAD_SLOTS) slot = next_slot++;
+                else {
+                    slot = std::hash<std::thread::id>{}(std::this_thread::get_id()) % THREAD_SLOTS;
+                    owned = false;
+                }
+            }
+            ~SlotLease() {
+                if (!owned) return;
+                std::lock_guard<std::mutex> lock(slots_lock);
+                free_slots.push_back(slot);
+            }
+        };
+    }
+
+    size_t thread_slot() {
+        static thread_local const SlotLease lease;
+        return lease.slot;
+    }
+
+    void StatsCollector::acquired(const LockWait& wait) {
+#if SYNC_TREE_STATS
+        if (wait.since == std::chrono::steady_clock::time_point{}) return; // got the lock on the first attempt
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - wait.since).count();
+        Slot& slot = local();
+        slot.counters[size_t(Counter::LockWaits)].fetch_add(1, std::memory_order_relaxed);
+        size_t bucket = std::min<size_t>(std::bit_width(ns >> 7), LOCK_WAIT_BUCKETS - 1);
+        slot.lock_wait_ns[bucket].fetch_add(1, std::memory_order_relaxed);
+#else
+        (void)wait;
+#endif
+    }
+
+    void StatsCollector::snapshot(TreeStats& stats) const {
+#if SYNC_TREE_STATS
+        uint64_t totals[size_t(Counter::COUNT)] = {};
+        for (const Slot& slot : slots) {
+            for (size_t i = 0; i < size_t(Counter::COUNT); i++) totals[i] += slot.counters[i].load(std::memory_order_relaxed);
+            for (size_t i = 0; i < LOCK_WAIT_BUCKETS; i++) stats.lock_wait_ns[i] += slot.lock_wait_ns[i].load(std::memory_order_relaxed);
+        }
+        auto total = [&](Counter counter) { return totals[size_t(counter)]; };
+        stats.finds = total(Counter::Finds);
+        stats.puts = total(Counter::Puts);
+        stats.inserts = total(Counter::Inserts);
+        stats.erases = total(Counter::Erases);
+        stats.removals = total(Counter::Removals);
+        stats.scans = total(Counter::Scans);
+        stats.restarts = total(Counter::Restarts);
+        stats.rewalked_levels = total(Counter::RewalkedLevels);
+        stats.rotations = total(Counter::Rotations);
+        stats.rotation_retries = total(Counter::RotationRetries);
+        stats.recolors = total(Counter::Recolors);
+        stats.lock_waits = total(Counter::LockWaits);
+        stats.index_hits = total(Counter::IndexHits);
+        stats.deferred_repairs = total(Counter::DeferredRepairs);
+        stats.combined_puts = total(Counter::CombinedPuts);
+        stats.evictions = total(Counter::Evictions);
+        stats.fence_entries = total(Counter::FenceEntries);
+        // Removals are counted after their insert, a racing snapshot may still see the removal first.
+        stats.size = stats.inserts > stats.removals ? stats.inserts - stats.removals : 0;
+#else
+        (void)stats;
+#endif
+    }
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include "platform.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+// Instrumentation is on unless the build defines SYNC_TREE_STATS=0 (premake --no-stats), then every counter
+// compiles to nothing and stats() reports zeros.
+#ifndef SYNC_TREE_STATS
+#define SYNC_TREE_STATS 1
+#endif
+
+namespace sync {
+
+    enum class Counter : size_t {
+        Finds,
+        Puts,
+        Inserts,         // puts that linked a new node
+        Erases,
+        Removals,        // erases that unlinked a node
+        Scans,
+        Restarts,        // optimistic traversals that failed validation and walked again
+        RewalkedLevels,  // tree levels those traversals walked twice
+        Rotations,
+        RotationRetries, // rotations that lost their locks or found the nodes changed, and tried again
+        Recolors,
+        LockWaits,       // begin_write calls that found the node locked
+        IndexHits,       // finds answered by the hash index without walking the tree
+        DeferredRepairs, // inserts left to the maintainer to rebalance, relaxed balance only
+        CombinedPuts,    // puts applied by another writer's combiner, combining only
+        Evictions,       // keys erased to stay within capacity, cache mode only
+        FenceEntries,    // walks that started below the root at a fence entry
+        COUNT
+    };
+
+    constexpr size_t LOCK_WAIT_BUCKETS = 16;
+
+    // Snapshot of a tree's counters. The counters are relaxed and summed slot by slot while other threads go on,
+    // so the fields are not one atomic cut, but each is exact once the tree is quiescent.
+    struct TreeStats {
+        uint64_t finds = 0;
+        uint64_t puts = 0;
+        uint64_t inserts = 0;
+        uint64_t erases = 0;
+        uint64_t removals = 0;
+        uint64_t scans = 0;
+        uint64_t restarts = 0;
+        uint64_t rewalked_levels = 0;
+        uint64_t rotations = 0;
+        uint64_t rotation_retries = 0;
+        uint64_t recolors = 0;
+        uint64_t lock_waits = 0;
+        uint64_t index_hits = 0;
+        uint64_t deferred_repairs = 0;
+        uint64_t combined_puts = 0;
+        uint64_t evictions = 0;
+        uint64_t fence_entries = 0;
+        // Bucket i counts lock waits shorter than 2^(i + 7) ns, the last one everything longer.
+        uint64_t lock_wait_ns[LOCK_WAIT_BUCKETS] = {};
+        uint64_t size = 0;   // inserts - removals
+        uint64_t height = 0; // levels on the longest root to leaf path, walked when the snapshot was taken
+    };
+
+    // Slot of the calling thread in [0, THREAD_SLOTS). Live threads get distinct slots from a free list, a thread
+    // gives its slot back when it exits. Only threads beyond THREAD_SLOTS alive at once fall back to a hash of their
+    // id and may share a slot.
+    constexpr size_t THREAD_SLOTS = 64;
+    size_t thread_slot();
+
+    // Signed count split into cache line padded slots, one per thread like the collector's, so adds never share a
+    // line. Not instrumentation, it is kept whatever SYNC_TREE_STATS says. load() sums the slots, a fixed cost.
+    class ShardedCount {
+    public:
+        void add(int64_t amount) { local().value.fetch_add(amount, std::memory_order_relaxed); }
+        int64_t load() const {
+            int64_t total = 0;
+            for (const Slot& slot : slots) total += slot.value.load(std::memory_order_relaxed);
+            return total;
+        }
+
+    private:
+        struct alignas(64) Slot {
+            std::atomic<int64_t> value{ 0 };
+        };
+
+        Slot slots[THREAD_SLOTS];
+
+        Slot& local() { return slots[thread_slot()]; }
+    };
+
+    // Counters split into cache line padded slots, one per thread (see thread_slot), so threads bump their own lines
+    // and never share one in the hot path. Threads that do share a slot keep the counters exact.
+    class StatsCollector {
+    public:
+        // Measures how long a begin_write spun on a held lock, from the first failed attempt.
+        class LockWait {
+        public:
+            void waiting() {
+#if SYNC_TREE_STATS
+                if (since == std::chrono::steady_clock::time_point{}) since = std::chrono::steady_clock::now();
+#endif
+            }
+        private:
+            friend class StatsCollector;
+#if SYNC_TREE_STATS
+            std::chrono::steady_clock::time_point since{};
+#endif
+        };
+
+        void add(Counter counter, uint64_t amount = 1) {
+#if SYNC_TREE_STATS
+            local().counters[size_t(counter)].fetch_add(amount, std::memory_order_relaxed);
+#else
+            (void)counter; (void)amount;
+#endif
+        }
+
+        void acquired(const LockWait& wait);
+        void snapshot(TreeStats& stats) const;
+
+    private:
+#if SYNC_TREE_STATS
+        struct alignas(64) Slot {
+            std::atomic<uint64_t> counters[size_t(Counter::COUNT)] = {};
+            std::atomic<uint64_t> lock_wait_ns[LOCK_WAIT_BUCKETS] = {};
+        };
+
+        Slot slots[THREAD_SLOTS];
+
+        Slot& local() { return slots[thread_slot()]; }
+#endif
+    };
+}
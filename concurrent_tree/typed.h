@@ -0,0 +1,170 @@
+#pragma once
+
+#include "platform.h"
+
+#include <array>
+#include <concepts>
+#include <cstring>
+#include <functional>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include "concurrent.h"
+
+namespace sync {
+
+    // Order preserving byte encoding of a key: two encoded keys compare bytewise like the keys compare with <. decode
+    // throws std::invalid_argument for bytes no key encodes to, a key put through the byte tree underneath may be one.
+    template <class Key>
+    struct KeyCodec;
+
+    // Integers big endian, signed ones with the sign bit flipped so negatives sort first. At most 8 bytes, so the
+    // key sits inline in the node and its cached prefix is the whole key: a level costs one integer comparison.
+    template <std::integral Key>
+    struct KeyCodec<Key> {
+        using Unsigned = std::make_unsigned_t<Key>;
+        static constexpr Unsigned SIGN = std::is_signed_v<Key> ? Unsigned(Unsigned(1) << (8 * sizeof(Key) - 1)) : 0;
+
+        static std::array<unsigned char, sizeof(Key)> encode(Key key) {
+            Unsigned bits = Unsigned(key) ^ SIGN;
+            std::array<unsigned char, sizeof(Key)> encoded;
+            for (size_t i = 0; i < sizeof(Key); i++) encoded[i] = static_cast<unsigned char>(bits >> (8 * (sizeof(Key) - 1 - i)));
+            return encoded;
+        }
+        static Key decode(std::span<const unsigned char> encoded) {
+            if (encoded.size() != sizeof(Key)) throw std::invalid_argument("encoded integer key of the wrong size");
+            Unsigned bits = 0;
+            for (size_t i = 0; i < sizeof(Key); i++) bits = Unsigned(bits << 8 | encoded[i]);
+            return Key(bits ^ SIGN);
+        }
+    };
+
+    // Byte strings are their own encoding, viewed without a copy.
+    template <>
+    struct KeyCodec<std::string> {
+        static std::span<const unsigned char> encode(const std::string& key) { return bytes(key); }
+        static std::string decode(std::span<const unsigned char> encoded) { return parse(encoded); }
+    };
+
+    template <>
+    struct KeyCodec<std::vector<unsigned char>> {
+        static std::span<const unsigned char> encode(const std::vector<unsigned char>& key) { return key; }
+        static std::vector<unsigned char> decode(std::span<const unsigned char> encoded) { return { encoded.begin(), encoded.end() }; }
+    };
+
+    // Byte image of a value. Trivially copyable types are copied as they are in memory, decode throws
+    // std::invalid_argument unless the image is sizeof(T) bytes.
+    template <class T>
+    struct ValueCodec {
+        static_assert(std::is_trivially_copyable_v<T>, "no ValueCodec for this type");
+        static std::vector<unsigned char> encode(const T& value) {
+            std::vector<unsigned char> encoded(sizeof(T));
+            std::memcpy(encoded.data(), &value, sizeof(T));
+            return encoded;
+        }
+        static T decode(const std::vector<unsigned char>& encoded) {
+            if (encoded.size() != sizeof(T)) throw std::invalid_argument("encoded value of the wrong size");
+            T value;
+            std::memcpy(&value, encoded.data(), sizeof(T));
+            return value;
+        }
+    };
+
+    template <>
+    struct ValueCodec<std::string> {
+        static std::vector<unsigned char> encode(const std::string& value) { return data(value); }
+        static std::string decode(const std::vector<unsigned char>& encoded) { return parse(encoded); }
+    };
+
+    template <>
+    struct ValueCodec<std::vector<unsigned char>> {
+        static std::vector<unsigned char> encode(const std::vector<unsigned char>& value) { return value; }
+        static std::vector<unsigned char> decode(const std::vector<unsigned char>& encoded) { return encoded; }
+    };
+
+    // ConcurrentTree keyed and valued by C++ types. Keys are stored through Keys, whose encoding keeps their order,
+    // values through Values. ConcurrentTree itself is the byte keyed form, TypedTree<std::vector<unsigned char>,
+    // std::vector<unsigned char>> behaves the same. Trivially copyable values of up to 8 bytes under the default codec
+    // are kept inline in their nodes, see ConcurrentTree::setInlineValues: put() and get() then neither allocate nor
+    // share a buffer, an update is one atomic store.
+    template <class Key, class T, class Keys = KeyCodec<Key>, class Values = ValueCodec<T>>
+    class TypedTree {
+    public:
+        static constexpr bool INLINE = std::is_same_v<Values, ValueCodec<T>> && std::is_trivially_copyable_v<T> && sizeof(T) <= sizeof(uint64_t);
+
+        // Maps the current value, empty when absent, to the new one, empty to leave the key as it is.
+        using ComputeFn = std::function<std::optional<T>(const std::optional<T>& current)>;
+        // Receives each key and value of a scan in order, returns false to stop early.
+        using ScanVisitor = std::function<bool(const Key& key, const T& value)>;
+
+        TypedTree() { if constexpr (INLINE) tree.setInlineValues(sizeof(T)); }
+        explicit TypedTree(std::unique_ptr<NodeAllocator> allocator) : tree(std::move(allocator)) {
+            if constexpr (INLINE) tree.setInlineValues(sizeof(T));
+        }
+
+        void put(const Key& key, const T& value) {
+            auto encoded = Keys::encode(key);
+            if constexpr (INLINE) {
+                uint64_t word = 0;
+                std::memcpy(&word, &value, sizeof(T));
+                tree.putInline(encoded, word);
+            }
+            else tree.put(encoded, Values::encode(value));
+        }
+        std::optional<T> get(const Key& key) {
+            auto encoded = Keys::encode(key);
+            if constexpr (INLINE) {
+                uint64_t word;
+                if (!tree.getInline(encoded, word)) return std::nullopt;
+                T value;
+                std::memcpy(&value, &word, sizeof(T));
+                return value;
+            }
+            else return decode(tree.find(encoded));
+        }
+        bool contains(const Key& key) {
+            auto encoded = Keys::encode(key);
+            return tree.find(encoded) != nullptr;
+        }
+        bool erase(const Key& key) {
+            auto encoded = Keys::encode(key);
+            return tree.erase(encoded);
+        }
+        bool putIfAbsent(const Key& key, const T& value) {
+            auto encoded = Keys::encode(key);
+            return tree.putIfAbsent(encoded, Values::encode(value));
+        }
+        // Same contract as ConcurrentTree::compute, fn runs under the node's write lock.
+        std::optional<T> compute(const Key& key, const ComputeFn& fn) {
+            auto encoded = Keys::encode(key);
+            return decode(tree.compute(encoded, [&fn](const Value& current) -> Value {
+                std::optional<T> next = fn(decode(current));
+                return next ? std::make_shared<const std::vector<unsigned char>>(Values::encode(*next)) : nullptr;
+            }));
+        }
+        // Visits every key in [lo, hi) in ascending order.
+        void scan(const Key& lo, const Key& hi, const ScanVisitor& visitor) {
+            auto encoded_lo = Keys::encode(lo);
+            auto encoded_hi = Keys::encode(hi);
+            tree.scan(encoded_lo, encoded_hi, [&visitor](std::span<const unsigned char> key, const Value& value) {
+                return visitor(Keys::decode(key), Values::decode(*value));
+            });
+        }
+        TreeStats stats() { return tree.stats(); }
+        // The byte keyed tree underneath, for snapshots, bulk loads and iteration on encoded keys. Its values are inline
+        // when INLINE is.
+        ConcurrentTree& bytes() { return tree; }
+
+    private:
+        ConcurrentTree tree;
+
+        static std::optional<T> decode(const Value& value) {
+            if (!value) return std::nullopt;
+            return Values::decode(*value);
+        }
+    };
+}
@@ -0,0 +1,216 @@
+#include "concurrent.h"
+
+// Snapshot reads. A write reads the clock while its node is locked and stamps the value with it; opening a snapshot
+// takes the clock's current reading as the snapshot's stamp and moves the clock past it. A write stamped at or below
+// a snapshot's stamp was either done before the snapshot opened or still holds its node's lock, which readers wait
+// out, so every snapshot read sees it. Writes stamped above it are hidden, their node's history or, once erased, the
+// graveyard keeps the value the snapshot sees.
+namespace sync {
+    ConcurrentTree::Snapshot ConcurrentTree::openSnapshot() {
+        std::lock_guard<std::mutex> held(history_lock);
+        uint64_t stamp = clock.load(std::memory_order_relaxed);
+        // Published before the clock moves: a writer that reads the moved clock then sees a snapshot it has to keep
+        // the overwritten value for.
+        if (stamp < oldest_snapshot.load(std::memory_order_relaxed)) oldest_snapshot.store(stamp, std::memory_order_seq_cst);
+        clock.store(stamp + 1, std::memory_order_seq_cst);
+        open_snapshots.insert(stamp);
+        return Snapshot(*this, stamp);
+    }
+
+    void ConcurrentTree::close_snapshot(uint64_t stamp) {
+        // Pinned before the list is taken: a node on it was not unlisted yet, so it is retired after this pin.
+        auto guard = epoch.pin();
+        std::unordered_set<Node*> dirty;
+        {
+            std::lock_guard<std::mutex> held(history_lock);
+            open_snapshots.erase(open_snapshots.find(stamp));
+            uint64_t oldest = open_snapshots.empty() ? NO_SNAPSHOT : *open_snapshots.begin();
+            oldest_snapshot.store(oldest, std::memory_order_seq_cst);
+            // An erased key is visible to snapshots older than the erase only.
+            for (auto it = graveyard.begin(); it != graveyard.end();) {
+                if (it->second.erased <= oldest) it = graveyard.erase(it);
+                else ++it;
+            }
+            buried.store(graveyard.size(), std::memory_order_release);
+            dirty.swap(historied);
+        }
+        // Every node that kept versions is cut now instead of at its next write, which may never come. Locked one by
+        // one outside history_lock, writers take that lock while holding their node's.
+        for (Node* node : dirty) {
+            if (!begin_write(node)) continue; // erased, the history goes with the node
+            ValueVersion* history = node->history.load(std::memory_order_relaxed);
+            ValueVersion* kept = history;
+            ValueVersion* cut = cut_history(kept, node->stamp.load(std::memory_order_relaxed), oldest_snapshot.load(std::memory_order_seq_cst));
+            if (kept != history) node->history.store(kept, std::memory_order_release);
+            if (kept) {
+                std::lock_guard<std::mutex> held(history_lock);
+                historied.insert(node);
+            }
+            else node->listed.store(0, std::memory_order_relaxed);
+            // No value a reader sees changed, the version goes back to what optimistic readers validate against.
+            abort_write(node);
+            if (cut) guard.retire(cut, reclaim_history);
+        }
+    }
+
+    ValueVersion* ConcurrentTree::cut_history(ValueVersion*& kept, uint64_t newest, uint64_t oldest) {
+        if (oldest >= newest) return std::exchange(kept, nullptr);
+        ValueVersion* last = kept;
+        while (last && last->stamp > oldest) last = last->older.load(std::memory_order_relaxed);
+        return last ? last->older.exchange(nullptr, std::memory_order_relaxed) : nullptr;
+    }
+
+    void ConcurrentTree::unlist(Node* node) {
+        if (!node->listed.load(std::memory_order_relaxed)) return;
+        std::lock_guard<std::mutex> held(history_lock);
+        historied.erase(node);
+    }
+
+    uint64_t ConcurrentTree::keep_history(Node* node, EpochDomain::Guard& guard) {
+        uint64_t stamp = clock.load(std::memory_order_seq_cst);
+        uint64_t oldest = oldest_snapshot.load(std::memory_order_seq_cst);
+        uint64_t previous = node->stamp.load(std::memory_order_relaxed);
+        ValueVersion* history = node->history.load(std::memory_order_relaxed);
+
+        // The old value matters to snapshots stamped in [previous, stamp), there are none unless oldest < stamp.
+        // Versions behind the first one at or below oldest can't be reached by any snapshot anymore.
+        ValueVersion* kept = history;
+        if (oldest < stamp && previous < stamp) {
+            kept = new ValueVersion{ load_value(node), previous, history };
+        }
+        ValueVersion* cut = cut_history(kept, stamp, oldest);
+        if (kept != history) node->history.store(kept, std::memory_order_release);
+        if (cut) guard.retire(cut, reclaim_history);
+        // Listed so closing snapshots trim it, a node whose next write never comes would keep its versions forever.
+        if (kept && !node->listed.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> held(history_lock);
+            historied.insert(node);
+            node->listed.store(1, std::memory_order_relaxed);
+        }
+        return stamp;
+    }
+
+    void ConcurrentTree::store_value(Node* node, Value value, EpochDomain::Guard& guard) {
+        if (inline_width.load(std::memory_order_relaxed)) {
+            store_word(node, to_word(value), guard);
+            return;
+        }
+        uint64_t stamp = keep_history(node, guard);
+        if (capacity.load(std::memory_order_relaxed)) charge(int64_t(value_bytes(value)) - int64_t(value_bytes(std::atomic_load(&node->value))));
+        std::atomic_store(&node->value, std::move(value));
+        node->stamp.store(stamp, std::memory_order_release);
+    }
+
+    void ConcurrentTree::store_word(Node* node, uint64_t word, EpochDomain::Guard& guard) {
+        uint64_t stamp = keep_history(node, guard);
+        node->word.store(word, std::memory_order_release);
+        node->stamp.store(stamp, std::memory_order_release);
+    }
+
+    void ConcurrentTree::bury(Node* node) {
+        uint64_t erased = clock.load(std::memory_order_seq_cst);
+        if (oldest_snapshot.load(std::memory_order_seq_cst) >= erased) return; // no snapshot predates the erase
+        Tombstone tombstone{ erased, {} };
+        tombstone.versions.emplace_back(node->stamp.load(std::memory_order_relaxed), load_value(node));
+        for (ValueVersion* past = node->history.load(std::memory_order_relaxed); past; past = past->older.load(std::memory_order_relaxed)) {
+            tombstone.versions.emplace_back(past->stamp, past->value);
+        }
+        // In place before the node is unlinked, a reader that misses the node finds it here.
+        std::lock_guard<std::mutex> held(history_lock);
+        auto key = node->key();
+        graveyard.emplace(std::vector<unsigned char>(key.begin(), key.end()), std::move(tombstone));
+        buried.store(graveyard.size(), std::memory_order_release);
+    }
+
+    bool ConcurrentTree::read_at(Node* node, uint64_t stamp, Value& value) {
+        Backoff backoff;
+        while (true) {
+            uint64_t version = node->version.load(std::memory_order_acquire);
+            if (version & OBSOLETE) return false;
+            if (version & 1u) { // a write that may be stamped at or below ours is in progress
+                backoff.pause();
+                continue;
+            }
+            bool found = false;
+            if (node->stamp.load(std::memory_order_acquire) <= stamp) {
+                value = load_value(node);
+                found = true;
+            }
+            else {
+                for (ValueVersion* past = node->history.load(std::memory_order_acquire); past; past = past->older.load(std::memory_order_acquire)) {
+                    if (past->stamp > stamp) continue;
+                    value = past->value;
+                    found = true;
+                    break;
+                }
+            }
+            if (node->version.load(std::memory_order_acquire) == version) return found;
+        }
+    }
+
+    void ConcurrentTree::buried_between(std::span<const unsigned char> from, bool exclusive, const std::span<const unsigned char>* to, uint64_t stamp,
+        std::vector<std::pair<std::vector<unsigned char>, Value>>& out) {
+        if (!buried.load(std::memory_order_acquire)) return;
+        std::lock_guard<std::mutex> held(history_lock);
+        auto it = graveyard.lower_bound(std::vector<unsigned char>(from.begin(), from.end()));
+        for (; it != graveyard.end() && (!to || compare(it->first, *to) < 0); ++it) {
+            if (exclusive && compare(it->first, from) == 0) continue;
+            if (it->second.erased <= stamp) continue; // erased before the snapshot opened
+            for (auto& [written, value] : it->second.versions) {
+                if (written > stamp) continue;
+                out.emplace_back(it->first, value);
+                break;
+            }
+        }
+    }
+
+    Value ConcurrentTree::Snapshot::find(std::span<const unsigned char> key) {
+        std::vector<std::pair<std::vector<unsigned char>, Value>> buried;
+        {
+            Iterator it = tree->lower_bound(key);
+            Value value;
+            if (it.valid() && compare(it.key(), key) == 0 && tree->read_at(it.current, stamp, value)) return value;
+            // Every live version of the key is too new, or it was erased since the snapshot opened.
+            std::vector<unsigned char> next(key.begin(), key.end());
+            next.push_back(0);
+            std::span<const unsigned char> to = next;
+            tree->buried_between(key, false, &to, stamp, buried);
+        }
+        return buried.empty() ? nullptr : buried.front().second;
+    }
+
+    Value ConcurrentTree::Snapshot::find(std::string_view key) {
+        return find(bytes(key));
+    }
+
+    std::vector<unsigned char> ConcurrentTree::Snapshot::get(std::span<const unsigned char> key) {
+        Value value = find(key);
+        return value ? *value : tree->NULL_VALUE;
+    }
+
+    void ConcurrentTree::Snapshot::scan(std::span<const unsigned char> lo, std::span<const unsigned char> hi, const ScanVisitor& visitor) {
+        visit(lo, &hi, visitor);
+    }
+
+    void ConcurrentTree::Snapshot::visit(std::span<const unsigned char> lo, const std::span<const unsigned char>* hi, const ScanVisitor& visitor) {
+        // Live keys come from an iterator, erased ones from the graveyard between two live keys: a key missing from
+        // the tree when the iterator passed its place was unlinked before, so it was buried before too.
+        std::vector<unsigned char> last(lo.begin(), lo.end());
+        bool visited = false; // whether last itself was visited
+        std::vector<std::pair<std::vector<unsigned char>, Value>> buried;
+        for (Iterator it = tree->lower_bound(lo);; it.next()) {
+            bool live = it.valid() && (!hi || compare(it.key(), *hi) < 0);
+            std::span<const unsigned char> upto = live ? it.key() : std::span<const unsigned char>();
+            buried.clear();
+            tree->buried_between(last, visited, live ? &upto : hi, stamp, buried);
+            for (auto& [key, value] : buried) {
+                if (!visitor(key, value)) return;
+            }
+            if (!live) return;
+            last.assign(upto.begin(), upto.end());
+            Value value;
+            visited = tree->read_at(it.current, stamp, value);
+            if (visited && !visitor(last, value)) return;
+        }
+    }
+}
@@ -0,0 +1,265 @@
+#include "wal.h"
+#include "file.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <numeric>
+
+// Log file layout, integers little endian:
+//   header  : magic "CTWAL001"
+//   records : u32 checksum, u8 op, u32 key size, u32 value size, key bytes, value bytes
+// The checksum is the low half of the FNV-1a of everything after it, a record torn by a crash fails it and ends
+// the replay.
+namespace sync {
+    namespace {
+        constexpr unsigned char LOG_MAGIC[8] = { 'C', 'T', 'W', 'A', 'L', '0', '0', '1' };
+        constexpr size_t RECORD_HEADER = 13;
+
+        bool key_less(std::span<const unsigned char> a, std::span<const unsigned char> b) {
+            return std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end());
+        }
+    }
+
+    WriteAheadLog::WriteAheadLog(const std::string& path, SyncPolicy policy, std::chrono::milliseconds interval, const Replay& replay)
+        : path(path), policy(policy), interval(interval) {
+        replay_file(replay);
+        if (!file) return;
+        if (policy == SyncPolicy::Interval) {
+            syncer = std::thread([this] {
+                std::unique_lock<std::mutex> held(lock);
+                while (!stopping) {
+                    wake.wait_for(held, this->interval, [this] { return stopping; });
+                    if (!flushing && !failure && durable < appended) flush(held, true);
+                }
+            });
+        }
+    }
+
+    WriteAheadLog::~WriteAheadLog() {
+        {
+            std::lock_guard<std::mutex> held(lock);
+            stopping = true;
+        }
+        wake.notify_all();
+        if (syncer.joinable()) syncer.join();
+        if (!file) return;
+        std::unique_lock<std::mutex> held(lock);
+        flushed.wait(held, [this] { return !flushing; });
+        if (!failure && durable < appended) flush(held, policy != SyncPolicy::None);
+        std::fclose(file);
+    }
+
+    void WriteAheadLog::replay_file(const Replay& replay) {
+        size_t valid = 0;
+        {
+            MappedFile mapped(path);
+            std::span<const unsigned char> log = mapped.bytes();
+            if (log.size() >= sizeof(LOG_MAGIC)) {
+                // Refuse to append to something that isn't a log.
+                if (std::memcmp(log.data(), LOG_MAGIC, sizeof(LOG_MAGIC)) != 0) return;
+                valid = sizeof(LOG_MAGIC);
+            }
+
+            std::vector<Record> batch;
+            batch.reserve(std::min(REPLAY_BATCH, log.size() / RECORD_HEADER + 1));
+            for (size_t offset = valid; valid && log.size() - offset >= RECORD_HEADER;) {
+                const unsigned char* header = log.data() + offset;
+                uint8_t op = header[4];
+                size_t key_size = load_u32(header + 5), value_size = load_u32(header + 9);
+                if (log.size() - offset - RECORD_HEADER < key_size + value_size) break;
+                Checksum checksum;
+                checksum.add(header + 4, RECORD_HEADER - 4 + key_size + value_size);
+                if (uint32_t(checksum.hash) != load_u32(header) || (op != uint8_t(Op::Put) && op != uint8_t(Op::Erase))) break;
+
+                batch.push_back({ Op(op), log.subspan(offset + RECORD_HEADER, key_size), log.subspan(offset + RECORD_HEADER + key_size, value_size) });
+                offset += RECORD_HEADER + key_size + value_size;
+                valid = offset;
+                if (batch.size() == REPLAY_BATCH) {
+                    if (replay) replay(batch);
+                    batch.clear();
+                }
+            }
+            if (replay && !batch.empty()) replay(batch);
+        }
+
+        // Appends continue right after the last intact record.
+        std::error_code error;
+        if (valid && std::filesystem::exists(path, error) && std::filesystem::file_size(path, error) > valid) {
+            std::filesystem::resize_file(path, valid, error);
+            if (error) return;
+        }
+        file = std::fopen(path.c_str(), valid ? "ab" : "wb");
+        end = valid;
+        if (!file || valid) return;
+        // A fresh log needs its directory entry on disk too, or a crash may lose the whole file.
+        if (std::fwrite(LOG_MAGIC, 1, sizeof(LOG_MAGIC), file) != sizeof(LOG_MAGIC) || !flush_to_disk(file) || !sync_directory(path)) {
+            std::fclose(file);
+            file = nullptr;
+            return;
+        }
+        end = sizeof(LOG_MAGIC);
+    }
+
+    uint64_t WriteAheadLog::append(Op op, std::span<const unsigned char> key, std::span<const unsigned char> value) {
+        std::unique_lock<std::mutex> held(lock);
+        if (failure || !file) return 0;
+        size_t start = pending.size();
+        pending.resize(start + RECORD_HEADER + key.size() + value.size());
+        unsigned char* record = pending.data() + start;
+        record[4] = uint8_t(op);
+        store_u32(record + 5, uint32_t(key.size()));
+        store_u32(record + 9, uint32_t(value.size()));
+        if (!key.empty()) std::memcpy(record + RECORD_HEADER, key.data(), key.size());
+        if (!value.empty()) std::memcpy(record + RECORD_HEADER + key.size(), value.data(), value.size());
+        Checksum checksum;
+        checksum.add(record + 4, RECORD_HEADER - 4 + key.size() + value.size());
+        store_u32(record, uint32_t(checksum.hash));
+
+        uint64_t lsn = ++appended;
+        if (policy == SyncPolicy::None && pending.size() >= BUFFER_LIMIT && !flushing) flush(held, false);
+        return lsn;
+    }
+
+    bool WriteAheadLog::commit(uint64_t lsn) {
+        if (!lsn) return false;
+        std::unique_lock<std::mutex> held(lock);
+        if (policy != SyncPolicy::EveryOp) return true;
+        // Group commit: a waiter with no flush in flight becomes the leader and syncs everything appended so far,
+        // the records of every writer that appended meanwhile included.
+        while (durable < lsn && !failure) {
+            if (flushing) flushed.wait(held);
+            else flush(held, true);
+        }
+        return durable >= lsn && (lsn <= lost_after || lsn > lost_upto);
+    }
+
+    int WriteAheadLog::error() {
+        std::lock_guard<std::mutex> held(lock);
+        return failure;
+    }
+
+    bool WriteAheadLog::recover() {
+        std::unique_lock<std::mutex> held(lock);
+        flushed.wait(held, [this] { return !flushing; });
+        if (!failure) return file != nullptr;
+        // Closed first, whatever stdio still buffers may reach the file and is cut off with the torn write.
+        if (file) std::fclose(file);
+        file = nullptr;
+        std::error_code error;
+        std::filesystem::resize_file(path, end, error);
+        if (error) {
+            failure = error.value();
+            return false;
+        }
+        file = std::fopen(path.c_str(), "ab");
+        if (!file) {
+            failure = errno ? errno : EIO;
+            return false;
+        }
+        failure = 0;
+        if (durable < appended) flush(held, policy != SyncPolicy::None);
+        return !failure;
+    }
+
+    void WriteAheadLog::flush(std::unique_lock<std::mutex>& held, bool sync) {
+        flushing = true;
+        std::vector<unsigned char> batch;
+        batch.swap(pending);
+        uint64_t upto = appended;
+
+        // Appends go on into the fresh buffer while this thread is in the kernel.
+        held.unlock();
+        errno = 0;
+        bool written = file && std::fwrite(batch.data(), 1, batch.size(), file) == batch.size()
+            && (sync ? flush_to_disk(file) : std::fflush(file) == 0);
+        int code = written ? 0 : errno ? errno : EIO;
+        held.lock();
+
+        if (written) {
+            durable = upto;
+            end += batch.size();
+        }
+        else {
+            failure = code;
+            // Under EveryOp no commit of the batch, nor of what was appended meanwhile, returned true, so no tree
+            // applied them. Under the other policies they are applied and kept for recover() to write again.
+            if (policy == SyncPolicy::EveryOp) {
+                pending.clear();
+                lost_after = durable;
+                lost_upto = appended;
+            }
+            else {
+                batch.insert(batch.end(), pending.begin(), pending.end());
+                pending.swap(batch);
+            }
+            batch.clear();
+        }
+        if (pending.empty()) {
+            batch.clear();
+            pending.swap(batch); // keep the capacity
+        }
+        flushing = false;
+        flushed.notify_all();
+    }
+
+    DurableTree::DurableTree(const std::string& log_path, WriteAheadLog::SyncPolicy policy, std::chrono::milliseconds interval)
+        : log(log_path, policy, interval, [this](std::span<const WriteAheadLog::Record> batch) { apply(batch); }) {
+    }
+
+    std::mutex& DurableTree::stripe(std::span<const unsigned char> key) {
+        std::string_view view(reinterpret_cast<const char*>(key.data()), key.size());
+        return stripes[std::hash<std::string_view>{}(view) % STRIPES];
+    }
+
+    bool DurableTree::put(std::span<const unsigned char> key, std::vector<unsigned char> value) {
+        return put(key, std::make_shared<const std::vector<unsigned char>>(std::move(value)));
+    }
+
+    bool DurableTree::put(std::span<const unsigned char> key, Value value) {
+        // The stripe keeps log order and apply order the same for a key, so a replay ends where the tree did.
+        std::lock_guard<std::mutex> held(stripe(key));
+        std::span<const unsigned char> bytes;
+        if (value) bytes = *value;
+        if (!log.commit(log.append(WriteAheadLog::Op::Put, key, bytes))) return false;
+        tree.put(key, std::move(value));
+        return true;
+    }
+
+    bool DurableTree::erase(std::span<const unsigned char> key) {
+        std::lock_guard<std::mutex> held(stripe(key));
+        if (!tree.find(key)) return false;
+        if (!log.commit(log.append(WriteAheadLog::Op::Erase, key))) return false;
+        return tree.erase(key);
+    }
+
+    void DurableTree::apply(std::span<const WriteAheadLog::Record> batch) {
+        // Only the last write of a key in the batch counts, and key order makes neighbouring writes share cache lines.
+        std::vector<size_t> order(batch.size());
+        std::iota(order.begin(), order.end(), size_t(0));
+        std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) { return key_less(batch[a].key, batch[b].key); });
+        std::vector<size_t> latest;
+        latest.reserve(order.size());
+        for (size_t i = 0; i < order.size(); i++) {
+            if (i + 1 < order.size() && !key_less(batch[order[i]].key, batch[order[i + 1]].key)) continue;
+            latest.push_back(order[i]);
+        }
+
+        // The first batch of a fresh tree is usually all puts, build it in one go.
+        bool only_puts = std::all_of(latest.begin(), latest.end(), [&](size_t i) { return batch[i].op == WriteAheadLog::Op::Put; });
+        if (only_puts) {
+            std::vector<ConcurrentTree::Record> records;
+            records.reserve(latest.size());
+            for (size_t i : latest) {
+                records.push_back({ batch[i].key, std::make_shared<const std::vector<unsigned char>>(batch[i].value.begin(), batch[i].value.end()) });
+            }
+            if (tree.bulkLoad(records)) return;
+        }
+        for (size_t i : latest) {
+            const WriteAheadLog::Record& record = batch[i];
+            if (record.op == WriteAheadLog::Op::Put) tree.put(record.key, std::vector<unsigned char>(record.value.begin(), record.value.end()));
+            else tree.erase(record.key);
+        }
+    }
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include "platform.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "concurrent.h"
+
+namespace sync {
+
+    // Append only log of tree writes. Concurrent writers share flushes: the first one to wait for its record
+    // writes and syncs everything appended so far, the others wait for it instead of syncing on their own.
+    //
+    // A write or sync that fails puts the log in a failed state, with the errno it failed with in error(): appends
+    // are refused and commits fail until recover() cuts the file back to its last intact record and reopens it.
+    class WriteAheadLog {
+    public:
+        enum class Op : uint8_t { Put = 1, Erase = 2 };
+
+        enum class SyncPolicy {
+            EveryOp,  // commit() returns once the record is on disk, syncs are shared between waiting writers
+            Interval, // a background thread syncs every interval, a crash loses at most that much
+            None      // written out when the buffer fills or the log closes, never synced
+        };
+
+        // Decoded record, the spans point into the file being replayed and only live for the call.
+        struct Record {
+            Op op;
+            std::span<const unsigned char> key;
+            std::span<const unsigned char> value;
+        };
+        using Replay = std::function<void(std::span<const Record> batch)>;
+
+        static constexpr size_t REPLAY_BATCH = 1 << 16;
+
+        // Replays the records already in path in batches, cuts off a torn tail left by a crash, then opens the log
+        // for appending.
+        WriteAheadLog(const std::string& path, SyncPolicy policy = SyncPolicy::EveryOp,
+            std::chrono::milliseconds interval = std::chrono::milliseconds(10), const Replay& replay = {});
+        ~WriteAheadLog();
+        WriteAheadLog(const WriteAheadLog&) = delete;
+        WriteAheadLog& operator=(const WriteAheadLog&) = delete;
+
+        bool is_open() const { return file != nullptr; }
+        // Buffers the record and returns its log sequence number, 0 if the log is closed or failed.
+        uint64_t append(Op op, std::span<const unsigned char> key, std::span<const unsigned char> value = {});
+        // Waits until the record at lsn is as durable as the policy promises, false if the log can't be written.
+        // Under Interval and None an appended record is never given up, the only failure is append's 0.
+        bool commit(uint64_t lsn);
+        // errno of the write or sync that failed the log, 0 while it is healthy.
+        int error();
+        // Truncates the file to the end of the last flush that succeeded and reopens it. Records whose commit
+        // returned true, those of Interval and None not yet on disk, are written again; the ones whose commit failed
+        // are dropped. True once the log accepts appends again.
+        bool recover();
+
+    private:
+        static constexpr size_t BUFFER_LIMIT = 1 << 20; // pending bytes that force a write under SyncPolicy::None
+
+        const std::string path;
+        const SyncPolicy policy;
+        const std::chrono::milliseconds interval;
+        std::FILE* file = nullptr;
+
+        std::mutex lock;
+        std::condition_variable flushed;
+        std::condition_variable wake; // the interval syncer's timer, cut short on close
+        std::vector<unsigned char> pending;
+        uint64_t appended = 0; // last lsn handed out
+        uint64_t durable = 0;  // last lsn written, and synced unless the policy is None
+        uint64_t end = 0;      // file size once the last successful flush is written
+        bool flushing = false;
+        int failure = 0;       // errno that failed the log, see error()
+        uint64_t lost_after = 0, lost_upto = 0; // lsns in (lost_after, lost_upto] were dropped by the last failure
+        bool stopping = false;
+        std::thread syncer;
+
+        void flush(std::unique_lock<std::mutex>& held, bool sync);
+        void replay_file(const Replay& replay);
+    };
+
+    // ConcurrentTree whose writes go through a WriteAheadLog before they are applied and acknowledged. Opening
+    // it replays the log. Writes to the same key are applied in log order, writes to different keys in parallel.
+    class DurableTree {
+    public:
+        explicit DurableTree(const std::string& log_path, WriteAheadLog::SyncPolicy policy = WriteAheadLog::SyncPolicy::EveryOp,
+            std::chrono::milliseconds interval = std::chrono::milliseconds(10));
+
+        bool is_open() const { return log.is_open(); }
+        // The log's failed state, see WriteAheadLog. Writes fail while it is set.
+        int error() { return log.error(); }
+        bool recover() { return log.recover(); }
+        // False, with the tree untouched, if the write couldn't be logged.
+        bool put(std::span<const unsigned char> key, std::vector<unsigned char> value);
+        bool put(std::span<const unsigned char> key, Value value);
+        // False if the key wasn't there or the erase couldn't be logged.
+        bool erase(std::span<const unsigned char> key);
+        Value find(std::span<const unsigned char> key) { return tree.find(key); }
+        Value find(std::string_view key) { return tree.find(key); }
+        std::vector<unsigned char> get(std::span<const unsigned char> key) { return tree.get(key); }
+        // Reads, scans and snapshots go straight to the tree. The tree itself isn't handed out, a write that
+        // bypassed the log would be lost on the next replay.
+        void scan(std::span<const unsigned char> lo, std::span<const unsigned char> hi, const ConcurrentTree::ScanVisitor& visitor) { tree.scan(lo, hi, visitor); }
+        ConcurrentTree::Iterator begin() { return tree.begin(); }
+        ConcurrentTree::Iterator lower_bound(std::span<const unsigned char> key) { return tree.lower_bound(key); }
+        ConcurrentTree::Snapshot openSnapshot() { return tree.openSnapshot(); }
+        // Dumps the tree to a snapshot file, see ConcurrentTree::snapshot.
+        bool snapshot(const std::string& path) { return tree.snapshot(path); }
+        size_t size() const { return tree.size(); }
+        TreeStats stats() { return tree.stats(); }
+
+    private:
+        static constexpr size_t STRIPES = 256;
+
+        ConcurrentTree tree;
+        std::mutex stripes[STRIPES];
+        WriteAheadLog log;
+
+        std::mutex& stripe(std::span<const unsigned char> key);
+        void apply(std::span<const WriteAheadLog::Record> batch);
+    };
+}
@@ -6,8 +6,13 @@
 #include <string>
 #include <atomic>
 #include <chrono>
+#include <filesystem>
 
+#include "../concurrent_tree/bplus.h"
 #include "../concurrent_tree/concurrent.h"
+#include "../concurrent_tree/sharded.h"
+#include "../concurrent_tree/typed.h"
+#include "../concurrent_tree/wal.h"
 
 using namespace Microsoft::VisualStudio::CppUnitTestFramework;
 
@@ -136,5 +141,1121 @@ namespace ConcurrencyTest
 			}
 		}
 
+		TEST_METHOD(FindReturnsSharedValueOrNull)
+		{
+			sync::ConcurrentTree tree;
+			Assert::IsTrue(tree.find("missing") == nullptr, L"Missing key must return an empty handle");
+			tree.put(bytes("k"), data("v1"));
+			sync::Value first = tree.find("k");
+			Assert::IsTrue(first && *first == data("v1"));
+			Assert::IsTrue(tree.find(data("k")) == first, L"Lookups must share the stored buffer");
+			tree.put(bytes("k"), data("v2"));
+			Assert::IsTrue(*first == data("v1"), L"Held handle must survive an update");
+			Assert::IsTrue(*tree.find("k") == data("v2"));
+		}
+
+		TEST_METHOD(LongAndPrefixSharingKeysKeepOrder)
+		{
+			sync::ConcurrentTree tree;
+			// Keys sharing the 8 byte prefix, embedded zero bytes, and keys spilling past the inline size.
+			std::vector<std::string> keys = { "", "a", std::string("a\0", 2), std::string("a\0\1", 3), "prefix00", "prefix001",
+				"prefix00z", "a_key_that_is_longer_than_inline", "a_key_that_is_longer_than_inline!" };
+			for (const auto& k : keys) tree.put(bytes(k), data(k + "_v"));
+			for (const auto& k : keys) Assert::IsTrue(tree.get(bytes(k)) == data(k + "_v"));
+			Assert::IsTrue(tree.erase(bytes("a_key_that_is_longer_than_inline")));
+			Assert::IsTrue(tree.find("a_key_that_is_longer_than_inline") == nullptr);
+			Assert::IsTrue(tree.get(bytes("a_key_that_is_longer_than_inline!")) == data("a_key_that_is_longer_than_inline!_v"));
+			Assert::IsTrue(tree.find("prefix0") == nullptr);
+		}
+
+		TEST_METHOD(ScanVisitsHalfOpenRangeInOrder)
+		{
+			sync::ConcurrentTree tree;
+			for (int i = 99; i >= 0; --i) {
+				std::string s = (i < 10 ? "0" : "") + std::to_string(i);
+				tree.put(data(s), data(s));
+			}
+			std::vector<std::string> seen;
+			tree.scan(bytes("20"), bytes("30"), [&](std::span<const unsigned char> k, const sync::Value& v) {
+				Assert::IsTrue(parse(k) == parse(*v));
+				seen.push_back(parse(k));
+				return true;
+			});
+			Assert::AreEqual(size_t(10), seen.size());
+			for (int i = 0; i < 10; i++) Assert::IsTrue(seen[i] == std::to_string(20 + i));
+
+			auto it = tree.lower_bound(bytes("955"));
+			Assert::IsTrue(it.valid() && parse(it.key()) == "96");
+			it.next();
+			Assert::IsTrue(it.valid() && parse(it.key()) == "97");
+		}
+
+		TEST_METHOD(IteratorDuringConcurrentPuts_OrderedAndComplete)
+		{
+			sync::ConcurrentTree tree;
+			auto key = [](int i) { std::string s = std::to_string(i); return std::string(6 - s.size(), '0') + s; };
+			for (int i = 0; i < 2000; i += 2) tree.put(bytes(key(i)), data(key(i)));
+
+			std::thread writer([&] {
+				for (int i = 1; i < 2000; i += 2) tree.put(bytes(key(i)), data(key(i)));
+			});
+
+			// Keys present before the scan started must all be seen, in strictly ascending order.
+			for (int round = 0; round < 20; round++) {
+				std::string previous;
+				int even = 0;
+				for (auto it = tree.begin(); it.valid(); it.next()) {
+					std::string k = parse(it.key());
+					Assert::IsTrue(previous.empty() || previous < k, L"Scan must be strictly ascending");
+					previous = k;
+					if (std::stoi(k) % 2 == 0) even++;
+				}
+				Assert::AreEqual(1000, even);
+			}
+			writer.join();
+		}
+
+		TEST_METHOD(ShardedTree_ScansInOrderAcrossShards)
+		{
+			for (auto partitioning : { sync::Partitioning::Hash, sync::Partitioning::Range }) {
+				sync::ShardedConcurrentTree tree(8, partitioning);
+				for (int i = 0; i < 500; i++) {
+					std::string k = std::string(1, char('a' + i % 26)) + std::to_string(i);
+					tree.put(bytes(k), data(k));
+				}
+				Assert::IsTrue(tree.find("c2") != nullptr && parse(*tree.find("c2")) == "c2");
+				Assert::IsTrue(tree.erase(bytes("c2")));
+				Assert::IsTrue(tree.find("c2") == nullptr);
+
+				std::vector<std::string> seen;
+				tree.scan(bytes("b"), bytes("x"), [&](std::span<const unsigned char> k, const sync::Value&) {
+					seen.push_back(parse(k));
+					return true;
+				});
+				Assert::IsTrue(std::is_sorted(seen.begin(), seen.end()), L"Scan must be ordered across shards");
+				Assert::AreEqual(size_t(500 - 20 - 3 * 19 - 1), seen.size()); // a, x, y, z and the erased key drop out
+				Assert::IsTrue(seen.front() >= "b" && seen.back() < "x");
+			}
+		}
+
+		TEST_METHOD(ShardedTree_ConcurrentWritersLandInTheirShards)
+		{
+			sync::ShardedConcurrentTree tree({ data("k1"), data("k2"), data("k3") });
+			Assert::AreEqual(size_t(4), tree.shard_count());
+
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 4; t++) {
+				threads.emplace_back([&, t] {
+					for (int i = 0; i < 1000; i++) {
+						std::string k = "k" + std::to_string(t) + "_" + std::to_string(i);
+						tree.put(bytes(k), data(k));
+					}
+				});
+			}
+			for (auto& th : threads) th.join();
+
+			auto stats = tree.stats();
+			for (int t = 0; t < 4; t++) {
+				Assert::AreEqual(uint64_t(1000), stats[t].writes);
+				Assert::AreEqual(size_t(t), tree.shard_of(bytes("k" + std::to_string(t) + "_0")));
+			}
+			for (int t = 0; t < 4; t++) {
+				for (int i = 0; i < 1000; i++) {
+					std::string k = "k" + std::to_string(t) + "_" + std::to_string(i);
+					Assert::IsTrue(tree.get(bytes(k)) == data(k));
+				}
+			}
+		}
+
+		TEST_METHOD(TraversalRetriesAreCountedOnlyUnderContention)
+		{
+			sync::ConcurrentTree tree;
+			for (int i = 0; i < 1000; i++) tree.put(bytes(std::to_string(i)), data(std::to_string(i)));
+			for (int i = 0; i < 1000; i++) Assert::IsTrue(tree.find(std::to_string(i)) != nullptr);
+			Assert::AreEqual(uint64_t(0), tree.stats().restarts, L"A lone thread never fails validation");
+
+			std::atomic<bool> done{ false };
+			std::thread reader([&] {
+				while (!done.load()) {
+					for (int i = 0; i < 1000; i++) Assert::IsTrue(tree.find(std::to_string(i)) != nullptr, L"Resumed reads must still find stable keys");
+				}
+			});
+			for (int i = 1000; i < 20000; i++) tree.put(bytes(std::to_string(i)), data(std::to_string(i)));
+			done = true;
+			reader.join();
+
+			auto stats = tree.stats();
+			Assert::IsTrue(stats.restarts > 0 || stats.rewalked_levels == 0, L"Levels are only re-walked by a retry");
+			for (int i = 0; i < 20000; i++) Assert::IsTrue(tree.get(bytes(std::to_string(i))) == data(std::to_string(i)));
+		}
+
+		TEST_METHOD(ContendedRotationsReleaseEveryLock)
+		{
+			// Ascending keys from every thread all land on the right spine, so rotations and recolors lock
+			// overlapping sets in ever changing address orders, and lose them to each other. A lock left held, or an
+			// abort_write that rolled back a version it didn't take, would leave the writes below spinning forever.
+			sync::ConcurrentTree tree;
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 4; t++) {
+				threads.emplace_back([&, t] {
+					for (int i = 0; i < 5000; i++) {
+						std::string k = std::to_string(100000 + i * 4 + t);
+						tree.put(bytes(k), data(k));
+						if (i % 3 == 1) tree.erase(bytes(k));
+					}
+				});
+			}
+			for (auto& th : threads) th.join();
+
+			// A lone thread writes every surviving key again and erases half of them, every lock must have been freed.
+			size_t keys = 0;
+			for (int i = 0; i < 20000; i++) {
+				std::string k = std::to_string(100000 + i);
+				bool present = (i / 4) % 3 != 1;
+				Assert::AreEqual(present, tree.find(k) != nullptr);
+				if (!present) continue;
+				tree.put(bytes(k), data("again"));
+				keys++;
+			}
+			Assert::AreEqual(keys, tree.size());
+			for (auto it = tree.begin(); it.valid(); it.next()) Assert::IsTrue(*it.value() == data("again"));
+			for (int i = 0; i < 20000; i += 2) tree.erase(bytes(std::to_string(100000 + i)));
+			Assert::AreEqual(keys / 2, tree.size());
+#if SYNC_TREE_STATS
+			Assert::IsTrue(tree.stats().rotations > 0);
+#endif
+		}
+
+		TEST_METHOD(ConcurrentPutsKeepRedBlackInvariants)
+		{
+			// Random keys repair all over the tree, interleaved ascending ones all on the right spine. Either way,
+			// once the writers are done no RED node may sit under a RED one and every path must hold as many BLACK.
+			for (int round = 0; round < 20; round++) {
+				sync::ConcurrentTree tree;
+				std::vector<std::thread> threads;
+				for (int t = 0; t < 4; t++) {
+					threads.emplace_back([&, t] {
+						uint32_t seed = round * 4 + t + 1;
+						for (int i = 0; i < 3000; i++) {
+							seed = seed * 1103515245 + 12345;
+							std::string k = round % 2 ? std::to_string(seed >> 8) : std::to_string(1000000 + i * 4 + t);
+							tree.put(bytes(k), data(k));
+						}
+					});
+				}
+				for (auto& th : threads) th.join();
+				Assert::IsTrue(tree.validate());
+			}
+		}
+
+		TEST_METHOD(StatsCountOperationsSizeAndHeight)
+		{
+			sync::ConcurrentTree tree;
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 4; t++) {
+				threads.emplace_back([&, t] {
+					for (int i = 0; i < 1000; i++) {
+						std::string k = std::to_string(t) + "_" + std::to_string(i);
+						tree.put(bytes(k), data(k));
+						tree.find(k);
+					}
+				});
+			}
+			for (auto& th : threads) th.join();
+			for (int i = 0; i < 500; i++) tree.erase(bytes("0_" + std::to_string(i)));
+			tree.erase(bytes("missing"));
+			tree.put(bytes("1_1"), data("updated"));
+
+			auto stats = tree.stats();
+#if SYNC_TREE_STATS
+			Assert::AreEqual(uint64_t(4001), stats.puts);
+			Assert::AreEqual(uint64_t(4000), stats.inserts);
+			Assert::AreEqual(uint64_t(4000), stats.finds);
+			Assert::AreEqual(uint64_t(501), stats.erases);
+			Assert::AreEqual(uint64_t(500), stats.removals);
+			Assert::AreEqual(uint64_t(3500), stats.size);
+			Assert::IsTrue(stats.rotations > 0 && stats.recolors > 0);
+			Assert::IsTrue(stats.height >= 12, L"4000 keys need at least 12 levels");
+			uint64_t waits = 0;
+			for (uint64_t bucket : stats.lock_wait_ns) waits += bucket;
+			Assert::AreEqual(stats.lock_waits, waits);
+#else
+			Assert::AreEqual(uint64_t(0), stats.puts);
+#endif
+		}
+
+		TEST_METHOD(BulkLoadBuildsBalancedTree)
+		{
+			const int n = 100000;
+			std::vector<std::string> keys;
+			for (int i = 0; i < n; i++) {
+				std::string s = std::to_string(i);
+				keys.push_back(std::string(8 - s.size(), '0') + s);
+			}
+			std::vector<sync::ConcurrentTree::Record> records;
+			for (auto& k : keys) records.push_back({ bytes(k), std::make_shared<const std::vector<unsigned char>>(data(k)) });
+
+			sync::ConcurrentTree tree;
+			Assert::IsTrue(tree.bulkLoad(records, sync::ConcurrentTree::BulkMode::Build, 4));
+			Assert::IsFalse(tree.bulkLoad(records), L"Build mode only loads an empty tree");
+
+			int i = 0;
+			for (auto it = tree.begin(); it.valid(); it.next(), i++) Assert::IsTrue(parse(it.key()) == keys[i]);
+			Assert::AreEqual(n, i);
+#if SYNC_TREE_STATS
+			auto stats = tree.stats();
+			Assert::AreEqual(uint64_t(n), stats.size);
+			Assert::AreEqual(uint64_t(17), stats.height, L"100000 keys fit in 17 levels");
+#endif
+			// The loaded tree keeps working as a red-black tree.
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 4; t++) {
+				threads.emplace_back([&, t] {
+					for (int j = t; j < 2000; j += 4) {
+						std::string k = "x" + std::to_string(j);
+						tree.put(bytes(k), data(k));
+						tree.erase(bytes(keys[j * 7]));
+					}
+				});
+			}
+			for (auto& th : threads) th.join();
+			for (int j = 0; j < 2000; j++) {
+				Assert::IsTrue(tree.find("x" + std::to_string(j)) != nullptr);
+				Assert::IsTrue(tree.find(keys[j * 7]) == nullptr);
+			}
+		}
+
+		TEST_METHOD(BulkLoadMergeKeepsExistingKeys)
+		{
+			sync::ConcurrentTree tree;
+			for (int i = 0; i < 1000; i += 2) tree.put(bytes(std::to_string(i)), data("old"));
+
+			std::vector<std::string> keys;
+			for (int i = 0; i < 1000; i += 3) keys.push_back(std::to_string(i));
+			std::sort(keys.begin(), keys.end());
+			std::vector<sync::ConcurrentTree::Record> records;
+			for (auto& k : keys) records.push_back({ bytes(k), std::make_shared<const std::vector<unsigned char>>(data("new")) });
+
+			// Unsorted or duplicate keys are refused before the tree is touched, in every build.
+			std::vector<sync::ConcurrentTree::Record> unsorted(records.rbegin(), records.rend());
+			std::vector<sync::ConcurrentTree::Record> duplicated = records;
+			duplicated.insert(duplicated.begin() + 1, records[1]);
+			Assert::IsFalse(tree.bulkLoad(unsorted, sync::ConcurrentTree::BulkMode::Merge));
+			Assert::IsFalse(tree.bulkLoad(duplicated, sync::ConcurrentTree::BulkMode::Merge));
+			Assert::AreEqual(size_t(500), tree.size());
+			Assert::IsTrue(tree.find("0") && parse(*tree.find("0")) == "old");
+
+			std::atomic<bool> done{ false };
+			std::thread reader([&] {
+				while (!done.load()) Assert::IsTrue(tree.find("998") != nullptr, L"Readers never lose an untouched key");
+			});
+			Assert::IsTrue(tree.bulkLoad(records, sync::ConcurrentTree::BulkMode::Merge));
+			done = true;
+			reader.join();
+
+			for (int i = 0; i < 1000; i++) {
+				auto v = tree.find(std::to_string(i));
+				if (i % 3 == 0) Assert::IsTrue(v && parse(*v) == "new");
+				else if (i % 2 == 0) Assert::IsTrue(v && parse(*v) == "old");
+				else Assert::IsTrue(v == nullptr);
+			}
+		}
+
+		TEST_METHOD(SnapshotRestoreRoundTrip)
+		{
+			std::string path = (std::filesystem::temp_directory_path() / "concurrent_tree_snapshot.bin").string();
+			sync::ConcurrentTree tree;
+			for (int i = 0; i < 5000; i++) {
+				std::string k = "key" + std::to_string(i) + std::string(i % 40, 'k');
+				tree.put(bytes(k), data("value" + std::to_string(i)));
+			}
+
+			// Writers keep going during the dump, the stable keys must all be in it.
+			std::atomic<bool> done{ false };
+			std::thread writer([&] {
+				for (int i = 0; !done.load(); i++) tree.put(bytes("w" + std::to_string(i % 1000)), data("w"));
+			});
+			Assert::IsTrue(tree.snapshot(path));
+			done = true;
+			writer.join();
+
+			sync::ConcurrentTree restored;
+			Assert::IsTrue(restored.restore(path));
+			for (int i = 0; i < 5000; i++) {
+				std::string k = "key" + std::to_string(i) + std::string(i % 40, 'k');
+				auto v = restored.find(k);
+				Assert::IsTrue(v && parse(*v) == "value" + std::to_string(i));
+			}
+
+			// A truncated file is rejected and leaves the tree alone.
+			std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+			sync::ConcurrentTree empty;
+			Assert::IsFalse(empty.restore(path));
+			Assert::IsFalse(empty.begin().valid());
+			Assert::IsFalse(empty.restore(path + ".missing"));
+			std::filesystem::remove(path);
+		}
+
+		TEST_METHOD(WriteAheadLogReplaysAfterRestart)
+		{
+			std::string path = (std::filesystem::temp_directory_path() / "concurrent_tree_wal.log").string();
+			std::filesystem::remove(path);
+			{
+				sync::DurableTree tree(path);
+				Assert::IsTrue(tree.is_open());
+				std::vector<std::thread> threads;
+				for (int t = 0; t < 4; t++) {
+					threads.emplace_back([&, t] {
+						for (int i = 0; i < 200; i++) {
+							std::string k = std::to_string(t) + "_" + std::to_string(i);
+							Assert::IsTrue(tree.put(bytes(k), data("v1")));
+							Assert::IsTrue(tree.put(bytes(k), data("v2")));
+						}
+					});
+				}
+				for (auto& th : threads) th.join();
+				for (int i = 0; i < 200; i += 2) Assert::IsTrue(tree.erase(bytes("0_" + std::to_string(i))));
+				Assert::IsFalse(tree.erase(bytes("missing")));
+				Assert::AreEqual(0, tree.error());
+				Assert::IsTrue(tree.recover(), L"A healthy log has nothing to recover");
+			}
+
+			// A crash in the middle of an append leaves a torn record behind, replay stops before it.
+			{
+				std::FILE* file = std::fopen(path.c_str(), "ab");
+				std::fwrite("\x01\x02\x03torn", 1, 7, file);
+				std::fclose(file);
+			}
+			{
+				sync::DurableTree tree(path, sync::WriteAheadLog::SyncPolicy::Interval, std::chrono::milliseconds(1));
+				for (int t = 0; t < 4; t++) {
+					for (int i = 0; i < 200; i++) {
+						auto v = tree.find(std::to_string(t) + "_" + std::to_string(i));
+						if (t == 0 && i % 2 == 0) Assert::IsTrue(v == nullptr);
+						else Assert::IsTrue(v && parse(*v) == "v2");
+					}
+				}
+				size_t scanned = 0;
+				tree.scan(bytes(""), bytes("z"), [&](std::span<const unsigned char>, const sync::Value&) { return ++scanned > 0; });
+				Assert::AreEqual(size_t(700), scanned);
+				Assert::AreEqual(size_t(700), tree.size());
+				Assert::IsTrue(tree.put(bytes("after"), data("torn tail")));
+			}
+			{
+				sync::DurableTree tree(path, sync::WriteAheadLog::SyncPolicy::None);
+				auto v = tree.find("after");
+				Assert::IsTrue(v && parse(*v) == "torn tail", L"Appends continue after the last intact record");
+				Assert::IsTrue(tree.find("1_199") != nullptr);
+			}
+			std::filesystem::remove(path);
+		}
+
+		TEST_METHOD(ComputeIncrementsWithoutLostUpdates)
+		{
+			sync::ConcurrentTree tree;
+			auto increment = [](const sync::Value& current) {
+				int count = current ? std::stoi(parse(*current)) : 0;
+				return std::make_shared<const std::vector<unsigned char>>(data(std::to_string(count + 1)));
+			};
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 4; t++) {
+				threads.emplace_back([&] {
+					for (int i = 0; i < 1000; i++) {
+						tree.compute(bytes("counter" + std::to_string(i % 10)), increment);
+					}
+				});
+			}
+			for (auto& th : threads) th.join();
+			for (int i = 0; i < 10; i++) Assert::IsTrue(parse(*tree.find("counter" + std::to_string(i))) == "400");
+
+			auto unchanged = tree.compute(bytes("counter0"), [](const sync::Value&) { return sync::Value(); });
+			Assert::IsTrue(parse(*unchanged) == "400", L"nullptr from fn keeps the current value");
+			Assert::IsTrue(tree.compute(bytes("absent"), [](const sync::Value&) { return sync::Value(); }) == nullptr);
+			Assert::IsTrue(tree.find("absent") == nullptr);
+		}
+
+		TEST_METHOD(PutIfAbsentAndCompareAndSet)
+		{
+			sync::ConcurrentTree tree;
+			std::atomic<int> winners{ 0 };
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 4; t++) {
+				threads.emplace_back([&, t] {
+					if (tree.putIfAbsent(bytes("session"), data("owner" + std::to_string(t)))) winners++;
+				});
+			}
+			for (auto& th : threads) th.join();
+			Assert::AreEqual(1, winners.load(), L"Exactly one putIfAbsent inserts");
+
+			auto owner = tree.find("session");
+			auto stale = std::make_shared<const std::vector<unsigned char>>(data("nobody"));
+			auto next = std::make_shared<const std::vector<unsigned char>>(data("next"));
+			Assert::IsFalse(tree.compareAndSet(bytes("session"), stale, next));
+			// Equal contents match, not just the same handle.
+			auto copy = std::make_shared<const std::vector<unsigned char>>(*owner);
+			Assert::IsTrue(tree.compareAndSet(bytes("session"), copy, next));
+			Assert::IsTrue(tree.find("session") == next);
+			Assert::IsTrue(tree.compareAndSet(bytes("fresh"), nullptr, next), L"nullptr expects the key to be absent");
+			Assert::IsFalse(tree.compareAndSet(bytes("fresh"), nullptr, stale));
+		}
+
+		TEST_METHOD(MultiGetAndMultiPutMatchSingleKeyCalls)
+		{
+			sync::ConcurrentTree tree;
+			for (int i = 0; i < 200; i += 2) tree.put(data(std::to_string(i)), data("old"));
+
+			// Unsorted, with a duplicate whose last record has to win, half the keys new and half updates.
+			std::vector<std::string> keys;
+			for (int i = 199; i >= 0; i--) keys.push_back(std::to_string(i));
+			keys.push_back("7");
+			std::vector<sync::ConcurrentTree::Record> records;
+			for (size_t i = 0; i < keys.size(); i++) {
+				auto value = std::make_shared<const std::vector<unsigned char>>(data(i + 1 == keys.size() ? "last" : keys[i]));
+				records.push_back({ bytes(keys[i]), value });
+			}
+			tree.multiPut(records);
+
+			std::vector<std::string> lookups = { "7", "missing", "0", "199", "7", "" };
+			std::vector<std::span<const unsigned char>> spans;
+			for (auto& key : lookups) spans.push_back(bytes(key));
+			auto values = tree.multiGet(spans);
+			Assert::AreEqual(lookups.size(), values.size());
+			Assert::IsTrue(values[0] && *values[0] == data("last"), L"Last record for a key wins");
+			Assert::IsTrue(values[1] == nullptr && values[5] == nullptr);
+			Assert::IsTrue(*values[2] == data("0") && *values[3] == data("199"));
+			Assert::IsTrue(values[4] == values[0], L"Repeated keys get the same handle");
+			Assert::AreEqual(uint64_t(200), tree.stats().size);
+
+			// Batches racing with single key writers on the same keys, every value is the key itself.
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 4; t++) {
+				threads.emplace_back([&, t] {
+					std::vector<std::string> batch;
+					for (int i = t; i < 2000; i += 3) batch.push_back("k" + std::to_string(i));
+					std::vector<sync::ConcurrentTree::Record> puts;
+					std::vector<std::span<const unsigned char>> gets;
+					for (auto& key : batch) {
+						puts.push_back({ bytes(key), std::make_shared<const std::vector<unsigned char>>(data(key)) });
+						gets.push_back(bytes(key));
+					}
+					for (size_t i = 0; i < puts.size(); i += 64) {
+						size_t n = std::min<size_t>(64, puts.size() - i);
+						if (t == 3) for (size_t j = i; j < i + n; j++) tree.put(puts[j].key, puts[j].value);
+						else tree.multiPut(std::span(puts).subspan(i, n));
+					}
+					auto found = tree.multiGet(gets);
+					for (size_t i = 0; i < batch.size(); i++) Assert::IsTrue(found[i] && *found[i] == data(batch[i]));
+				});
+			}
+			for (auto& th : threads) th.join();
+			for (int i = 0; i < 2000; i++) {
+				auto key = "k" + std::to_string(i);
+				Assert::IsTrue(tree.get(data(key)) == data(key));
+			}
+		}
+
+		TEST_METHOD(TypedTreeKeepsIntegerOrder)
+		{
+			sync::TypedTree<int64_t, uint64_t> tree;
+			for (int64_t key : { 5ll, -3ll, 0ll, 1ll << 40, -(1ll << 40), -1ll }) tree.put(key, uint64_t(key) * uint64_t(key));
+			Assert::IsTrue(tree.get(-3) == std::optional<uint64_t>(9));
+			Assert::IsFalse(tree.get(4).has_value());
+
+			// Encoded keys sort like the integers, negatives before zero.
+			std::vector<int64_t> order;
+			tree.scan(-(1ll << 50), 1ll << 50, [&](const int64_t& key, const uint64_t&) { order.push_back(key); return true; });
+			Assert::IsTrue(order == std::vector<int64_t>{ -(1ll << 40), -3, -1, 0, 5, 1ll << 40 });
+
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 4; t++) {
+				threads.emplace_back([&] {
+					for (int i = 0; i < 1000; i++) tree.compute(7, [](const std::optional<uint64_t>& count) { return std::optional<uint64_t>(count.value_or(0) + 1); });
+				});
+			}
+			for (auto& th : threads) th.join();
+			Assert::IsTrue(tree.get(7) == std::optional<uint64_t>(4000));
+			Assert::IsTrue(tree.erase(7) && !tree.contains(7));
+
+			sync::TypedTree<std::string, std::string> strings;
+			strings.put("b", "2");
+			Assert::IsFalse(strings.putIfAbsent("b", "3"));
+			Assert::IsTrue(strings.get("b") == std::optional<std::string>("2"));
+		}
+
+		TEST_METHOD(TypedTreeKeepsSmallValuesInline)
+		{
+			sync::TypedTree<uint64_t, double> tree;
+			Assert::IsTrue(tree.INLINE);
+			Assert::IsFalse(sync::TypedTree<uint64_t, std::string>::INLINE);
+
+			// Updates store in place while readers load, every value read is one some writer stored.
+			std::atomic<bool> run{ true };
+			std::thread reader([&] {
+				while (run) {
+					std::optional<double> value = tree.get(3);
+					Assert::IsTrue(!value || (*value >= 0 && *value < 4000 && *value == double(int(*value))));
+				}
+			});
+			std::vector<std::thread> writers;
+			for (int t = 0; t < 4; t++) {
+				writers.emplace_back([&, t] {
+					for (int i = 0; i < 1000; i++) tree.put(uint64_t(i % 16), double(t * 1000 + i));
+				});
+			}
+			for (auto& th : writers) th.join();
+			run = false;
+			reader.join();
+			Assert::AreEqual(uint64_t(16), tree.stats().size);
+
+			// The byte API and snapshots see the same values, as sizeof(double) byte buffers.
+			tree.put(1, 0.5);
+			auto snapshot = tree.bytes().openSnapshot();
+			tree.put(1, 1.5);
+			auto encoded = sync::KeyCodec<uint64_t>::encode(1);
+			Assert::IsTrue(sync::ValueCodec<double>::decode(*snapshot.find(encoded)) == 0.5);
+			Assert::IsTrue(sync::ValueCodec<double>::decode(*tree.bytes().find(encoded)) == 1.5);
+			Assert::IsTrue(tree.compute(1, [](const std::optional<double>& value) { return std::optional<double>(*value * 2); }) == std::optional<double>(3.0));
+			Assert::IsTrue(tree.get(1) == std::optional<double>(3.0));
+			Assert::IsFalse(tree.bytes().setInlineValues(4), L"Only an empty tree switches");
+			Assert::IsTrue(tree.erase(1) && !tree.get(1));
+		}
+
+		TEST_METHOD(TypedCodecsRejectImagesOfTheWrongSize)
+		{
+			auto rejects = [](auto&& decode) {
+				try { decode(); }
+				catch (const std::invalid_argument&) { return true; }
+				return false;
+			};
+			Assert::IsTrue(sync::KeyCodec<int32_t>::decode(sync::KeyCodec<int32_t>::encode(-7)) == -7);
+			Assert::IsTrue(rejects([] { sync::KeyCodec<int32_t>::decode(bytes("abc")); }));
+			Assert::IsTrue(rejects([] { sync::KeyCodec<uint64_t>::decode(bytes("a_longer_key")); }));
+			Assert::IsTrue(rejects([] { sync::ValueCodec<uint64_t>::decode(data("1234")); }));
+
+			// A key put through the byte tree in another shape surfaces when a typed scan reaches it.
+			sync::TypedTree<uint16_t, std::string> tree;
+			tree.put(1, "one");
+			tree.bytes().put(bytes("xyz"), data("bad"));
+			Assert::IsTrue(rejects([&] { tree.scan(0, 0xFFFF, [](const uint16_t&, const std::string&) { return true; }); }));
+		}
+
+		TEST_METHOD(SnapshotReadsAreRepeatableWhileWritersRun)
+		{
+			sync::ConcurrentTree tree;
+			for (auto key : { "a", "b", "c" }) tree.put(bytes(key), data("1"));
+			{
+				auto snapshot = tree.openSnapshot();
+				tree.put(bytes("a"), data("2"));
+				tree.erase(bytes("b"));
+				tree.erase(bytes("c"));
+				tree.put(bytes("c"), data("2"));
+				tree.put(bytes("d"), data("2"));
+				for (auto key : { "a", "b", "c" }) Assert::IsTrue(snapshot.get(bytes(key)) == data("1"));
+				Assert::IsTrue(snapshot.find("d") == nullptr, L"Inserted after the snapshot opened");
+				Assert::IsTrue(tree.find("b") == nullptr && tree.get(bytes("c")) == data("2"));
+
+				std::string seen;
+				snapshot.scan(bytes(""), bytes("z"), [&](std::span<const unsigned char> key, const sync::Value& value) {
+					seen += parse(key) + parse(*value);
+					return true;
+				});
+				Assert::AreEqual(std::string("a1b1c1"), seen);
+			}
+
+			// Two scans of one snapshot agree, however the writers overwrite, erase and reinsert meanwhile.
+			std::atomic<bool> stop{ false };
+			std::vector<std::thread> writers;
+			for (int t = 0; t < 3; t++) {
+				writers.emplace_back([&, t] {
+					for (int round = 0; !stop.load(); round++) {
+						auto key = "k" + std::to_string((round * 7 + t) % 300);
+						if (round % 3 == 0) tree.erase(bytes(key));
+						else tree.put(bytes(key), data(std::to_string(round)));
+					}
+				});
+			}
+			auto dump = [](sync::ConcurrentTree::Snapshot& snapshot) {
+				std::vector<std::pair<std::string, std::string>> contents;
+				snapshot.scan(bytes(""), bytes("z"), [&](std::span<const unsigned char> key, const sync::Value& value) {
+					contents.emplace_back(parse(key), parse(*value));
+					return true;
+				});
+				return contents;
+			};
+			for (int i = 0; i < 20; i++) {
+				auto snapshot = tree.openSnapshot();
+				auto first = dump(snapshot);
+				std::this_thread::sleep_for(std::chrono::milliseconds(2));
+				Assert::IsTrue(first == dump(snapshot));
+				for (auto& [key, value] : first) Assert::IsTrue(snapshot.get(bytes(key)) == data(value));
+			}
+			stop = true;
+			for (auto& th : writers) th.join();
+		}
+
+		TEST_METHOD(ClosingSnapshotReleasesVersionsOfIdleKeys)
+		{
+			sync::ConcurrentTree tree;
+			auto first = std::make_shared<const std::vector<unsigned char>>(data("1"));
+			std::weak_ptr<const std::vector<unsigned char>> kept = first;
+			tree.put(bytes("idle"), std::move(first));
+			{
+				auto snapshot = tree.openSnapshot();
+				tree.put(bytes("idle"), data("2"));
+				Assert::IsTrue(snapshot.get(bytes("idle")) == data("1"));
+			}
+			// "idle" is never written again, only the close can cut its history. Churn lets the epoch free the cut.
+			for (int i = 0; i < 1000; i++) {
+				tree.put(bytes("churn"), data("x"));
+				tree.erase(bytes("churn"));
+			}
+			Assert::IsTrue(kept.expired(), L"No snapshot can read the old version anymore");
+			Assert::IsTrue(tree.get(bytes("idle")) == data("2"));
+		}
+
+		TEST_METHOD(EpochFreesShortListsOfSlotsNobodyPins)
+		{
+			sync::EpochDomain domain;
+			std::atomic<int> freed{ 0 };
+			std::thread([&] {
+				domain.pin().retire(&freed, [](void* counter, void*) { static_cast<std::atomic<int>*>(counter)->fetch_add(1); });
+			}).join();
+			// Far below RETIRE_THRESHOLD, in the slot of a thread that is gone. Other threads' pins free it.
+			for (int i = 0; i < 100 && !freed.load(); i++) domain.pin();
+			Assert::AreEqual(1, freed.load());
+		}
+
+		TEST_METHOD(HashIndexAnswersPointLookupsAndForgetsErasedKeys)
+		{
+			sync::ConcurrentTree tree(std::make_unique<sync::HashIndex>(1024));
+			for (int i = 0; i < 500; i++) tree.put(data("key" + std::to_string(i)), data(std::to_string(i)));
+			for (int i = 0; i < 500; i += 2) Assert::IsTrue(tree.erase(data("key" + std::to_string(i))));
+			for (int i = 0; i < 500; i++) {
+				auto value = tree.find("key" + std::to_string(i));
+				if (i % 2) Assert::IsTrue(value && *value == data(std::to_string(i)));
+				else Assert::IsTrue(value == nullptr);
+			}
+			Assert::IsTrue(tree.stats().index_hits >= 200, L"Present keys are answered by the index");
+
+			// Readers racing erase and reinsert of the same keys only ever see a key's own value.
+			std::atomic<bool> stop{ false };
+			std::thread writer([&] {
+				for (int round = 0; !stop.load(); round++) {
+					auto key = "key" + std::to_string(round % 500);
+					if (round % 2) tree.erase(data(key));
+					else tree.put(data(key), data(key));
+				}
+			});
+			std::vector<std::thread> readers;
+			for (int t = 0; t < 3; t++) {
+				readers.emplace_back([&] {
+					for (int i = 0; i < 20000; i++) {
+						auto key = "key" + std::to_string(i % 500);
+						auto value = tree.find(key);
+						Assert::IsTrue(!value || *value == data(key) || *value == data(std::to_string(i % 500)));
+					}
+				});
+			}
+			for (auto& th : readers) th.join();
+			stop = true;
+			writer.join();
+		}
+
+		TEST_METHOD(RelaxedBalanceDefersRepairsToTheMaintainer)
+		{
+			sync::ConcurrentTree tree;
+			tree.setBalance(sync::ConcurrentTree::Balance::Relaxed);
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 4; t++) {
+				threads.emplace_back([&, t] {
+					for (int i = 0; i < 3000; i++) {
+						auto key = std::to_string(t) + "_" + std::to_string(i);
+						tree.put(data(key), data(key));
+						if (i % 10 == 0) tree.erase(data(key));
+					}
+				});
+			}
+			for (auto& th : threads) th.join();
+			tree.setBalance(sync::ConcurrentTree::Balance::Strict);
+			Assert::AreEqual(size_t(0), tree.rebalance(), L"Switching back repairs everything still queued");
+
+			auto stats = tree.stats();
+			Assert::IsTrue(stats.deferred_repairs > 0);
+			Assert::AreEqual(uint64_t(4 * 2700), stats.size);
+			for (int t = 0; t < 4; t++) {
+				for (int i = 0; i < 3000; i++) {
+					auto key = std::to_string(t) + "_" + std::to_string(i);
+					Assert::IsTrue(tree.get(data(key)) == (i % 10 == 0 ? tree.NULL_VALUE : data(key)));
+				}
+			}
+		}
+
+		TEST_METHOD(RelaxedBalanceConvergesOnceDrained)
+		{
+			// A long interval keeps RED-RED links waiting while erases rotate and recolor around them, the drain at the
+			// end must still leave a valid red-black tree.
+			for (int round = 0; round < 10; round++) {
+				sync::ConcurrentTree tree;
+				tree.setBalance(sync::ConcurrentTree::Balance::Relaxed, std::chrono::milliseconds(round % 2 ? 1 : 1000));
+				std::vector<std::thread> threads;
+				for (int t = 0; t < 4; t++) {
+					threads.emplace_back([&, t] {
+						uint32_t seed = 7919u * (t + 1) + round * 104729u;
+						for (int i = 0; i < 3000; i++) {
+							seed = seed * 1103515245u + 12345u;
+							std::string k = std::to_string(t) + "_" + std::to_string(i);
+							tree.put(data(k), data(k));
+							if (seed & 0x10000) tree.erase(data(std::to_string(t) + "_" + std::to_string((seed >> 4) % (i + 1))));
+						}
+					});
+				}
+				for (auto& th : threads) th.join();
+				tree.setBalance(sync::ConcurrentTree::Balance::Strict);
+				Assert::AreEqual(size_t(0), tree.rebalance());
+				Assert::IsTrue(tree.validate());
+			}
+		}
+
+		TEST_METHOD(CombiningAppliesEveryPublishedPut)
+		{
+			sync::ConcurrentTree tree;
+			tree.setCombining(true);
+			// Monotonic keys, every writer appends at the right edge of the tree.
+			auto key_of = [](int i) {
+				std::string digits = std::to_string(i);
+				return std::string(8 - digits.size(), '0') + digits;
+			};
+			std::atomic<int> next{ 0 };
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 4; t++) {
+				threads.emplace_back([&] {
+					for (int i; (i = next.fetch_add(1)) < 8000;) {
+						tree.put(data(key_of(i)), data(key_of(i)));
+						if (i % 7 == 0) tree.put(data(key_of(i / 2)), data("again"));
+					}
+				});
+			}
+			for (auto& th : threads) th.join();
+			tree.setCombining(false);
+
+			auto stats = tree.stats();
+			Assert::AreEqual(uint64_t(8000), stats.size);
+			Assert::AreEqual(uint64_t(8000 + 8000 / 7 + 1), stats.puts, L"A combined put is counted once");
+			int i = 0;
+			for (auto it = tree.begin(); it.valid(); it.next(), i++) {
+				Assert::IsTrue(parse(it.key()) == key_of(i));
+				Assert::IsTrue(*it.value() == data(key_of(i)) || *it.value() == data("again"));
+			}
+			Assert::AreEqual(8000, i);
+		}
+
+		TEST_METHOD(BPlusTreeMatchesTheRedBlackTree)
+		{
+			// Enough keys for leaves and inner pages to split several times over.
+			sync::BPlusTree tree;
+			sync::ConcurrentTree reference;
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 4; t++) {
+				threads.emplace_back([&, t] {
+					for (int i = 0; i < 5000; i++) {
+						auto key = std::to_string(i % 10) + "_" + std::to_string(t) + "_" + std::to_string(i);
+						tree.put(data(key), data(key));
+						reference.put(data(key), data(key));
+						if (i % 3 == 0) {
+							tree.erase(data(key));
+							reference.erase(data(key));
+						}
+					}
+				});
+			}
+			for (auto& th : threads) th.join();
+
+			Assert::AreEqual(reference.stats().size, tree.stats().size);
+			Assert::IsTrue(tree.stats().height > 2, L"Pages split into at least three levels");
+			auto it = reference.begin();
+			tree.scan(data(""), data("~"), [&](std::span<const unsigned char> key, const sync::Value& value) {
+				Assert::IsTrue(it.valid() && parse(it.key()) == parse(key));
+				Assert::IsTrue(*it.value() == *value);
+				it.next();
+				return true;
+			});
+			Assert::IsFalse(it.valid());
+			Assert::IsTrue(tree.get(data("3_1_3")) == tree.NULL_VALUE);
+			Assert::IsTrue(tree.get(data("4_1_4")) == data("4_1_4"));
+		}
+
+		TEST_METHOD(CapacityEvictsKeysNotFoundLately)
+		{
+			sync::ConcurrentTree tree;
+			const size_t capacity = 64 * 1024;
+			tree.setCapacity(capacity);
+			std::vector<unsigned char> value(100, 'v');
+			for (int h = 0; h < 8; h++) tree.put(bytes("hot_" + std::to_string(h)), value);
+			// Hot keys are found between every two puts, a turn of the hand always finds them referenced again.
+			for (int i = 0; i < 5000; i++) {
+				tree.put(bytes("cold_" + std::to_string(i)), value);
+				for (int h = 0; h < 8; h++) Assert::IsTrue(tree.find("hot_" + std::to_string(h)) != nullptr);
+			}
+			Assert::IsTrue(tree.footprint() <= capacity);
+			auto stats = tree.stats();
+			Assert::IsTrue(stats.evictions > 0);
+			Assert::AreEqual(stats.size, uint64_t(5008) - stats.evictions);
+
+			// Concurrent writers may overshoot by the puts in flight while another one runs the hand, not more.
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 4; t++) {
+				threads.emplace_back([&, t] {
+					for (int i = 0; i < 2000; i++) tree.put(bytes("t" + std::to_string(t) + "_" + std::to_string(i)), value);
+				});
+			}
+			for (auto& th : threads) th.join();
+			Assert::IsTrue(tree.footprint() <= capacity + 4 * 1024);
+			size_t bytes_held = 0;
+			for (auto it = tree.begin(); it.valid(); it.next()) bytes_held += it.key().size() + it.value()->size();
+			Assert::IsTrue(bytes_held < tree.footprint(), L"Accounting covers keys and values and more");
+
+			tree.setCapacity(0);
+			Assert::AreEqual(size_t(0), tree.footprint());
+		}
+
+		TEST_METHOD(ParallelForEachVisitsEveryKeyOnce)
+		{
+			sync::ConcurrentTree tree;
+			for (int i = 0; i < 20000; i++) tree.put(bytes("k" + std::to_string(i)), data(std::to_string(i)));
+			for (int i = 0; i < 20000; i += 4) tree.erase(bytes("k" + std::to_string(i)));
+			Assert::AreEqual(size_t(15000), tree.size());
+
+			// Writers put keys of their own meanwhile, the keys present throughout are visited exactly once.
+			std::atomic<bool> stop{ false };
+			std::thread writer([&] {
+				for (int i = 0; !stop.load(); i++) tree.put(bytes("w" + std::to_string(i % 5000)), data("w"));
+			});
+			std::vector<std::atomic<int>> visits(20000);
+			tree.parallelForEach([&](std::span<const unsigned char> key, const sync::Value&) {
+				std::string k = parse(key);
+				if (k[0] == 'k') visits[std::stoi(k.substr(1))]++;
+			}, 4);
+			for (int i = 0; i < 20000; i++) Assert::AreEqual(i % 4 ? 1 : 0, visits[i].load());
+
+			long long sum = tree.reduce(0ll, [](std::span<const unsigned char> key, const sync::Value& value) {
+				return key[0] == 'k' ? std::stoll(parse(*value)) : 0ll;
+			}, std::plus<long long>(), 3);
+			stop = true;
+			writer.join();
+			long long expected = 0;
+			for (int i = 0; i < 20000; i++) if (i % 4) expected += i;
+			Assert::AreEqual(expected, sum);
+
+			// Combined in key order, a non-commutative combine sees the keys sorted.
+			auto keys = tree.reduce(std::string(), [](std::span<const unsigned char> key, const sync::Value&) {
+				return parse(key).substr(0, 1);
+			}, std::plus<std::string>());
+			Assert::IsTrue(std::is_sorted(keys.begin(), keys.end()));
+			Assert::AreEqual(tree.size(), keys.size());
+			Assert::AreEqual(uint64_t(tree.size()), tree.stats().size);
+		}
+
+		TEST_METHOD(FenceEntersBelowTheRootAndStaysCorrect)
+		{
+			sync::ConcurrentTree tree;
+			for (int i = 0; i < 50000; i++) tree.put(bytes("k" + std::to_string(i)), data(std::to_string(i)));
+			tree.setFence(10, std::chrono::milliseconds(1));
+			for (int i = 0; i < 50000; i++) Assert::IsTrue(tree.get(bytes("k" + std::to_string(i))) == data(std::to_string(i)));
+			Assert::IsTrue(tree.stats().fence_entries > 40000, L"An unchanged tree is entered below the root");
+
+			// Inserts rotate the top levels and erases move successors up while the fence is rebuilt every millisecond.
+			std::atomic<bool> stop{ false };
+			std::vector<std::thread> threads;
+			threads.emplace_back([&] {
+				for (int i = 0; !stop.load(); i++) {
+					std::string key = "w" + std::to_string(i % 20000);
+					if (i % 3 == 2) tree.erase(bytes(key));
+					else tree.put(bytes(key), data(key));
+				}
+			});
+			for (int t = 0; t < 2; t++) {
+				threads.emplace_back([&, t] {
+					for (int round = 0; round < 3; round++) {
+						for (int i = t; i < 50000; i += 2) Assert::IsTrue(tree.find("k" + std::to_string(i)) != nullptr);
+					}
+				});
+			}
+			for (size_t i = 1; i < threads.size(); i++) threads[i].join();
+			stop = true;
+			threads[0].join();
+			for (int i = 0; i < 50000; i += 7) tree.put(bytes("k" + std::to_string(i)), data("again"));
+			tree.setFence(0);
+			int keys = 0;
+			for (auto it = tree.begin(); it.valid(); it.next()) keys += parse(it.key())[0] == 'k';
+			Assert::AreEqual(50000, keys, L"Puts entering at the fence insert no duplicates");
+		}
+
+		TEST_METHOD(ChangeFeedReplaysIntoAnEqualReplica)
+		{
+			sync::ConcurrentTree tree;
+			tree.setChangeFeed(true);
+			sync::ChangeFeed* feed = tree.changeFeed();
+			std::atomic<int> writing{ 4 };
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 4; t++) {
+				threads.emplace_back([&, t] {
+					// Overlapping keys, the replica only ends up equal if the writes to a key come in the order applied.
+					for (int i = 0; i < 6000; i++) {
+						std::string key = "k" + std::to_string((i * 7 + t) % 1500);
+						if (i % 5 == 4) tree.erase(bytes(key));
+						else tree.put(bytes(key), data(std::to_string(t) + "_" + std::to_string(i)));
+					}
+					writing--;
+				});
+			}
+
+			// Rings of 1024 changes, the writers wait on the consumer more than once.
+			sync::ConcurrentTree replica;
+			std::vector<sync::Change> batch;
+			uint64_t last = 0;
+			while (true) {
+				bool done = writing.load() == 0;
+				batch.clear();
+				feed->poll(batch, 256);
+				for (const sync::Change& change : batch) {
+					Assert::AreEqual(last + 1, change.sequence);
+					last = change.sequence;
+					if (change.value) replica.put(change.key, change.value);
+					else replica.erase(change.key);
+				}
+				if (done && batch.empty()) break;
+				if (batch.empty()) std::this_thread::yield(); // the next change is still on its way, let its writer run
+			}
+			for (auto& th : threads) th.join();
+			Assert::AreEqual(last + 1, feed->position());
+
+			auto it = tree.begin();
+			auto copy = replica.begin();
+			for (; it.valid() && copy.valid(); it.next(), copy.next()) {
+				Assert::IsTrue(parse(it.key()) == parse(copy.key()));
+				Assert::IsTrue(*it.value() == *copy.value());
+			}
+			Assert::IsTrue(!it.valid() && !copy.valid());
+		}
+
+		TEST_METHOD(EraseRemovesOnlyThatKey)
+		{
+			sync::ConcurrentTree tree;
+			for (int i = 0; i < 100; i++) {
+				auto s = std::to_string(i);
+				tree.put(data(s), data(s));
+			}
+			for (int i = 0; i < 100; i += 2) {
+				Assert::IsTrue(tree.erase(data(std::to_string(i))));
+			}
+			Assert::IsFalse(tree.erase(data("0")), L"Erasing a missing key must report false");
+			for (int i = 0; i < 100; i++) {
+				auto s = std::to_string(i);
+				if (i % 2) Assert::IsTrue(tree.get(data(s)) == data(s));
+				else Assert::IsTrue(tree.get(data(s)) == tree.NULL_VALUE);
+			}
+		}
+
+		TEST_METHOD(HeapAllocatorTreeBehavesTheSame)
+		{
+			sync::ConcurrentTree tree(std::make_unique<sync::HeapAllocator>());
+			for (int i = 0; i < 100; i++) {
+				auto s = std::to_string(i);
+				tree.put(data(s), data(s));
+			}
+			for (int i = 0; i < 100; i += 3) tree.erase(data(std::to_string(i)));
+			for (int i = 0; i < 100; i++) {
+				auto s = std::to_string(i);
+				Assert::IsTrue(tree.get(data(s)) == (i % 3 ? data(s) : tree.NULL_VALUE));
+			}
+		}
+
+		TEST_METHOD(ConcurrentPutEraseChurn_NoCrashesAndConsistent)
+		{
+			sync::ConcurrentTree tree;
+
+			const int threads = 4;
+			const int keys = 256;
+
+			// Each thread owns a disjoint key range so its final state is known.
+			auto worker = [&](int id) {
+				for (int round = 0; round < 20; round++) {
+					for (int i = 0; i < keys; i++) {
+						std::string k = "t" + std::to_string(id) + "_" + std::to_string(i);
+						tree.put(data(k), data(k));
+					}
+					for (int i = 0; i < keys; i++) {
+						std::string k = "t" + std::to_string(id) + "_" + std::to_string(i);
+						if (i % 3) tree.erase(data(k));
+					}
+				}
+			};
+
+			std::vector<std::thread> t;
+			t.reserve(threads);
+			for (int i = 0; i < threads; ++i) t.emplace_back(worker, i);
+			for (auto& thread : t) thread.join();
+
+			for (int id = 0; id < threads; ++id) {
+				for (int i = 0; i < keys; ++i) {
+					std::string k = "t" + std::to_string(id) + "_" + std::to_string(i);
+					if (i % 3) Assert::IsTrue(tree.get(data(k)) == tree.NULL_VALUE);
+					else Assert::IsTrue(tree.get(data(k)) == data(k));
+				}
+			}
+		}
+
+		TEST_METHOD(ConcurrentPutEraseOfSharedKeysTerminates)
+		{
+			// Every thread puts and erases the same few keys, so erases race to rebalance around nodes another
+			// thread erases meanwhile.
+			sync::ConcurrentTree tree;
+			std::vector<std::thread> threads;
+			for (int t = 0; t < 4; t++) {
+				threads.emplace_back([&, t] {
+					uint32_t seed = 7919u * (t + 1);
+					for (int i = 0; i < 20000; i++) {
+						seed = seed * 1103515245u + 12345u;
+						std::string k = "s" + std::to_string((seed >> 8) % 64);
+						if (seed & 0x10000) tree.erase(data(k));
+						else tree.put(data(k), data(k));
+					}
+				});
+			}
+			for (auto& thread : threads) thread.join();
+
+			size_t keys = 0;
+			std::string last;
+			for (auto it = tree.begin(); it.valid(); it.next(), keys++) {
+				Assert::IsTrue(keys == 0 || last < parse(it.key()));
+				last = parse(it.key());
+				Assert::IsTrue(*it.value() == data(last));
+			}
+			Assert::AreEqual(keys, tree.size());
+		}
+
+		TEST_METHOD(ConcurrentEraseChurnKeepsRedBlackInvariants)
+		{
+			// Erases of shared keys keep repairing around places other puts refill and other erases empty, each of
+			// them must still carry its missing BLACK all the way up.
+			for (int round = 0; round < 20; round++) {
+				sync::ConcurrentTree tree;
+				std::vector<std::thread> threads;
+				for (int t = 0; t < 4; t++) {
+					threads.emplace_back([&, t] {
+						uint32_t seed = 7919u * (t + 1) + round * 104729u;
+						for (int i = 0; i < 3000; i++) {
+							seed = seed * 1103515245u + 12345u;
+							std::string k = "s" + std::to_string((seed >> 8) % (round % 2 ? 2048 : 256));
+							if (seed & 0x10000) tree.erase(data(k));
+							else tree.put(data(k), data(k));
+						}
+					});
+				}
+				for (auto& thread : threads) thread.join();
+				Assert::IsTrue(tree.validate());
+			}
+		}
+
 	};
 }